@@ -0,0 +1,63 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ANS_COMMON_H_
+#define ANS_COMMON_H_
+
+#include <cstdint>
+
+#include "huffman_common.h"
+
+namespace himg {
+
+namespace {
+
+// The ANS coder uses the same symbols as the Huffman coder (bytes and RLE
+// tokens, see huffman_common.h), with table based ANS (tANS) coding of the
+// symbols. The probability of each symbol is quantized to a multiple of
+// 1 / kAnsTableSize, and the coding states are the kAnsTableSize slots of a
+// table where each symbol occupies as many slots as its quantized frequency.
+const int kAnsTableBits = 11;
+const int kAnsTableSize = 1 << kAnsTableBits;
+
+// Each stream is coded with this many interleaved states (symbol i uses state
+// i % kAnsNumStates), so that the decoder can work on several symbols at once.
+const int kAnsNumStates = 2;
+
+// The maximum size of the frequency table (a presence bit per symbol, plus
+// kAnsTableBits bits per present symbol).
+const int kAnsMaxTableDataSize =
+    ((1 + kAnsTableBits) * kNumSymbols + 7) / 8;
+
+// Distribute the symbols over the table slots (freqs must add up to
+// kAnsTableSize). The step is odd, so all slots are visited, and it spreads
+// the slots of each symbol fairly evenly over the table.
+inline void SpreadSymbols(const int *freqs, uint16_t *slot_symbols) {
+  const int kStep = (kAnsTableSize >> 1) + (kAnsTableSize >> 3) + 3;
+  int pos = 0;
+  for (int symbol = 0; symbol < kNumSymbols; ++symbol) {
+    for (int k = 0; k < freqs[symbol]; ++k) {
+      slot_symbols[pos] = static_cast<uint16_t>(symbol);
+      pos = (pos + kStep) & (kAnsTableSize - 1);
+    }
+  }
+}
+
+// Get the position of the most significant set bit of x (x must be nonzero).
+inline int FloorLog2(uint32_t x) {
+  int result = 0;
+  while (x >>= 1)
+    ++result;
+  return result;
+}
+
+}  // namespace
+
+}  // namespace himg
+
+#endif  // ANS_COMMON_H_
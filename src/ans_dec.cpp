@@ -0,0 +1,255 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "ans_dec.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "ans_common.h"
+#include "common.h"
+#include "cpu.h"
+
+namespace himg {
+
+namespace {
+
+// The decode table has one 32-bit entry per state:
+//   Bits 0-3:   The number of bits to read for the next state.
+//   Bits 4-15:  The base of the next state (the bits that are read are added
+//               to it).
+//   Bits 16-19: The number of extra bits of an RLE token.
+//   Bit 20:     Set for RLE tokens (zero runs).
+//   Bits 21-31: The literal, or the smallest zero count of an RLE token.
+const uint32_t kEntryZeroRun = 1 << 20;
+
+inline uint32_t MakeEntry(int bits, int base, int symbol) {
+  uint32_t entry =
+      static_cast<uint32_t>(bits) | (static_cast<uint32_t>(base) << 4);
+  int extra_bits, min_zeros;
+  if (GetRleToken(symbol, &extra_bits, &min_zeros)) {
+    return entry | (static_cast<uint32_t>(extra_bits) << 16) | kEntryZeroRun |
+           (static_cast<uint32_t>(min_zeros) << 21);
+  }
+  return entry | (static_cast<uint32_t>(symbol) << 21);
+}
+
+// Decode the symbol of a state, write it to the output, and go to the next
+// state. Unless kChecked is true, the caller must make sure that the bit
+// buffer holds enough bits for the symbol (at most 25 bits), and that there
+// is room for a literal in the output.
+template <bool kChecked>
+FORCE_INLINE bool DecodeSymbol(const uint32_t *decode_table,
+                               uint32_t *state,
+                               BitStream *stream,
+                               uint8_t **out,
+                               uint8_t *out_end) {
+  const uint32_t entry = decode_table[*state];
+  const int value = static_cast<int>(entry >> 21);
+  if (LIKELY(!(entry & kEntryZeroRun))) {
+    // A literal.
+    if (kChecked && *out >= out_end)
+      return false;
+    *(*out)++ = static_cast<uint8_t>(value);
+  } else {
+    // An RLE token: A zero run (the extra bits come before the state bits).
+    const int extra_bits = static_cast<int>((entry >> 16) & 15);
+    if (kChecked && stream->bits_available() < extra_bits)
+      return false;
+    int zeros = value + static_cast<int>(stream->PeekBits(extra_bits));
+    stream->Advance(extra_bits);
+    if (UNLIKELY(zeros > out_end - *out))
+      return false;
+    std::memset(*out, 0, static_cast<size_t>(zeros));
+    *out += zeros;
+  }
+
+  const int bits = static_cast<int>(entry & 15);
+  if (kChecked && stream->bits_available() < bits)
+    return false;
+  *state = ((entry >> 4) & 0xfff) + stream->PeekBits(bits);
+  stream->Advance(bits);
+  return true;
+}
+
+}  // namespace
+
+AnsDec::AnsDec(const uint8_t *in,
+               int in_size,
+               bool use_blocks,
+               int num_substreams)
+    : EntropyDec(in, in_size, use_blocks, num_substreams),
+      m_has_table(false) {
+}
+
+bool AnsDec::Init() {
+  // Only allow Init() to run once.
+  if (m_has_table)
+    return false;
+
+  if (!InitPartial(m_in_size))
+    return false;
+
+  // All the blocks must be accounted for.
+  return FoundAllBlocks();
+}
+
+bool AnsDec::InitPartial(int available_size) {
+  m_available_size = std::min(available_size, m_in_size);
+
+  if (!m_has_table) {
+    // Wait until the entire frequency table is guaranteed to have been
+    // received.
+    if (m_available_size < std::min(m_in_size, kAnsMaxTableDataSize))
+      return true;
+    if (!DecodeFrequencies())
+      return false;
+    m_has_table = true;
+  }
+
+  // Find the blocks that have been received.
+  return FindBlocks();
+}
+
+bool AnsDec::Uncompress(uint8_t *out, int out_size) const {
+  if (m_use_blocks)
+    return false;
+  return UncompressBlock(out, out_size, 0);
+}
+
+bool AnsDec::UncompressBlock(uint8_t *out, int out_size, int block_no) const {
+  // Has Init() been run successfully?
+  Block block;
+  if (!GetBlock(block_no, &block))
+    return false;
+
+  // The substreams are uncompressed one after the other.
+  const int n = m_num_substreams;
+  BitStream streams[kMaxSubstreams];
+  if (out_size % n != 0 || !ReadSubstreams(block.data, block.size, n, streams))
+    return false;
+  const int part_size = out_size / n;
+  for (int k = 0; k < n; ++k) {
+    if (!UncompressStream(out + part_size * k, part_size, streams[k]))
+      return false;
+  }
+  return true;
+}
+
+bool AnsDec::DecodeFrequencies() {
+  // Read the symbol frequencies (a presence bit per symbol, followed by the
+  // frequency minus one for present symbols). The 64-bit refills read ahead
+  // of the table, so the stream must end where the received data ends.
+  BitStream stream(m_in, m_available_size);
+  int freqs[kNumSymbols];
+  int sum = 0;
+  for (int k = 0; k < kNumSymbols; ++k) {
+    freqs[k] = 0;
+    if (stream.ReadBits(1))
+      freqs[k] = static_cast<int>(stream.ReadBits(kAnsTableBits)) + 1;
+    sum += freqs[k];
+  }
+  if (stream.read_failed() || sum != kAnsTableSize)
+    return false;
+
+  // Build the decode table. The j:th slot (in table order) of a symbol with
+  // frequency f corresponds to the encoder state x = f + j. Reading the bits
+  // that the encoder wrote for x gives the previous state.
+  uint16_t slot_symbols[kAnsTableSize];
+  SpreadSymbols(freqs, slot_symbols);
+  for (int slot = 0; slot < kAnsTableSize; ++slot) {
+    const int symbol = slot_symbols[slot];
+    const int x = freqs[symbol]++;
+    const int bits = kAnsTableBits - FloorLog2(static_cast<uint32_t>(x));
+    m_decode_table[slot] =
+        MakeEntry(bits, (x << bits) - kAnsTableSize, symbol);
+  }
+
+  // The blocks start at the first byte after the table.
+  stream.AlignToByte();
+  m_next_block_ptr = stream.byte_ptr();
+  return true;
+}
+
+bool AnsDec::UncompressStream(uint8_t *out,
+                              int out_size,
+                              BitStream stream) const {
+#if CPU_DISPATCH_X86
+  static const bool kUseBMI2 = CPU::HasBMI2();
+  if (kUseBMI2)
+    return UncompressStreamBMI2(out, out_size, stream);
+#endif
+  return UncompressStreamDefault(out, out_size, stream);
+}
+
+// The same code, compiled for different instruction sets (with BMI2, the
+// variable shifts and masks of the bit reader become SHRX and BZHI).
+bool AnsDec::UncompressStreamDefault(uint8_t *out,
+                                     int out_size,
+                                     BitStream stream) const {
+  return UncompressStreamImpl(out, out_size, stream);
+}
+
+#if CPU_DISPATCH_X86
+TARGET_BMI2 bool AnsDec::UncompressStreamBMI2(uint8_t *out,
+                                              int out_size,
+                                              BitStream stream) const {
+  return UncompressStreamImpl(out, out_size, stream);
+}
+#endif
+
+FORCE_INLINE bool AnsDec::UncompressStreamImpl(uint8_t *out,
+                                               int out_size,
+                                               BitStream bits) const {
+  uint8_t *out_end = out + out_size;
+
+  // The stream starts with the initial states (kAnsNumStates = 2).
+  bits.Refill();
+  if (bits.bits_available() < 2 * kAnsTableBits)
+    return false;
+  uint32_t state_0 = bits.PeekBits(kAnsTableBits);
+  bits.Advance(kAnsTableBits);
+  uint32_t state_1 = bits.PeekBits(kAnsTableBits);
+  bits.Advance(kAnsTableBits);
+
+  // We do the majority of the decoding in a fast loop, that decodes one
+  // symbol with each state per refill (at most 2 * 25 bits). The two states
+  // are independent, so the CPU can overlap their table lookups.
+  int next_state = 0;
+  while (out_end - out >= 2 && bits.HasSlack()) {
+    bits.Refill();
+    if (UNLIKELY(!DecodeSymbol<false>(
+            m_decode_table, &state_0, &bits, &out, out_end))) {
+      return false;
+    }
+    if (UNLIKELY(out == out_end)) {
+      next_state = 1;
+      break;
+    }
+    if (UNLIKELY(!DecodeSymbol<false>(
+            m_decode_table, &state_1, &bits, &out, out_end))) {
+      return false;
+    }
+  }
+
+  // ...and we do the tail of the decoding in a slower, checked loop.
+  uint32_t states[2] = {state_0, state_1};
+  while (out < out_end) {
+    bits.Refill();
+    if (!DecodeSymbol<true>(
+            m_decode_table, &states[next_state], &bits, &out, out_end)) {
+      return false;
+    }
+    next_state ^= 1;
+  }
+
+  // The encoder starts from state zero, so that is where we should end up.
+  return states[0] == 0 && states[1] == 0 && bits.AtTheEnd();
+}
+
+}  // namespace himg
@@ -0,0 +1,63 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ANS_DEC_H_
+#define ANS_DEC_H_
+
+#include <cstdint>
+
+#include "entropy_common.h"
+#include "entropy_dec.h"
+
+namespace himg {
+
+class AnsDec : public EntropyDec {
+ public:
+  // If use_blocks is true, the stream is divided into several blocks that
+  // can be uncompressed independently (see UncompressBlock()). If
+  // num_substreams is greater than one, each block is made up of that many
+  // substreams (see AnsEnc::Compress()).
+  AnsDec(const uint8_t *in, int in_size, bool use_blocks, int num_substreams);
+
+  // Decode the ANS data preamble (the symbol frequencies).
+  bool Init() override;
+
+  // Decode as much as possible of the ANS data preamble (the symbol
+  // frequencies and the block sizes), given that only the first
+  // available_size bytes of the stream have been received so far.
+  bool InitPartial(int available_size) override;
+
+  bool Uncompress(uint8_t *out, int out_size) const override;
+  bool UncompressBlock(uint8_t *out,
+                       int out_size,
+                       int block_no) const override;
+  using EntropyDec::UncompressBlock;
+
+ private:
+  // The number of decoding states (kAnsTableSize).
+  static const int kTableSize = 1 << 11;
+
+  bool DecodeFrequencies();
+  bool UncompressStream(uint8_t *out, int out_size, BitStream stream) const;
+  bool UncompressStreamDefault(uint8_t *out,
+                               int out_size,
+                               BitStream stream) const;
+  bool UncompressStreamBMI2(uint8_t *out,
+                            int out_size,
+                            BitStream stream) const;
+  bool UncompressStreamImpl(uint8_t *out, int out_size, BitStream stream) const;
+
+  // Each entry of the decode table gives the symbol of a state, and how to
+  // get the next state (see ans_dec.cpp).
+  uint32_t m_decode_table[kTableSize];
+  bool m_has_table;
+};
+
+}  // namespace himg
+
+#endif  // ANS_DEC_H_
@@ -0,0 +1,289 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "ans_enc.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "ans_common.h"
+#include "entropy_common.h"
+
+namespace himg {
+
+namespace {
+
+// A symbol of the stream, and the extra bits that follow it (for RLE tokens).
+struct Token {
+  Symbol symbol;
+  int extra_bits;
+  uint32_t extra_value;
+};
+
+// A group of bits that is written to the stream.
+struct BitGroup {
+  uint32_t value;
+  int bits;
+};
+
+// Split a part of the input data into tokens (the same RLE scheme as
+// HuffmanEnc).
+void Tokenize(const uint8_t *in, int size, std::vector<Token> *tokens) {
+  tokens->clear();
+  for (int k = 0; k < size;) {
+    Token token;
+    token.symbol = static_cast<Symbol>(in[k]);
+    token.extra_bits = 0;
+    token.extra_value = 0;
+
+    // Possible RLE?
+    int zeros = 1;
+    if (token.symbol == 0) {
+      for (; zeros < 16662 && (k + zeros) < size; ++zeros) {
+        if (in[k + zeros] != 0)
+          break;
+      }
+      if (zeros > 1) {
+        token.symbol =
+            GetZeroRunToken(zeros, &token.extra_bits, &token.extra_value);
+      }
+    }
+    tokens->push_back(token);
+    k += zeros;
+  }
+}
+
+// Quantize the symbol counts to frequencies that add up to kAnsTableSize (all
+// symbols that occur get a nonzero frequency).
+void NormalizeFrequencies(const int *counts, int *freqs) {
+  int64_t total = 0;
+  for (int k = 0; k < kNumSymbols; ++k)
+    total += counts[k];
+
+  // Start with the rounded down frequencies.
+  int sum = 0;
+  for (int k = 0; k < kNumSymbols; ++k) {
+    freqs[k] = 0;
+    if (counts[k] > 0) {
+      int64_t freq = (static_cast<int64_t>(counts[k]) * kAnsTableSize) / total;
+      freqs[k] = std::max(1, static_cast<int>(freq));
+    }
+    sum += freqs[k];
+  }
+
+  // Adjust the frequencies one step at a time, picking the symbol that gives
+  // the smallest increase (or the largest decrease) of the coded size.
+  while (sum != kAnsTableSize) {
+    int best = -1;
+    double best_gain = 0.0;
+    for (int k = 0; k < kNumSymbols; ++k) {
+      if (counts[k] == 0 || (sum > kAnsTableSize && freqs[k] == 1))
+        continue;
+      int new_freq = sum < kAnsTableSize ? freqs[k] + 1 : freqs[k] - 1;
+      double gain =
+          counts[k] * std::log2(static_cast<double>(new_freq) / freqs[k]);
+      if (best < 0 || gain > best_gain) {
+        best = k;
+        best_gain = gain;
+      }
+    }
+    if (sum < kAnsTableSize) {
+      ++freqs[best];
+      ++sum;
+    } else {
+      --freqs[best];
+      --sum;
+    }
+  }
+}
+
+// The encoding tables.
+struct EncodeTable {
+  // For each symbol: The frequency, floor(log2(frequency)), and the index of
+  // the first state of the symbol in states[].
+  int freq[kNumSymbols];
+  int freq_log2[kNumSymbols];
+  int first[kNumSymbols];
+
+  // The states (kAnsTableSize + slot), grouped by symbol.
+  uint16_t states[kAnsTableSize];
+};
+
+void MakeEncodeTable(const int *freqs, EncodeTable *table) {
+  int next[kNumSymbols];
+  int first = 0;
+  for (int k = 0; k < kNumSymbols; ++k) {
+    table->freq[k] = freqs[k];
+    table->freq_log2[k] = freqs[k] > 0 ? FloorLog2(freqs[k]) : 0;
+    table->first[k] = first;
+    next[k] = first;
+    first += freqs[k];
+  }
+
+  // The j:th slot (in table order) of a symbol with frequency f is the state
+  // that the decoder maps to the encoder state f + j.
+  uint16_t slot_symbols[kAnsTableSize];
+  SpreadSymbols(freqs, slot_symbols);
+  for (int slot = 0; slot < kAnsTableSize; ++slot) {
+    table->states[next[slot_symbols[slot]]++] =
+        static_cast<uint16_t>(kAnsTableSize + slot);
+  }
+}
+
+// Write the symbol frequencies to the stream.
+void WriteFrequencies(const int *freqs, OutBitstream *stream) {
+  for (int k = 0; k < kNumSymbols; ++k) {
+    if (freqs[k] > 0) {
+      stream->WriteBits(1, 1);
+      stream->WriteBits(static_cast<uint32_t>(freqs[k] - 1), kAnsTableBits);
+    } else {
+      stream->WriteBits(0, 1);
+    }
+  }
+}
+
+// Encode a stream of tokens. Returns the size of the encoded data, in bytes.
+//
+// ANS works like a stack: The decoder gets the symbols in the reverse order
+// of the encoder. Therefore we encode the tokens backwards, collecting the
+// bits in reverse order, and then write the final states followed by the
+// collected bits (last one first), so that the decoder can read the stream
+// forwards.
+int EncodeStream(uint8_t *out,
+                 const std::vector<Token> &tokens,
+                 const EncodeTable &table,
+                 std::vector<BitGroup> *bit_groups) {
+  uint32_t states[kAnsNumStates];
+  for (int k = 0; k < kAnsNumStates; ++k)
+    states[k] = kAnsTableSize;
+
+  bit_groups->clear();
+  for (int i = static_cast<int>(tokens.size()) - 1; i >= 0; --i) {
+    const Token &token = tokens[i];
+    uint32_t &state = states[i % kAnsNumStates];
+
+    // The decoder reads the extra bits of a token before the state bits, so
+    // we collect them after.
+    const int freq = table.freq[token.symbol];
+    const int max_bits = kAnsTableBits - table.freq_log2[token.symbol];
+    const int bits =
+        max_bits - ((state >> max_bits) < static_cast<uint32_t>(freq) ? 1 : 0);
+    BitGroup state_bits = {state & ((1u << bits) - 1), bits};
+    bit_groups->push_back(state_bits);
+    state = table.states[table.first[token.symbol] + (state >> bits) - freq];
+    if (token.extra_bits > 0) {
+      BitGroup extra_bits = {token.extra_value, token.extra_bits};
+      bit_groups->push_back(extra_bits);
+    }
+  }
+
+  OutBitstream stream(out);
+  for (int k = 0; k < kAnsNumStates; ++k)
+    stream.WriteBits(states[k] - kAnsTableSize, kAnsTableBits);
+  for (int i = static_cast<int>(bit_groups->size()) - 1; i >= 0; --i)
+    stream.WriteBits((*bit_groups)[i].value, (*bit_groups)[i].bits);
+  stream.AlignToByte();
+  return stream.Size();
+}
+
+}  // namespace
+
+int AnsEnc::MaxCompressedSize(int uncompressed_size, int num_streams) {
+  // A symbol costs at most kAnsTableBits bits plus its extra bits, which is
+  // at most 11 bits per byte. Each stream has up to four bytes for its size,
+  // and up to four bytes for its states (plus padding).
+  return uncompressed_size + (uncompressed_size * 3 + 7) / 8 +
+         kAnsMaxTableDataSize + 8 * num_streams;
+}
+
+int AnsEnc::Compress(uint8_t *out,
+                     const uint8_t *in,
+                     int in_size,
+                     const int *block_sizes,
+                     int num_blocks,
+                     int num_substreams,
+                     int *block_offsets) {
+  // Do we have anything to compress?
+  if (in_size < 1 || num_blocks < 1 || num_substreams < 1)
+    return 0;
+  const bool use_blocks = num_blocks > 1;
+
+  // Sanity check: Do the blocks add up the the entire input buffer, and can
+  // they be split into substreams?
+  int max_block_size = 0;
+  int total_size = 0;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    if (block_sizes[block_no] < 1 || block_sizes[block_no] % num_substreams)
+      return 0;
+    max_block_size = std::max(max_block_size, block_sizes[block_no]);
+    total_size += block_sizes[block_no];
+  }
+  if (total_size != in_size)
+    return 0;
+
+  // Calculate the histogram of the tokens of all the substreams.
+  int counts[kNumSymbols] = {0};
+  std::vector<Token> tokens;
+  const uint8_t *block = in;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    const int part_size = block_sizes[block_no] / num_substreams;
+    for (int k = 0; k < num_substreams; ++k) {
+      Tokenize(block + part_size * k, part_size, &tokens);
+      for (size_t i = 0; i < tokens.size(); ++i)
+        ++counts[tokens[i].symbol];
+    }
+    block += block_sizes[block_no];
+  }
+
+  // Build the coding tables, and store the frequencies in the output stream.
+  int freqs[kNumSymbols];
+  NormalizeFrequencies(counts, freqs);
+  std::unique_ptr<EncodeTable> table(new EncodeTable);
+  MakeEncodeTable(freqs, table.get());
+  OutBitstream stream(out);
+  WriteFrequencies(freqs, &stream);
+  stream.AlignToByte();
+
+  const int max_part_size = max_block_size / num_substreams;
+  const int max_packed_part_size = MaxCompressedSize(max_part_size, 1);
+  std::vector<uint8_t> part_buffer(max_packed_part_size * num_substreams);
+  std::vector<int> packed_part_sizes(num_substreams);
+  std::vector<BitGroup> bit_groups;
+
+  // Encode input stream.
+  block = in;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    const int block_size = block_sizes[block_no];
+
+    // Encode the substreams of this block into temporary buffers, and append
+    // them to the output stream.
+    const int part_size = block_size / num_substreams;
+    for (int k = 0; k < num_substreams; ++k) {
+      Tokenize(block + part_size * k, part_size, &tokens);
+      packed_part_sizes[k] = EncodeStream(
+          &part_buffer[max_packed_part_size * k], tokens, *table, &bit_groups);
+    }
+    if (block_offsets)
+      block_offsets[block_no] = stream.Size();
+    WriteBlock(&stream,
+               use_blocks,
+               part_buffer.data(),
+               max_packed_part_size,
+               packed_part_sizes.data(),
+               num_substreams);
+
+    block += block_size;
+  }
+
+  // Calculate size of output data.
+  return stream.Size();
+}
+
+}  // namespace himg
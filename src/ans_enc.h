@@ -0,0 +1,37 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ANS_ENC_H_
+#define ANS_ENC_H_
+
+#include <cstdint>
+
+namespace himg {
+
+class AnsEnc {
+ public:
+  // Get the maximum compressed size of the input data, when it is coded as
+  // num_streams streams in total (blocks times substreams).
+  static int MaxCompressedSize(int uncompressed_size, int num_streams);
+
+  // Compress the input data as num_blocks blocks of different sizes, with
+  // num_substreams substreams per block. The stream layout is the same as for
+  // HuffmanEnc::Compress(), but the Huffman tree is replaced by a table of
+  // symbol frequencies, and each (sub)stream is coded with tANS.
+  static int Compress(uint8_t *out,
+                      const uint8_t *in,
+                      int in_size,
+                      const int *block_sizes,
+                      int num_blocks,
+                      int num_substreams = 1,
+                      int *block_offsets = nullptr);
+};
+
+}  // namespace himg
+
+#endif  // ANS_ENC_H_
@@ -0,0 +1,100 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "async_codec.h"
+
+namespace himg {
+
+AsyncCodec::AsyncCodec(int max_threads)
+    : m_own_pool(new ThreadPool(max_threads)), m_pool(m_own_pool.get()) {
+}
+
+AsyncCodec::AsyncCodec(ThreadPool *pool) : m_pool(pool) {
+}
+
+AsyncCodec::~AsyncCodec() {
+}
+
+void AsyncCodec::Decode(const uint8_t *packed_data,
+                        int packed_size,
+                        DecodeCallback done,
+                        DecodeObserver *observer) {
+  ThreadPool *pool = m_pool;
+  m_pool->Submit([pool, packed_data, packed_size, done, observer]() {
+    // The block rows are decoded by tasks in the same pool.
+    std::unique_ptr<Decoder> decoder(new Decoder());
+    decoder->SetThreadPool(pool);
+    decoder->SetObserver(observer);
+    if (!decoder->Decode(packed_data, packed_size))
+      decoder.reset();
+    done(std::move(decoder));
+  });
+}
+
+std::future<std::unique_ptr<Decoder>> AsyncCodec::DecodeFuture(
+    const uint8_t *packed_data,
+    int packed_size,
+    DecodeObserver *observer) {
+  std::shared_ptr<std::promise<std::unique_ptr<Decoder>>> promise(
+      new std::promise<std::unique_ptr<Decoder>>());
+  Decode(packed_data,
+         packed_size,
+         [promise](std::unique_ptr<Decoder> decoder) {
+           promise->set_value(std::move(decoder));
+         },
+         observer);
+  return promise->get_future();
+}
+
+void AsyncCodec::Encode(const uint8_t *data,
+                        int width,
+                        int height,
+                        int pixel_stride,
+                        int num_channels,
+                        int quality,
+                        bool use_ycbcr,
+                        EncodeCallback done) {
+  m_pool->Submit([=]() {
+    std::unique_ptr<Encoder> encoder(new Encoder());
+    if (!encoder->Encode(data,
+                         width,
+                         height,
+                         pixel_stride,
+                         num_channels,
+                         quality,
+                         use_ycbcr)) {
+      encoder.reset();
+    }
+    done(std::move(encoder));
+  });
+}
+
+std::future<std::unique_ptr<Encoder>> AsyncCodec::EncodeFuture(
+    const uint8_t *data,
+    int width,
+    int height,
+    int pixel_stride,
+    int num_channels,
+    int quality,
+    bool use_ycbcr) {
+  std::shared_ptr<std::promise<std::unique_ptr<Encoder>>> promise(
+      new std::promise<std::unique_ptr<Encoder>>());
+  Encode(data,
+         width,
+         height,
+         pixel_stride,
+         num_channels,
+         quality,
+         use_ycbcr,
+         [promise](std::unique_ptr<Encoder> encoder) {
+           promise->set_value(std::move(encoder));
+         });
+  return promise->get_future();
+}
+
+}  // namespace himg
@@ -0,0 +1,87 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ASYNC_CODEC_H_
+#define ASYNC_CODEC_H_
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "thread_pool.h"
+
+namespace himg {
+
+// Non-blocking decoding and encoding. All the work (including the full-res
+// block rows of each image) is run as tasks in a thread pool, so the calling
+// thread never waits for a decode or an encode to finish.
+//
+// The results are delivered either through a completion callback or through
+// a std::future. Callbacks (and the DecodeObserver, if any) are called from
+// the worker threads, so an event loop will typically post the result back
+// to its own thread. A future can be polled with wait_for(0) from a loop, or
+// be wrapped in an awaitable.
+class AsyncCodec {
+ public:
+  // The result is nullptr if decoding/encoding failed.
+  typedef std::function<void(std::unique_ptr<Decoder> decoder)> DecodeCallback;
+  typedef std::function<void(std::unique_ptr<Encoder> encoder)> EncodeCallback;
+
+  // Use an internal thread pool with max_threads threads (zero means one
+  // thread per hardware thread).
+  AsyncCodec(int max_threads = 0);
+
+  // Use a caller supplied thread pool, which must outlive this object and
+  // all the pending operations.
+  AsyncCodec(ThreadPool *pool);
+
+  // Pending operations on the internal thread pool are completed before the
+  // pool is destroyed.
+  ~AsyncCodec();
+
+  // Start decoding an image. The packed data must remain valid until the
+  // image has been decoded. If an observer is given, it is notified about
+  // the low-res image and about decoded rows as decoding progresses.
+  void Decode(const uint8_t *packed_data,
+              int packed_size,
+              DecodeCallback done,
+              DecodeObserver *observer = nullptr);
+  std::future<std::unique_ptr<Decoder>> DecodeFuture(
+      const uint8_t *packed_data,
+      int packed_size,
+      DecodeObserver *observer = nullptr);
+
+  // Start encoding an image (see Encoder::Encode()). The image data must
+  // remain valid until the image has been encoded.
+  void Encode(const uint8_t *data,
+              int width,
+              int height,
+              int pixel_stride,
+              int num_channels,
+              int quality,
+              bool use_ycbcr,
+              EncodeCallback done);
+  std::future<std::unique_ptr<Encoder>> EncodeFuture(const uint8_t *data,
+                                                     int width,
+                                                     int height,
+                                                     int pixel_stride,
+                                                     int num_channels,
+                                                     int quality,
+                                                     bool use_ycbcr);
+
+ private:
+  std::unique_ptr<ThreadPool> m_own_pool;
+  ThreadPool *m_pool;
+};
+
+}  // namespace himg
+
+#endif  // ASYNC_CODEC_H_
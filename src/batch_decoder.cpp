@@ -0,0 +1,136 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "batch_decoder.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace himg {
+
+namespace {
+
+// Images with at least this many pixels are split into several row tasks.
+const int64_t kMinSplitPixels = 1024 * 1024;
+
+// The number of rows per row task (must be a multiple of 8).
+const int kRowsPerTask = 64;
+
+struct RowTask {
+  int image;
+  int first_row;
+  int end_row;
+};
+
+}  // namespace
+
+// A single threaded decoder that can decode its full-res data in parts.
+class BatchDecoder::ImageDecoder : public Decoder {
+ public:
+  ImageDecoder() : Decoder(1), m_is_large(false), m_succeeded(false) {}
+
+  // Decode everything up to the full-res data, and prepare the output buffer.
+  bool Begin(const PackedImage &image) {
+    m_full_res_dec.reset();
+    m_is_large = false;
+    if (!DecodeUpToFullRes(image.data, image.size))
+      return false;
+    m_full_res_dec = InitFullResDecoder();
+    if (!m_full_res_dec)
+      return false;
+    BeginFullRes();
+    m_is_large = static_cast<int64_t>(m_width) * m_height >= kMinSplitPixels;
+    return true;
+  }
+
+  // Decode the rows [first_row, end_row) of the full-res data. Different row
+  // ranges may be decoded concurrently.
+  bool DecodeRows(int first_row, int end_row) {
+    return DecodeFullResBlockRows(*m_full_res_dec, first_row, end_row);
+  }
+
+  void End() { m_full_res_dec.reset(); }
+
+  // Is the image large enough to be split into row tasks? This is false if
+  // Begin() failed.
+  bool is_large() const { return m_is_large; }
+
+  bool succeeded() const { return m_succeeded; }
+  void set_succeeded(bool succeeded) { m_succeeded = succeeded; }
+
+ private:
+  std::unique_ptr<EntropyDec> m_full_res_dec;
+  bool m_is_large;
+  std::atomic_bool m_succeeded;
+};
+
+BatchDecoder::BatchDecoder(int max_threads)
+    : m_pool(max_threads), m_num_images(0) {
+}
+
+BatchDecoder::~BatchDecoder() {
+}
+
+bool BatchDecoder::Decode(const std::vector<PackedImage> &images) {
+  m_num_images = static_cast<int>(images.size());
+  while (static_cast<int>(m_decoders.size()) < m_num_images)
+    m_decoders.push_back(std::unique_ptr<ImageDecoder>(new ImageDecoder()));
+
+  // Decode all the image headers and low-res data, one image per task. Small
+  // images are decoded completely in the same task.
+  m_pool.ParallelFor(m_num_images, [this, &images](int i) {
+    ImageDecoder &decoder = *m_decoders[i];
+    bool success = decoder.Begin(images[i]);
+    if (success && !decoder.is_large()) {
+      success = decoder.DecodeRows(0, decoder.height());
+      decoder.End();
+    }
+    decoder.set_succeeded(success);
+  });
+
+  // Split the full-res data of the large images into row tasks.
+  std::vector<RowTask> row_tasks;
+  for (int i = 0; i < m_num_images; ++i) {
+    const ImageDecoder &decoder = *m_decoders[i];
+    if (!decoder.succeeded() || !decoder.is_large())
+      continue;
+    for (int y = 0; y < decoder.height(); y += kRowsPerTask) {
+      RowTask task;
+      task.image = i;
+      task.first_row = y;
+      task.end_row = std::min(y + kRowsPerTask, decoder.height());
+      row_tasks.push_back(task);
+    }
+  }
+
+  // Decode all the row tasks.
+  m_pool.ParallelFor(static_cast<int>(row_tasks.size()), [&](int i) {
+    const RowTask &task = row_tasks[i];
+    ImageDecoder &decoder = *m_decoders[task.image];
+    if (!decoder.DecodeRows(task.first_row, task.end_row))
+      decoder.set_succeeded(false);
+  });
+
+  bool success = true;
+  for (int i = 0; i < m_num_images; ++i) {
+    if (m_decoders[i]->is_large())
+      m_decoders[i]->End();
+    success = success && m_decoders[i]->succeeded();
+  }
+  return success;
+}
+
+bool BatchDecoder::succeeded(int i) const {
+  return m_decoders[i]->succeeded();
+}
+
+const Decoder &BatchDecoder::image(int i) const {
+  return *m_decoders[i];
+}
+
+}  // namespace himg
@@ -0,0 +1,61 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef BATCH_DECODER_H_
+#define BATCH_DECODER_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "decoder.h"
+#include "thread_pool.h"
+
+namespace himg {
+
+// A packed image (the data is not owned by this struct).
+struct PackedImage {
+  const uint8_t *data;
+  int size;
+};
+
+// A decoder for many images at a time. Rather than decoding the block rows
+// of each image in parallel (which does not pay off for small images), the
+// images themselves are spread across a pool of worker threads. Only large
+// images are split into several row tasks.
+//
+// The worker threads are kept alive between calls to Decode(), as are the
+// per-image decoders (so that their buffers can be reused).
+class BatchDecoder {
+ public:
+  BatchDecoder(int max_threads = 0);
+  ~BatchDecoder();
+
+  // Decode all the images. Returns false if any of the images could not be
+  // decoded (use succeeded() to find out which).
+  bool Decode(const std::vector<PackedImage> &images);
+
+  int num_images() const { return m_num_images; }
+
+  // Was image i successfully decoded?
+  bool succeeded(int i) const;
+
+  // The decoded image i (see Decoder::unpacked_data() etc).
+  const Decoder &image(int i) const;
+
+ private:
+  class ImageDecoder;
+
+  ThreadPool m_pool;
+  std::vector<std::unique_ptr<ImageDecoder>> m_decoders;
+  int m_num_images;
+};
+
+}  // namespace himg
+
+#endif  // BATCH_DECODER_H_
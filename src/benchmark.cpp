@@ -7,14 +7,18 @@
 //-----------------------------------------------------------------------------
 
 #include <chrono>
+#include <climits>
 #include <cstdint>
-#include <fstream>
 #include <iostream>
 
+#include <sys/resource.h>
+
 #include <FreeImage.h>
 
+#include "batch_decoder.h"
 #include "decoder.h"
 #include "encoder.h"
+#include "file_io.h"
 
 namespace {
 
@@ -22,9 +26,39 @@ const int kNumIterations = 30;
 
 enum BenchmarkMode {
   Decode,
+  StreamingDecode,
+  Verify,
+  BatchDecode,
   Encode
 };
 
+// A row sink that just touches the decoded data.
+class ChecksumSink : public himg::RowSink {
+ public:
+  ChecksumSink() : m_checksum(0) {}
+
+  bool ConsumeRows(const himg::Decoder &decoder,
+                   const uint8_t *rows,
+                   int /* first_row */,
+                   int num_rows) override {
+    const int size = num_rows * decoder.width() * decoder.num_channels();
+    for (int i = 0; i < size; ++i)
+      m_checksum += rows[i];
+    return true;
+  }
+
+ private:
+  uint32_t m_checksum;
+};
+
+// Get the peak resident set size of the process (in KB).
+long MaxRSS() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return -1;
+  return usage.ru_maxrss;
+}
+
 class TimeMeasure {
  public:
   void Start() { m_start = std::chrono::system_clock::now(); }
@@ -41,35 +75,30 @@ class TimeMeasure {
   std::chrono::system_clock::time_point m_start;
 };
 
-bool IsHimg(const std::vector<uint8_t> &buffer) {
-  return buffer.size() >= 12 && buffer[0] == 'R' && buffer[1] == 'I' &&
-         buffer[2] == 'F' && buffer[3] == 'F' && buffer[8] == 'H' &&
-         buffer[9] == 'I' && buffer[10] == 'M' && buffer[11] == 'G';
+bool IsHimg(const himg::InputFile &file) {
+  const uint8_t *buffer = file.data();
+  return file.size() >= 12 && file.size() <= INT_MAX && buffer[0] == 'R' &&
+         buffer[1] == 'I' && buffer[2] == 'F' && buffer[3] == 'F' &&
+         buffer[8] == 'H' && buffer[9] == 'I' && buffer[10] == 'M' &&
+         buffer[11] == 'G';
 }
 
 void ShowUsage(const char *arg0) {
-  std::cout << "Usage: " << arg0 << " [-d][-e] image" << std::endl;
+  std::cout << "Usage: " << arg0 << " [-d][-s][-v][-b][-e] image [image ...]" << std::endl;
   std::cout << "  -d Decode (default)" << std::endl;
+  std::cout << "  -s Streaming decode (HIMG only)" << std::endl;
+  std::cout << "  -v Verify (HIMG only)" << std::endl;
+  std::cout << "  -b Batch decode all the images (HIMG only)" << std::endl;
   std::cout << "  -e Encode" << std::endl;
 }
 
-bool LoadFile(const std::string &file_name, std::vector<uint8_t> *buffer) {
-  // Open file.
-  std::ifstream f(file_name.c_str(), std::ifstream::in | std::ofstream::binary);
-  if (!f.good()) {
+bool LoadFile(const std::string &file_name, himg::InputFile *file) {
+  // Map the file (or read it into memory).
+  if (!file->Open(file_name.c_str())) {
     std::cout << "Unable to read file " << file_name << std::endl;
     return false;
   }
-
-  // Get file size.
-  f.seekg(0, std::ifstream::end);
-  int file_size = static_cast<int>(f.tellg());
-  f.seekg(0, std::ifstream::beg);
-  std::cout << "File size: " << file_size << std::endl;
-
-  // Read the file data into our buffer.
-  buffer->resize(file_size);
-  f.read(reinterpret_cast<char *>(buffer->data()), file_size);
+  std::cout << "File size: " << file->size() << std::endl;
 
   return true;
 }
@@ -79,33 +108,56 @@ bool LoadFile(const std::string &file_name, std::vector<uint8_t> *buffer) {
 int main(int argc, const char **argv) {
   // Parse arguments.
   BenchmarkMode benchmark_mode = Decode;
-  std::string file_name;
+  std::vector<std::string> file_names;
   for (int i = 1; i < argc; ++i) {
     const char *arg = argv[i];
     if (arg[0] == '-' && arg[1] != 0 && arg[2] == 0) {
       if (arg[1] == 'd')
         benchmark_mode = Decode;
+      else if (arg[1] == 's')
+        benchmark_mode = StreamingDecode;
+      else if (arg[1] == 'v')
+        benchmark_mode = Verify;
+      else if (arg[1] == 'b')
+        benchmark_mode = BatchDecode;
       else if (arg[1] == 'e')
         benchmark_mode = Encode;
-    } else if (file_name.empty()) {
-      file_name = std::string(arg);
     } else {
-      ShowUsage(argv[0]);
-      return 0;
+      file_names.push_back(std::string(arg));
     }
   }
 
-  if (file_name.empty()) {
+  // Only batch decoding accepts more than one image.
+  if (file_names.empty() ||
+      (file_names.size() > 1 && benchmark_mode != BatchDecode)) {
     ShowUsage(argv[0]);
     return 0;
   }
 
-  // Load the data from a file into memory.
-  std::vector<uint8_t> buffer;
-  LoadFile(file_name, &buffer);
+  // Load the data from the files into memory.
+  std::vector<himg::InputFile> buffers(file_names.size());
+  for (size_t i = 0; i < file_names.size(); ++i)
+    LoadFile(file_names[i], &buffers[i]);
+  const std::string &file_name = file_names[0];
+  const himg::InputFile &buffer = buffers[0];
+  const int buffer_size = IsHimg(buffer) ? static_cast<int>(buffer.size()) : 0;
+
+  // Count the total number of pixels in all HIMG images.
+  std::vector<himg::PackedImage> packed_images;
+  double megapixels = 0.0;
+  for (const auto &b : buffers) {
+    himg::ImageInfo info;
+    const int size = IsHimg(b) ? static_cast<int>(b.size()) : 0;
+    if (size > 0 && himg::Decoder::Probe(b.data(), size, &info)) {
+      himg::PackedImage packed_image = {b.data(), size};
+      packed_images.push_back(packed_image);
+      megapixels += static_cast<double>(info.width) * info.height * 1e-6;
+    }
+  }
 
   FreeImage_Initialise();
   himg::Decoder himg_decoder;
+  himg::BatchDecoder batch_decoder;
 
   double min_dt = -1.0, max_dt = -1.0, total_t = 0.0;
   for (int iteration = 1; iteration <= kNumIterations; ++iteration) {
@@ -119,21 +171,45 @@ int main(int argc, const char **argv) {
       // Decode the image.
       if (IsHimg(buffer)) {
         // Use the HIMG decoder.
-        if (!himg_decoder.Decode(buffer.data(), buffer.size())) {
+        if (!himg_decoder.Decode(buffer.data(), buffer_size)) {
           std::cout << "Unable to decode image." << std::endl;
           return -1;
         }
       } else {
         // Use FreeImage to decode.
         // TODO(m): Add support for other decoders (libjpeg-turbo!).
-        FIMEMORY *mem = FreeImage_OpenMemory(static_cast<BYTE *>(buffer.data()),
-                                             buffer.size());
+        FIMEMORY *mem =
+            FreeImage_OpenMemory(const_cast<BYTE *>(buffer.data()),
+                                 static_cast<DWORD>(buffer.size()));
         FREE_IMAGE_FORMAT format =
             FreeImage_GetFIFFromFilename(file_name.c_str());
         FIBITMAP *bitmap = FreeImage_LoadFromMemory(format, mem);
         FreeImage_Unload(bitmap);
         FreeImage_CloseMemory(mem);
       }
+    } else if (benchmark_mode == StreamingDecode) {
+      // Decode the image, a few rows at a time.
+      ChecksumSink sink;
+      if (!IsHimg(buffer) ||
+          !himg_decoder.DecodeStreaming(buffer.data(), buffer_size, &sink)) {
+        std::cout << "Unable to decode image." << std::endl;
+        return -1;
+      }
+    } else if (benchmark_mode == Verify) {
+      // Verify the image data, without decoding it.
+      himg::VerifyError error;
+      if (!IsHimg(buffer) ||
+          !himg_decoder.Verify(buffer.data(), buffer_size, &error)) {
+        std::cout << "Invalid image: " << error.message << std::endl;
+        return -1;
+      }
+    } else if (benchmark_mode == BatchDecode) {
+      // Decode all the images in one batch.
+      if (packed_images.size() != buffers.size() ||
+          !batch_decoder.Decode(packed_images)) {
+        std::cout << "Unable to decode images." << std::endl;
+        return -1;
+      }
     } else {
       // TODO(m): Implement me!
     }
@@ -152,6 +228,11 @@ int main(int argc, const char **argv) {
   std::cout << "    Min: " << min_dt << " ms\n";
   std::cout << "    Max: " << max_dt << " ms\n";
   std::cout << "Average: " << average << " ms\n";
+  if (benchmark_mode != Encode && megapixels > 0.0) {
+    std::cout << "Throughput: " << (megapixels * 1000.0 / average)
+              << " MP/s\n";
+  }
+  std::cout << "Max RSS: " << MaxRSS() << " KB\n";
 
   FreeImage_DeInitialise();
 
@@ -8,14 +8,15 @@
 
 #include <cstdint>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
 #include <FreeImage.h>
 
+#include "common.h"
 #include "encoder.h"
+#include "file_io.h"
 
 namespace {
 
@@ -36,6 +37,11 @@ bool ArgToInt(const char *arg, int *result) {
 struct Options {
   Options() {
     use_ycbcr = true;
+    blocked_low_res = false;
+    channel_blocks = false;
+    interleaved = false;
+    ans = false;
+    block_index = false;
     quality = kDefaultQuality;
     input_file = nullptr;
     output_file = nullptr;
@@ -52,6 +58,16 @@ struct Options {
         // Parse options (starting with '-').
         if (std::strcmp(arg, "-rgb") == 0) {
           use_ycbcr = false;
+        } else if (std::strcmp(arg, "-blocked-lres") == 0) {
+          blocked_low_res = true;
+        } else if (std::strcmp(arg, "-channel-blocks") == 0) {
+          channel_blocks = true;
+        } else if (std::strcmp(arg, "-interleaved") == 0) {
+          interleaved = true;
+        } else if (std::strcmp(arg, "-ans") == 0) {
+          ans = true;
+        } else if (std::strcmp(arg, "-index") == 0) {
+          block_index = true;
         } else if (std::strcmp(arg, "-q") == 0) {
           if (k + 1 < argc && ArgToInt(argv[++k], &quality)) {
             success = quality >= 0 && quality <= 100;
@@ -73,8 +89,24 @@ struct Options {
     if (!success || file_names.size() != 2) {
       std::cout << "Usage: " << argv[0] << " [options] image outfile\n";
       std::cout << "Options:\n";
-      std::cout << " -q <quality> Set the quality (0-100)\n";
-      std::cout << " -rgb         Use RGB color space (instead of YCbCr)\n";
+      std::cout << " -q <quality>    Set the quality (0-100)\n";
+      std::cout << " -rgb            Use RGB color space (instead of YCbCr)\n";
+      std::cout << " -blocked-lres   Split the low-res data into independent "
+                   "blocks (faster\n"
+                   "                 to decode, requires format version 2)\n";
+      std::cout << " -channel-blocks Split the full-res data into blocks per "
+                   "channel and\n"
+                   "                 segment (for wide or many-channel "
+                   "images, requires\n"
+                   "                 format version 2)\n";
+      std::cout << " -interleaved    Code the full-res data as interleaved "
+                   "substreams (faster\n"
+                   "                 to decode, requires format version 2)\n";
+      std::cout << " -ans            Use ANS entropy coding instead of "
+                   "Huffman coding\n"
+                   "                 (requires format version 2)\n";
+      std::cout << " -index          Write a block index (faster random "
+                   "access to the blocks)\n";
       return false;
     }
 
@@ -85,6 +117,11 @@ struct Options {
   }
 
   bool use_ycbcr;
+  bool blocked_low_res;
+  bool channel_blocks;
+  bool interleaved;
+  bool ans;
+  bool block_index;
   int quality;
   const char *input_file;
   const char *output_file;
@@ -100,17 +137,28 @@ int main(int argc, const char **argv) {
 
   FreeImage_Initialise();
 
-  // Load the source image using FreeImage.
+  // Load the source image using FreeImage (from the mapped file).
   int num_channels;
   FIBITMAP *bitmap;
   {
-    FREE_IMAGE_FORMAT format = FreeImage_GetFileType(options.input_file);
+    himg::InputFile source_file;
+    if (!source_file.Open(options.input_file) ||
+        source_file.size() > 0xffffffffLL) {
+      std::cerr << "Unable to load " << options.input_file << std::endl;
+      return -1;
+    }
+    FIMEMORY *mem = FreeImage_OpenMemory(
+        const_cast<BYTE *>(source_file.data()),
+        static_cast<DWORD>(source_file.size()));
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileTypeFromMemory(mem);
     if (format == FIF_UNKNOWN) {
       std::cerr << "Unknown file format for " << options.input_file
                 << std::endl;
+      FreeImage_CloseMemory(mem);
       return -1;
     }
-    FIBITMAP *bitmap_tmp = FreeImage_Load(format, options.input_file);
+    FIBITMAP *bitmap_tmp = FreeImage_LoadFromMemory(format, mem);
+    FreeImage_CloseMemory(mem);
     if (!bitmap_tmp) {
       std::cerr << "Unable to load " << options.input_file << std::endl;
       return -1;
@@ -138,6 +186,17 @@ int main(int argc, const char **argv) {
 
   // Encode the image.
   himg::Encoder encoder;
+  uint8_t format_flags = 0;
+  if (options.blocked_low_res)
+    format_flags |= himg::kFormatBlockedLowRes;
+  if (options.channel_blocks)
+    format_flags |= himg::kFormatChannelBlocks;
+  if (options.interleaved)
+    format_flags |= himg::kFormatInterleavedFullRes;
+  if (options.ans)
+    format_flags |= himg::kFormatAnsCoding;
+  encoder.SetFormatFlags(format_flags);
+  encoder.SetWriteBlockIndex(options.block_index);
   {
     int width = FreeImage_GetWidth(bitmap);
     int height = FreeImage_GetHeight(bitmap);
@@ -156,11 +215,12 @@ int main(int argc, const char **argv) {
   FreeImage_Unload(bitmap);
 
   // Write packed data to a file.
-  {
-    std::ofstream f(options.output_file,
-                    std::ofstream::out | std::ofstream::binary);
-    f.write(reinterpret_cast<const char *>(encoder.packed_data()),
-            encoder.packed_size());
+  if (!himg::OutputFile::Write(options.output_file,
+                               encoder.packed_data(),
+                               encoder.packed_size())) {
+    std::cerr << "Unable to write " << options.output_file << std::endl;
+    FreeImage_DeInitialise();
+    return -1;
   }
 
   FreeImage_DeInitialise();
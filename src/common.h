@@ -20,6 +20,15 @@
 # define UNLIKELY(expr) (expr)
 #endif
 
+// Inlining and aliasing macros.
+#if defined(__GNUC__)
+# define FORCE_INLINE inline __attribute__((always_inline))
+# define RESTRICT __restrict__
+#else
+# define FORCE_INLINE inline
+# define RESTRICT
+#endif
+
 // Alignment macros.
 #if defined(__GNUC__)
 #define ASSUME_ALIGNED16(x) __builtin_assume_aligned(x, 16)
@@ -33,6 +42,55 @@ namespace himg {
 // Indexing of an 8x8 block.
 extern const uint8_t kIndexLUT[64];
 
+// Optional format features, stored as flags in the FRMT chunk. Images that use
+// any of them are stored as format version 2 (which has a flags byte), and
+// other images as version 1.
+const uint8_t kFormatBlockedLowRes = 0x01;  // One LRES block per macro row.
+const uint8_t kFormatChannelBlocks = 0x02;  // FRES blocks per channel/segment.
+const uint8_t kFormatInterleavedFullRes = 0x04;  // FRES blocks as substreams.
+const uint8_t kFormatAnsCoding = 0x08;  // LRES/FRES use ANS instead of Huffman.
+const uint8_t kFormatSupportedFlags = kFormatBlockedLowRes |
+                                      kFormatChannelBlocks |
+                                      kFormatInterleavedFullRes |
+                                      kFormatAnsCoding;
+
+// The entropy coders of the LRES and FRES chunks (see EntropyEnc and
+// EntropyDec). Both use the same symbols and the same block layout.
+enum EntropyCoder { kEntropyHuffman, kEntropyAns };
+
+// With kFormatChannelBlocks, each block row of the full-res data is split into
+// segments of this many blocks (the last segment may be narrower), and there
+// is one Huffman block per block row, segment and channel, in that order.
+const int kFullResSegmentWidth = 64;
+
+// With kFormatInterleavedFullRes, each full-res Huffman block is coded as this
+// many substreams (see HuffmanEnc::Compress()).
+const int kFullResSubstreams = 2;
+
+// The rows (coefficient planes) of a Huffman block are distributed over the
+// substreams in a round robin fashion, and the rows of each substream are
+// stored one after the other. Get the storage index of a row.
+inline int SubstreamRowIndex(int row, int num_rows, int num_substreams) {
+  return (row % num_substreams) * (num_rows / num_substreams) +
+         row / num_substreams;
+}
+
+// The 32-bit RIFF code of a four character name (e.g. a chunk name).
+inline uint32_t ToFourcc(const char name[4]) {
+  return static_cast<uint32_t>(name[0]) |
+         (static_cast<uint32_t>(name[1]) << 8) |
+         (static_cast<uint32_t>(name[2]) << 16) |
+         (static_cast<uint32_t>(name[3]) << 24);
+}
+
+// Read a 32-bit little endian value (as used by RIFF).
+inline uint32_t Read32(const uint8_t *data) {
+  return static_cast<uint32_t>(data[0]) |
+         (static_cast<uint32_t>(data[1]) << 8) |
+         (static_cast<uint32_t>(data[2]) << 16) |
+         (static_cast<uint32_t>(data[3]) << 24);
+}
+
 // Clamp a 16-bit value to an 8-bit unsigned value.
 inline uint8_t ClampTo8Bit(int16_t x) {
   return x >= 0 ? (x <= 255 ? static_cast<uint8_t>(x) : 255) : 0;
@@ -0,0 +1,54 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "cpu.h"
+
+namespace himg {
+
+bool CPU::HasSSE2() {
+#if CPU_DISPATCH_X86
+  return __builtin_cpu_supports("sse2");
+#else
+  return false;
+#endif
+}
+
+bool CPU::HasSSSE3() {
+#if CPU_DISPATCH_X86
+  return __builtin_cpu_supports("ssse3");
+#else
+  return false;
+#endif
+}
+
+bool CPU::HasAVX2() {
+#if CPU_DISPATCH_X86
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+bool CPU::HasAVX512() {
+#if CPU_DISPATCH_X86
+  return __builtin_cpu_supports("avx512f") &&
+         __builtin_cpu_supports("avx512bw");
+#else
+  return false;
+#endif
+}
+
+bool CPU::HasBMI2() {
+#if CPU_DISPATCH_X86
+  return __builtin_cpu_supports("bmi2");
+#else
+  return false;
+#endif
+}
+
+}  // namespace himg
@@ -0,0 +1,45 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef CPU_H_
+#define CPU_H_
+
+// Runtime dispatch to functions that are compiled for a specific instruction
+// set (using the target attribute) is only supported for x86 with GCC/Clang.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH_X86 1
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#define TARGET_BMI2 __attribute__((target("bmi2")))
+#else
+#define CPU_DISPATCH_X86 0
+#define TARGET_SSE2
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define TARGET_BMI2
+#endif
+
+namespace himg {
+
+// Runtime CPU feature detection.
+class CPU {
+ public:
+  static bool HasSSE2();
+  static bool HasSSSE3();
+  static bool HasAVX2();
+  // AVX-512 F and BW (TARGET_AVX512).
+  static bool HasAVX512();
+  static bool HasBMI2();
+};
+
+}  // namespace himg
+
+#endif  // CPU_H_
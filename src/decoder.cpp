@@ -10,35 +10,199 @@
 
 #include <algorithm>
 #include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "downsampled.h"
 #include "hadamard.h"
 #include "mapper.h"
 #include "quantize.h"
+#include "thread_pool.h"
 #include "ycbcr.h"
 
 namespace himg {
 
 namespace {
 
-uint32_t ToFourcc(const char name[4]) {
-  return static_cast<uint32_t>(name[0]) |
-         (static_cast<uint32_t>(name[1]) << 8) |
-         (static_cast<uint32_t>(name[2]) << 16) |
-         (static_cast<uint32_t>(name[3]) << 24);
+// With kFormatChannelBlocks, the generic block row decoder decodes the
+// channels of a segment in groups of this many channels (the first group must
+// hold all the color channels).
+const int kChannelGroupSize = 4;
+
+// Scratch memory for Decoder::DecodeFullResBlockRowImpl(). There is one per
+// thread, and it is kept between calls, so that decoding a block row does not
+// allocate memory (the buffers only grow).
+struct BlockRowScratch {
+  std::vector<int16_t> buffers;
+  std::vector<int16_t> planes;
+  std::vector<uint8_t> last_nonzero;
+};
+
+BlockRowScratch &GetBlockRowScratch() {
+  static thread_local BlockRowScratch scratch;
+  return scratch;
+}
+
+// Get at least size elements of a scratch buffer (the contents are not
+// initialized).
+template <typename T>
+T *GrowScratch(std::vector<T> *buffer, size_t size) {
+  if (buffer->size() < size)
+    buffer->resize(size);
+  return buffer->data();
+}
+
+// Check that the data starts with a RIFF HIMG header of the correct size.
+bool ParseRIFFStart(const uint8_t *data, int size) {
+  if (size < 12)
+    return false;
+
+  if (Read32(&data[0]) != ToFourcc("RIFF"))
+    return false;
+
+  uint32_t file_size = Read32(&data[4]);
+  if (file_size != static_cast<uint32_t>(size - 8))
+    return false;
+
+  if (Read32(&data[8]) != ToFourcc("HIMG"))
+    return false;
+
+  return true;
+}
+
+// Read a RIFF chunk header at data[*idx], and advance *idx to the chunk data.
+// Returns false if the entire chunk is not within the data.
+bool ParseRIFFChunk(const uint8_t *data,
+                    int size,
+                    int *idx,
+                    uint32_t *fourcc,
+                    int *chunk_size) {
+  if ((*idx + 8) > size)
+    return false;
+
+  *fourcc = Read32(&data[*idx]);
+  uint32_t size32 = Read32(&data[*idx + 4]);
+  *idx += 8;
+  if (size32 > static_cast<uint32_t>(size - *idx))
+    return false;
+  *chunk_size = static_cast<int>(size32);
+  return true;
+}
+
+// Find the next RIFF chunk with the given fourcc, starting at data[*idx]. On
+// success, *idx is advanced to the chunk data.
+bool FindRIFFChunkIn(const uint8_t *data,
+                     int size,
+                     int *idx,
+                     uint32_t fourcc,
+                     int *chunk_size) {
+  uint32_t chunk_fourcc;
+  int size_of_chunk;
+  while (ParseRIFFChunk(data, size, idx, &chunk_fourcc, &size_of_chunk)) {
+    // Did we find the requested chunk?
+    if (chunk_fourcc == fourcc) {
+      *chunk_size = size_of_chunk;
+      return true;
+    }
+
+    // Unrecognized chunk. Skip to the next one.
+    *idx += size_of_chunk;
+  }
+
+  // We didn't find the chunk.
+  return false;
+}
+
+// Parse a block table of the BIDX chunk: The number of blocks, followed by
+// the offset of each block. The number of blocks must be zero (no index) or
+// num_blocks.
+bool ParseBlockIndex(const uint8_t **ptr,
+                     const uint8_t *end,
+                     int num_blocks,
+                     std::vector<int> *offsets) {
+  if (end - *ptr < 4)
+    return false;
+  const uint32_t count = Read32(*ptr);
+  *ptr += 4;
+  if (count == 0)
+    return true;
+  if (count != static_cast<uint32_t>(num_blocks) ||
+      static_cast<uint32_t>(end - *ptr) / 4 < count) {
+    return false;
+  }
+  offsets->resize(count);
+  for (uint32_t k = 0; k < count; ++k) {
+    const uint32_t offset = Read32(*ptr);
+    *ptr += 4;
+    if (offset > static_cast<uint32_t>(INT_MAX))
+      return false;
+    (*offsets)[k] = static_cast<int>(offset);
+  }
+  return true;
 }
 
+// Parse the contents of the FRMT chunk.
+bool ParseHeader(const uint8_t *chunk_data, int chunk_size, ImageInfo *info) {
+  info->version = 0;
+
+  // Check the header size.
+  if (chunk_size < 11)
+    return false;
+
+  // Check version.
+  info->version = static_cast<int>(chunk_data[0]);
+  if (info->version != 1 && info->version != 2)
+    return false;
+
+  // Get image dimensions.
+  info->width = static_cast<int>(Read32(&chunk_data[1]));
+  info->height = static_cast<int>(Read32(&chunk_data[5]));
+  info->num_channels = static_cast<int>(chunk_data[9]);
+  info->use_ycbcr = chunk_data[10] != 0;
+
+  // The image (padded to whole blocks) must fit in the decode buffers, which
+  // are indexed with ints.
+  if (info->width < 1 || info->height < 1 || info->num_channels < 1)
+    return false;
+  const int64_t padded_width = (static_cast<int64_t>(info->width) + 7) & ~7;
+  const int64_t padded_height = (static_cast<int64_t>(info->height) + 7) & ~7;
+  if (padded_width * padded_height * info->num_channels > INT_MAX)
+    return false;
+
+  // Version 2 adds the format flags.
+  info->format_flags = 0;
+  if (info->version >= 2) {
+    if (chunk_size < 12)
+      return false;
+    info->format_flags = static_cast<int>(chunk_data[11]);
+  }
+
+  return true;
+}
+
+// Write one channel of a block to an interleaved image. If kPixelStride is
+// non-zero, it overrides pixel_stride (so that it is known at compile time).
+template <int kPixelStride>
 void RestoreChannelBlock(uint8_t *out,
                          const int16_t *in,
                          int pixel_stride,
                          int row_stride,
                          int block_width,
                          int block_height) {
+  if (kPixelStride > 0)
+    pixel_stride = kPixelStride;
   for (int y = 0; y < block_height; y++) {
     if (LIKELY(block_width == 8)) {
       // Fast path.
@@ -61,36 +225,327 @@ void RestoreChannelBlock(uint8_t *out,
         out += 4 * pixel_stride;
       }
     } else {
-      // Slow path.
-      for (int y = 0; y < block_height; y++) {
-        for (int x = 0; x < block_width; x++) {
-          *out = ClampTo8Bit(*in++);
-          out += pixel_stride;
-        }
-        in += 8 - block_width;
+      // Slow path (partial block at the right edge of the image).
+      for (int x = 0; x < block_width; x++) {
+        *out = ClampTo8Bit(*in++);
+        out += pixel_stride;
       }
+      in += 8 - block_width;
     }
     out += row_stride - (pixel_stride * block_width);
   }
 }
 
+#if defined(__SSE2__)
+// Squeeze four r g b 0 pixels into twelve r g b bytes (the four upper bytes of
+// the result are undefined).
+inline __m128i PackRGB0(__m128i x) {
+  // Move every other pixel down one byte (within each 64-bit lane)...
+  const __m128i kLowPixel = _mm_set1_epi64x(0x0000000000ffffffLL);
+  const __m128i kHighPixel = _mm_set1_epi64x(0x00ffffff00000000LL);
+  x = _mm_or_si128(_mm_and_si128(x, kLowPixel),
+                   _mm_srli_epi64(_mm_and_si128(x, kHighPixel), 8));
+
+  // ...and move the upper lane down two bytes.
+  const __m128i kLowLane = _mm_set_epi32(0, 0, 0x0000ffff, -1);
+  return _mm_or_si128(_mm_and_si128(x, kLowLane),
+                      _mm_andnot_si128(kLowLane, _mm_srli_si128(x, 2)));
+}
+#endif
+
+// Write all the channels of a block to an interleaved image, with clamping.
+// The input holds kNumChannels consecutive planes of 8x8 values.
+template <int kNumChannels>
+void StoreBlock(uint8_t *out,
+                const int16_t *in,
+                int row_stride,
+                int block_width,
+                int block_height) {
+#if defined(__SSE2__)
+  if ((kNumChannels == 1 || kNumChannels == 3 || kNumChannels == 4) &&
+      LIKELY(block_width == 8)) {
+    for (int y = 0; y < block_height; ++y) {
+      const __m128i *row = reinterpret_cast<const __m128i *>(&in[y * 8]);
+      if (kNumChannels == 1) {
+        __m128i c = _mm_packus_epi16(_mm_load_si128(row), _mm_setzero_si128());
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out), c);
+      } else if (kNumChannels == 4) {
+        // Clamp and interleave (r0 g0 b0 a0 r1 g1 ...) in registers.
+        __m128i rg = _mm_packus_epi16(_mm_load_si128(row),
+                                      _mm_load_si128(row + 8));
+        __m128i ba = _mm_packus_epi16(_mm_load_si128(row + 16),
+                                      _mm_load_si128(row + 24));
+        rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+        ba = _mm_unpacklo_epi8(ba, _mm_srli_si128(ba, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                         _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16),
+                         _mm_unpackhi_epi16(rg, ba));
+      } else if (kNumChannels == 3) {
+        // Clamp and interleave to r g b 0 quadruples in registers (as for
+        // four channels), and then squeeze out the zero bytes.
+        __m128i rg = _mm_packus_epi16(_mm_load_si128(row),
+                                      _mm_load_si128(row + 8));
+        __m128i b = _mm_packus_epi16(_mm_load_si128(row + 16),
+                                     _mm_setzero_si128());
+        rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+        b = _mm_unpacklo_epi8(b, _mm_setzero_si128());
+        __m128i p0 = PackRGB0(_mm_unpacklo_epi16(rg, b));
+        __m128i p1 = PackRGB0(_mm_unpackhi_epi16(rg, b));
+
+        // Store 24 bytes (the last store must not write past the block).
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), p0);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 12), p1);
+        int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(p1, 8));
+        std::memcpy(out + 20, &last, 4);
+      }
+      out += row_stride;
+    }
+    return;
+  }
+#endif
+
+  for (int y = 0; y < block_height; ++y) {
+    for (int x = 0; x < block_width; ++x) {
+      for (int chan = 0; chan < kNumChannels; ++chan)
+        out[x * kNumChannels + chan] = ClampTo8Bit(in[chan * 64 + y * 8 + x]);
+    }
+    out += row_stride;
+  }
+}
+
 }  // namespace
 
-Decoder::Decoder(int max_threads) {
+// Decodes the macro rows of blocked low-res data (see kFormatBlockedLowRes).
+// Each macro row is decoded at most once: the first thread that needs it
+// decodes it, and other threads that need it wait until it is done. This lets
+// full-res block rows start as soon as the low-res rows that they depend on
+// are available, rather than waiting for the entire low-res image.
+class Decoder::LowResRows {
+ public:
+  LowResRows(Decoder &decoder,
+             std::unique_ptr<EntropyDec> entropy_dec,
+             int num_macro_rows)
+      : m_decoder(decoder),
+        m_entropy_dec(std::move(entropy_dec)),
+        m_num_macro_rows(num_macro_rows),
+        m_states(new std::atomic<int>[num_macro_rows]) {
+    for (int i = 0; i < num_macro_rows; ++i)
+      m_states[i].store(kPending, std::memory_order_relaxed);
+  }
+
+  // Make sure that the given macro row has been decoded (may be called
+  // concurrently).
+  bool Ensure(int macro_row) {
+    int state = m_states[macro_row].load(std::memory_order_acquire);
+    if (state == kDone)
+      return true;
+
+    // Try to claim the macro row, and decode it.
+    if (state == kPending &&
+        m_states[macro_row].compare_exchange_strong(
+            state, kDecoding, std::memory_order_acquire)) {
+      bool success = m_decoder.DecodeLowResMacroRow(*m_entropy_dec, macro_row);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_states[macro_row].store(success ? kDone : kFailed,
+                                  std::memory_order_release);
+      }
+      m_row_done.notify_all();
+      return success;
+    }
+
+    // Another thread is decoding the macro row. Wait for it to finish.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_row_done.wait(lock, [this, macro_row]() {
+      return m_states[macro_row].load(std::memory_order_acquire) >= kDone;
+    });
+    return m_states[macro_row].load(std::memory_order_acquire) == kDone;
+  }
+
+  // Make sure that the low-res rows that are needed by the full-res block row
+  // v (i.e. low-res rows v and v + 1) have been decoded.
+  bool EnsureBlockRow(int v) {
+    const int last_row = std::min(v + 1, m_decoder.low_res_height() - 1);
+    const int first_macro_row = Downsampled::MacroRow(v);
+    const int last_macro_row = Downsampled::MacroRow(last_row);
+    for (int m = first_macro_row; m <= last_macro_row; ++m) {
+      if (!Ensure(m))
+        return false;
+    }
+    return true;
+  }
+
+  // Decode all the macro rows, using several threads if possible (one task
+  // per macro row if we have a thread pool).
+  bool DecodeAll(ThreadPool *thread_pool, int max_threads) {
+    std::atomic_bool success(true);
+    RunParallel(
+        thread_pool, m_num_macro_rows, max_threads, [this, &success](int m) {
+          if (success && !Ensure(m))
+            success = false;
+        });
+    return success;
+  }
+
+ private:
+  // Macro row states (a decoded row is either done or failed).
+  enum { kPending, kDecoding, kDone, kFailed };
+
+  Decoder &m_decoder;
+  std::unique_ptr<EntropyDec> m_entropy_dec;
+  const int m_num_macro_rows;
+  std::unique_ptr<std::atomic<int>[]> m_states;
+  std::mutex m_mutex;
+  std::condition_variable m_row_done;
+};
+
+// Keeps track of completed block rows and forwards them to a DecodeObserver.
+// In ordered mode, rows are reported strictly top to bottom: each worker marks
+// its row in a lock free completion bitmap, and whichever worker manages to
+// grab the reporting flag reports all consecutive completed rows.
+class Decoder::RowReporter {
+ public:
+  RowReporter(const Decoder &decoder, DecodeObserver *observer, bool in_order)
+      : m_decoder(decoder),
+        m_observer(observer),
+        m_in_order(in_order),
+        m_num_block_rows((decoder.height() + 7) >> 3),
+        m_completed(new std::atomic<uint32_t>[(m_num_block_rows + 31) >> 5]),
+        m_reporting(false),
+        m_next_row(0) {
+    for (int i = 0; i < (m_num_block_rows + 31) >> 5; ++i)
+      m_completed[i].store(0, std::memory_order_relaxed);
+  }
+
+  // Called (possibly concurrently) when block row v has been decoded.
+  void BlockRowDone(int v) {
+    if (!m_in_order) {
+      Report(v, v + 1);
+      return;
+    }
+
+    // Mark the block row as completed.
+    m_completed[v >> 5].fetch_or(1u << (v & 31));
+
+    ReportCompletedRows();
+  }
+
+  // Report any completed rows that have not been reported yet. Called when
+  // the decoding of a range of rows has ended (no BlockRowDone() calls are in
+  // progress).
+  void Flush() {
+    if (m_in_order)
+      ReportCompletedRows();
+  }
+
+ private:
+  // Try to become the reporting thread. If another thread is currently
+  // reporting, it will pick up our row (or we will, after it is done).
+  //
+  // NOTE: All the operations on m_completed and m_reporting must be
+  // sequentially consistent. Otherwise the release of m_reporting may be
+  // reordered after the final IsCompleted() check, and a row that is
+  // completed by a thread that fails to grab m_reporting in between would
+  // never be reported.
+  void ReportCompletedRows() {
+    while (!m_reporting.exchange(true)) {
+      int first = m_next_row;
+      int row = first;
+      while (row < m_num_block_rows && IsCompleted(row))
+        ++row;
+      if (row > first) {
+        Report(first, row);
+        m_next_row = row;
+      }
+      m_reporting.store(false);
+
+      // A row may have been completed while we were reporting.
+      if (row >= m_num_block_rows || !IsCompleted(row))
+        break;
+    }
+  }
+
+  bool IsCompleted(int v) const {
+    return (m_completed[v >> 5].load() & (1u << (v & 31))) != 0;
+  }
+
+  void Report(int first_block_row, int end_block_row) {
+    int first_row = first_block_row * 8;
+    int end_row = std::min(end_block_row * 8, m_decoder.height());
+    m_observer->RowsReady(m_decoder, first_row, end_row - first_row);
+  }
+
+  const Decoder &m_decoder;
+  DecodeObserver *m_observer;
+  const bool m_in_order;
+  const int m_num_block_rows;
+  std::unique_ptr<std::atomic<uint32_t>[]> m_completed;
+  std::atomic_bool m_reporting;
+  int m_next_row;
+};
+
+Decoder::Decoder(int max_threads)
+    : m_thread_pool(nullptr),
+      m_block_row_decoder(&Decoder::DecodeFullResBlockRowImpl<0, false>),
+      m_channel_group_size(1),
+      m_observer(nullptr),
+      m_in_order(false),
+      m_defer_low_res(false),
+      m_format_flags(0) {
   if (max_threads <= 0) {
-    m_max_threads = std::thread::hardware_concurrency();
+    m_max_threads = std::max(1u, std::thread::hardware_concurrency());
   } else {
     m_max_threads = max_threads;
   }
 }
 
+Decoder::~Decoder() {
+}
+
 bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
+  if (!DecodeUpToFullRes(packed_data, packed_size, true))
+    return false;
+
+  // Full resolution data (this also completes any deferred low-res data).
+  bool success = DecodeFullRes();
+  m_low_res_rows.reset();
+  if (!success) {
+    std::cout << "Error decoding full-res data.\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool Decoder::DecodeStreaming(const uint8_t *packed_data,
+                              int packed_size,
+                              RowSink *sink) {
+  if (!DecodeUpToFullRes(packed_data, packed_size, true))
+    return false;
+
+  // Full resolution data (this also completes any deferred low-res data).
+  bool success = DecodeFullResStreaming(sink);
+  m_low_res_rows.reset();
+  if (!success) {
+    std::cout << "Error decoding full-res data.\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool Decoder::DecodeUpToFullRes(const uint8_t *packed_data,
+                                int packed_size,
+                                bool defer_low_res) {
   m_packed_data = packed_data;
   m_packed_size = packed_size;
   m_packed_idx = 0;
+  m_defer_low_res = defer_low_res;
 
   m_unpacked_data.clear();
   m_downsampled.clear();
+  m_low_res_rows.reset();
 
   // Check that this is a RIFF HIMG file.
   if (!DecodeRIFFStart()) {
@@ -104,6 +559,12 @@ bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
     return false;
   }
 
+  // Block index (optional).
+  if (!DecodeBlockIndex()) {
+    std::cout << "Error decoding block index.\n";
+    return false;
+  }
+
   // Low resolution mapping table.
   if (!DecodeLowResMappingFunction()) {
     std::cout << "Error decoding low-res mapping function.\n";
@@ -128,36 +589,176 @@ bool Decoder::Decode(const uint8_t *packed_data, int packed_size) {
     return false;
   }
 
-  // Full resolution data.
-  if (!DecodeFullRes()) {
-    std::cout << "Error decoding full-res data.\n";
+  return true;
+}
+
+bool Decoder::Verify(const uint8_t *packed_data,
+                     int packed_size,
+                     VerifyError *error) {
+  m_packed_data = packed_data;
+  m_packed_size = packed_size;
+  m_packed_idx = 0;
+
+  m_unpacked_data.clear();
+  m_downsampled.clear();
+  m_low_res_rows.reset();
+
+  error->message.clear();
+  error->chunk.clear();
+  error->offset = -1;
+  error->block_row = -1;
+
+  // Check that this is a RIFF HIMG file.
+  if (!DecodeRIFFStart())
+    return VerifyFailed(error, "RIFF", 0, "Not a RIFF HIMG file.");
+
+  // Header data.
+  int chunk_offset = m_packed_idx;
+  if (!DecodeHeader())
+    return VerifyFailed(error, "FRMT", chunk_offset, "Invalid header.");
+
+  // Block index (optional).
+  if (!DecodeBlockIndex())
+    return VerifyFailed(error, "BIDX", -1, "Invalid block index.");
+
+  // Low resolution mapping table.
+  chunk_offset = m_packed_idx;
+  if (!DecodeLowResMappingFunction()) {
+    return VerifyFailed(
+        error, "LMAP", chunk_offset, "Invalid low-res mapping function.");
+  }
+
+  // Lowres data (Huffman data only).
+  chunk_offset = m_packed_idx;
+  if (!VerifyLowRes())
+    return VerifyFailed(error, "LRES", chunk_offset, "Invalid low-res data.");
+
+  // Quantization table.
+  chunk_offset = m_packed_idx;
+  if (!DecodeQuantizationConfig()) {
+    return VerifyFailed(
+        error, "QCFG", chunk_offset, "Invalid quantization configuration.");
+  }
+
+  // Full resolution mapping table.
+  chunk_offset = m_packed_idx;
+  if (!DecodeFullResMappingFunction()) {
+    return VerifyFailed(
+        error, "FMAP", chunk_offset, "Invalid full-res mapping function.");
+  }
+
+  // Full resolution data (Huffman data only).
+  return VerifyFullRes(error);
+}
+
+bool Decoder::Probe(const uint8_t *packed_data,
+                    int packed_size,
+                    ImageInfo *info,
+                    bool get_chunk_sizes) {
+  info->low_res_size = -1;
+  info->full_res_size = -1;
+
+  // Check that this is a RIFF HIMG file.
+  if (!ParseRIFFStart(packed_data, packed_size))
+    return false;
+  int idx = 12;
+
+  // Parse the header.
+  int chunk_size;
+  if (!FindRIFFChunkIn(packed_data, packed_size, &idx, ToFourcc("FRMT"),
+                       &chunk_size) ||
+      !ParseHeader(&packed_data[idx], chunk_size, info)) {
     return false;
   }
+  idx += chunk_size;
+
+  // Optionally walk the remaining chunk headers to get the data sizes.
+  if (get_chunk_sizes) {
+    uint32_t fourcc;
+    while (ParseRIFFChunk(packed_data, packed_size, &idx, &fourcc,
+                          &chunk_size)) {
+      if (fourcc == ToFourcc("LRES"))
+        info->low_res_size = chunk_size;
+      else if (fourcc == ToFourcc("FRES"))
+        info->full_res_size = chunk_size;
+      idx += chunk_size;
+    }
+  }
 
   return true;
 }
 
-bool Decoder::HasChroma() const {
-  return m_use_ycbcr && m_num_channels >= 3;
+void Decoder::SetObserver(DecodeObserver *observer, bool in_order) {
+  m_observer = observer;
+  m_in_order = in_order;
 }
 
-bool Decoder::DecodeRIFFStart() {
-  if (m_packed_size < 12)
-    return false;
+void Decoder::SetThreadPool(ThreadPool *pool) {
+  m_thread_pool = pool;
+}
 
-  if (m_packed_data[0] != 'R' || m_packed_data[1] != 'I' ||
-      m_packed_data[2] != 'F' || m_packed_data[3] != 'F')
-    return false;
+int Decoder::NumWorkerThreads() const {
+  return m_thread_pool ? m_thread_pool->num_threads() : m_max_threads;
+}
 
-  int file_size = static_cast<int>(m_packed_data[4]) |
-                  (static_cast<int>(m_packed_data[5]) << 8) |
-                  (static_cast<int>(m_packed_data[6]) << 16) |
-                  (static_cast<int>(m_packed_data[7]) << 24);
-  if (file_size + 8 != m_packed_size)
-    return false;
+int Decoder::low_res_width() const {
+  return (m_width + 7) >> 3;
+}
+
+int Decoder::low_res_height() const {
+  return (m_height + 7) >> 3;
+}
+
+void Decoder::GetLowResImage(uint8_t *out) const {
+  const int lr_width = low_res_width();
+  const int lr_height = low_res_height();
+
+  // Interleave the low-res samples of all channels.
+  for (int chan = 0; chan < m_num_channels; ++chan) {
+    const uint8_t *src = m_downsampled[chan].data();
+    uint8_t *dst = out + chan;
+    for (int i = 0; i < lr_width * lr_height; ++i) {
+      *dst = *src++;
+      dst += m_num_channels;
+    }
+  }
+
+  if (HasChroma())
+    YCbCr::YCbCrToRGB(out, lr_width, lr_height, m_num_channels);
+}
+
+void Decoder::GetUpsampledLowResImage(uint8_t *out) const {
+  int16_t lowres[64];
+  for (int y = 0; y < m_height; y += 8) {
+    int v = y >> 3;
+    int block_height = std::min(8, m_height - y);
+    for (int chan = 0; chan < m_num_channels; ++chan) {
+      const Downsampled &downsampled = m_downsampled[chan];
+      for (int x = 0; x < m_width; x += 8) {
+        int u = x >> 3;
+        int block_width = std::min(8, m_width - x);
+        downsampled.GetLowresBlock(lowres, u, v);
+        RestoreChannelBlock<0>(
+            &out[(y * m_width + x) * m_num_channels + chan],
+            lowres,
+            m_num_channels,
+            m_width * m_num_channels,
+            block_width,
+            block_height);
+      }
+    }
+  }
+
+  if (HasChroma())
+    YCbCr::YCbCrToRGB(out, m_width, m_height, m_num_channels);
+}
+
+bool Decoder::HasChroma() const {
+  return m_use_ycbcr && m_num_channels >= 3;
+}
 
-  if (m_packed_data[8] != 'H' || m_packed_data[9] != 'I' ||
-      m_packed_data[10] != 'M' || m_packed_data[11] != 'G')
+bool Decoder::DecodeRIFFStart() {
+  if (!ParseRIFFStart(m_packed_data, m_packed_size))
     return false;
 
   m_packed_idx += 12;
@@ -173,32 +774,60 @@ bool Decoder::DecodeHeader() {
   const uint8_t *chunk_data = &m_packed_data[m_packed_idx];
   m_packed_idx += chunk_size;
 
-  // Check the header size.
-  if (chunk_size < 11)
+  ImageInfo info;
+  if (!ParseHeader(chunk_data, chunk_size, &info)) {
+    if (info.version != 0 && info.version != 1 && info.version != 2)
+      std::cout << "Incorrect HIMG version number.\n";
     return false;
-
-  // Check version.
-  uint8_t version = chunk_data[0];
-  if (version != 1) {
-    std::cout << "Incorrect HIMG version number.\n";
+  }
+  if ((info.format_flags & ~kFormatSupportedFlags) != 0) {
+    std::cout << "Unsupported HIMG format features.\n";
     return false;
   }
 
-  // Get image dimensions.
-  m_width = static_cast<int>(chunk_data[1]) |
-            (static_cast<int>(chunk_data[2]) << 8) |
-            (static_cast<int>(chunk_data[3]) << 16) |
-            (static_cast<int>(chunk_data[4]) << 24);
-  m_height = static_cast<int>(chunk_data[5]) |
-             (static_cast<int>(chunk_data[6]) << 8) |
-             (static_cast<int>(chunk_data[7]) << 16) |
-             (static_cast<int>(chunk_data[8]) << 24);
-  m_num_channels = static_cast<int>(chunk_data[9]);
-  m_use_ycbcr = chunk_data[10] != 0;
+  m_width = info.width;
+  m_height = info.height;
+  m_num_channels = info.num_channels;
+  m_use_ycbcr = info.use_ycbcr;
+  m_format_flags = static_cast<uint8_t>(info.format_flags);
+  SelectBlockRowDecoder();
 
   return true;
 }
 
+bool Decoder::DecodeBlockIndex() {
+  m_low_res_block_index.clear();
+  m_full_res_block_index.clear();
+
+  // The BIDX chunk is optional, and it follows the FRES chunk (the encoder
+  // writes it once all the blocks have been coded). Look for it without
+  // moving past the other chunks.
+  int idx = m_packed_idx;
+  int chunk_size;
+  if (!FindRIFFChunkIn(
+          m_packed_data, m_packed_size, &idx, ToFourcc("BIDX"), &chunk_size)) {
+    return true;
+  }
+
+  // The chunk holds the block table of the LRES data, followed by the block
+  // table of the FRES data. Data without blocks has an empty table.
+  const int num_rows = (m_height + 7) >> 3;
+  const int num_macro_rows = Downsampled::NumMacroRows(num_rows);
+  const int num_low_res_blocks =
+      (m_format_flags & kFormatBlockedLowRes) && num_macro_rows > 1
+          ? num_macro_rows
+          : 0;
+  const int num_full_res_blocks =
+      UseFullResBlocks() ? num_rows * NumFullResBlocksPerRow() : 0;
+  const uint8_t *ptr = &m_packed_data[idx];
+  const uint8_t *end = ptr + chunk_size;
+  return ParseBlockIndex(
+             &ptr, end, num_low_res_blocks, &m_low_res_block_index) &&
+         ParseBlockIndex(
+             &ptr, end, num_full_res_blocks, &m_full_res_block_index) &&
+         ptr == end;
+}
+
 bool Decoder::DecodeLowResMappingFunction() {
   // Find the LMAP chunk.
   int chunk_size;
@@ -217,36 +846,146 @@ bool Decoder::DecodeLowRes() {
   if (!FindRIFFChunk(ToFourcc("LRES"), &chunk_size))
     return false;
 
-  // Prepare a buffer for all channels.
   const int num_rows = (m_height + 7) >> 3;
   const int num_cols = (m_width + 7) >> 3;
-  const int channel_size =
-      Downsampled::BlockDataSizePerChannel(num_rows, num_cols);
-  const int unpacked_size = channel_size * m_num_channels;
-  std::vector<uint8_t> unpacked_data(unpacked_size);
 
-  // Uncompress source Huffman data.
-  HuffmanDec huffman_dec(m_packed_data + m_packed_idx, chunk_size, 0);
-  if (!huffman_dec.Init() ||
-      !huffman_dec.Uncompress(unpacked_data.data(), unpacked_size)) {
-    std::cout << "Error: Invalid Huffman data.\n";
+  if (m_format_flags & kFormatBlockedLowRes) {
+    // Blocked layout: Recover the Huffman tree and the block table (one block
+    // per macro row).
+    const int num_macro_rows = Downsampled::NumMacroRows(num_rows);
+    std::unique_ptr<EntropyDec> entropy_dec = CreateEntropyDec(
+        m_packed_data + m_packed_idx, chunk_size, num_macro_rows > 1);
+    entropy_dec->SetBlockIndex(m_low_res_block_index);
+    if (!entropy_dec->Init() ||
+        entropy_dec->NumAvailableBlocks() != num_macro_rows) {
+      std::cout << "Error: Invalid entropy coded data.\n";
+      return false;
+    }
+    m_packed_idx += chunk_size;
+
+    // Allocate the downsampled version of each channel.
+    for (int chan = 0; chan < m_num_channels; ++chan) {
+      m_downsampled.push_back(Downsampled());
+      m_downsampled.back().InitBlockData(num_rows, num_cols);
+    }
+    m_low_res_rows.reset(
+        new LowResRows(*this, std::move(entropy_dec), num_macro_rows));
+
+    // Unless the macro rows can be decoded on demand during full-res
+    // decoding, decode them all now (in parallel).
+    if (m_defer_low_res && !m_observer)
+      return true;
+    bool success = m_low_res_rows->DecodeAll(m_thread_pool, m_max_threads);
+    m_low_res_rows.reset();
+    if (!success) {
+      std::cout << "Error: Invalid entropy coded data.\n";
+      return false;
+    }
+  } else {
+    // Prepare a buffer for all channels.
+    const int channel_size =
+        Downsampled::BlockDataSizePerChannel(num_rows, num_cols);
+    const int unpacked_size = channel_size * m_num_channels;
+    std::vector<uint8_t> unpacked_data(unpacked_size);
+
+    // Uncompress source Huffman data.
+    std::unique_ptr<EntropyDec> entropy_dec =
+        CreateEntropyDec(m_packed_data + m_packed_idx, chunk_size, false);
+    if (!entropy_dec->Init() ||
+        !entropy_dec->Uncompress(unpacked_data.data(), unpacked_size)) {
+      std::cout << "Error: Invalid entropy coded data.\n";
+      return false;
+    }
+    m_packed_idx += chunk_size;
+
+    // Initialize the downsampled version of each channel.
+    for (int chan = 0; chan < m_num_channels; ++chan) {
+      m_downsampled.push_back(Downsampled());
+      Downsampled &downsampled = m_downsampled.back();
+      downsampled.SetBlockData(unpacked_data.data() + channel_size * chan,
+                               num_rows,
+                               num_cols,
+                               m_low_res_mapper);
+    }
+  }
+
+  // The low-res image is now available for previews.
+  if (m_observer)
+    m_observer->LowResReady(*this);
+
+  return true;
+}
+
+bool Decoder::DecodeLowResMacroRow(const EntropyDec &entropy_dec,
+                                   int macro_row) {
+  // Uncompress the Huffman block of this macro row (all channels).
+  const int num_rows = (m_height + 7) >> 3;
+  const int num_cols = (m_width + 7) >> 3;
+  const int macro_row_size =
+      Downsampled::MacroRowDataSize(num_rows, num_cols, macro_row);
+  std::vector<uint8_t> unpacked_data(macro_row_size * m_num_channels);
+  if (!entropy_dec.UncompressBlock(
+          unpacked_data.data(), unpacked_data.size(), macro_row)) {
     return false;
   }
-  m_packed_idx += chunk_size;
 
-  // Initialize the downsampled version of each channel.
+  // Reconstruct the samples of this macro row.
   for (int chan = 0; chan < m_num_channels; ++chan) {
-    m_downsampled.push_back(Downsampled());
-    Downsampled &downsampled = m_downsampled.back();
-    downsampled.SetBlockData(unpacked_data.data() + channel_size * chan,
-                             num_rows,
-                             num_cols,
-                             m_low_res_mapper);
+    m_downsampled[chan].SetMacroRowData(
+        unpacked_data.data() + macro_row_size * chan,
+        macro_row,
+        m_low_res_mapper);
   }
 
   return true;
 }
 
+bool Decoder::VerifyLowRes() {
+  // Find the LRES chunk.
+  int chunk_size;
+  if (!FindRIFFChunk(ToFourcc("LRES"), &chunk_size))
+    return false;
+
+  // Uncompress the Huffman data (the samples are not reconstructed).
+  const int num_rows = (m_height + 7) >> 3;
+  const int num_cols = (m_width + 7) >> 3;
+  if (m_format_flags & kFormatBlockedLowRes) {
+    // Blocked layout: One block per macro row.
+    const int num_macro_rows = Downsampled::NumMacroRows(num_rows);
+    std::unique_ptr<EntropyDec> entropy_dec = CreateEntropyDec(
+        m_packed_data + m_packed_idx, chunk_size, num_macro_rows > 1);
+    entropy_dec->SetBlockIndex(m_low_res_block_index);
+    if (!entropy_dec->Init() ||
+        entropy_dec->NumAvailableBlocks() != num_macro_rows) {
+      return false;
+    }
+    std::vector<uint8_t> unpacked_data;
+    for (int m = 0; m < num_macro_rows; ++m) {
+      unpacked_data.resize(
+          Downsampled::MacroRowDataSize(num_rows, num_cols, m) *
+          m_num_channels);
+      if (!entropy_dec->UncompressBlock(
+              unpacked_data.data(), unpacked_data.size(), m)) {
+        return false;
+      }
+    }
+  } else {
+    const int unpacked_size =
+        Downsampled::BlockDataSizePerChannel(num_rows, num_cols) *
+        m_num_channels;
+    std::vector<uint8_t> unpacked_data(unpacked_size);
+    std::unique_ptr<EntropyDec> entropy_dec =
+        CreateEntropyDec(m_packed_data + m_packed_idx, chunk_size, false);
+    if (!entropy_dec->Init() ||
+        !entropy_dec->Uncompress(unpacked_data.data(), unpacked_size)) {
+      return false;
+    }
+  }
+  m_packed_idx += chunk_size;
+
+  return true;
+}
+
 bool Decoder::DecodeQuantizationConfig() {
   // Find the QCFG chunk.
   int chunk_size;
@@ -268,196 +1007,666 @@ bool Decoder::DecodeFullResMappingFunction() {
   m_packed_idx += chunk_size;
 
   // Restore the mapping function.
-  return m_full_res_mapper.SetMappingFunction(chunk_data, chunk_size);
+  if (!m_full_res_mapper.SetMappingFunction(chunk_data, chunk_size))
+    return false;
+
+  // The dequantization tables depend on both the quantization configuration
+  // and the mapping function.
+  m_quantize.InitUnpackLuts(m_full_res_mapper);
+  return true;
 }
 
-bool Decoder::DecodeFullRes() {
+std::unique_ptr<EntropyDec> Decoder::CreateEntropyDec(
+    const uint8_t *in, int in_size, bool use_blocks, int num_substreams) const {
+  const EntropyCoder coder =
+      (m_format_flags & kFormatAnsCoding) ? kEntropyAns : kEntropyHuffman;
+  return EntropyDec::Create(coder, in, in_size, use_blocks, num_substreams);
+}
+
+std::unique_ptr<EntropyDec> Decoder::InitFullResDecoder() {
   // Find the FRES chunk.
   int chunk_size;
   if (!FindRIFFChunk(ToFourcc("FRES"), &chunk_size))
-    return false;
+    return nullptr;
+
+  // Prepare uncompression of the Huffman data (there is one Huffman block per
+  // block row, unless the image only has a single block row).
+  std::unique_ptr<EntropyDec> entropy_dec =
+      CreateEntropyDec(m_packed_data + m_packed_idx,
+                       chunk_size,
+                       UseFullResBlocks(),
+                       NumFullResSubstreams());
+  entropy_dec->SetBlockIndex(m_full_res_block_index);
+  if (!entropy_dec->Init()) {
+    std::cout << "Error: Invalid entropy coded data.\n";
+    return nullptr;
+  }
+  m_packed_idx += chunk_size;
 
-  // Reserve space for the output data.
-  m_unpacked_data.resize(m_width * m_height * m_num_channels);
+  return entropy_dec;
+}
 
-  // Prepare uncompression of the Huffman data.
-  const int huffman_block_size = ((m_width + 7) >> 3) * 64 * m_num_channels;
-  HuffmanDec huffman_dec(m_packed_data + m_packed_idx, chunk_size, huffman_block_size);
-  if (!huffman_dec.Init()) {
-    std::cout << "Error: Invalid Huffman data.\n";
+bool Decoder::DecodeFullRes() {
+  std::unique_ptr<EntropyDec> entropy_dec = InitFullResDecoder();
+  if (!entropy_dec)
     return false;
-  }
-  m_packed_idx += chunk_size;
 
   // Process all the 8x8 blocks, one row at a time or several rows in parallel.
-  {
-    std::atomic_int next_row(0);
-    std::atomic_bool success(true);
+  BeginFullRes();
+  return DecodeFullResBlockRows(*entropy_dec, 0, m_height);
+}
+
+bool Decoder::DecodeFullResStreaming(RowSink *sink) {
+  std::unique_ptr<EntropyDec> entropy_dec = InitFullResDecoder();
+  if (!entropy_dec)
+    return false;
 
-    // One worker core lambda is run in each worker thread.
-    auto worker_core = [this, &huffman_dec, &next_row, &success]() {
-      while (true) {
-        int y = next_row.fetch_add(8, std::memory_order_relaxed);
-        if (y >= m_height)
-          break;
-        if (!DecodeFullResBlockRow(huffman_dec, y)) {
+  const int num_block_rows = (m_height + 7) >> 3;
+  const int band_size = m_width * 8 * m_num_channels;
+
+  // Block rows are decoded in parallel into a ring of band buffers. A worker
+  // may only start decoding a block row when its band buffer has been handed
+  // over to the sink, so there are never more than ring_size bands in memory.
+  const int worker_threads = std::min(num_block_rows, NumWorkerThreads());
+  const int ring_size = std::min(num_block_rows, 2 * worker_threads);
+  std::vector<uint8_t> bands(ring_size * band_size);
+  std::vector<bool> band_ready(ring_size, false);
+
+  std::mutex mutex;
+  std::condition_variable band_consumed;
+  int next_row = 0;        // The next block row to decode.
+  int next_to_consume = 0;  // The next block row to hand over to the sink.
+  bool consuming = false;
+  bool success = true;
+
+  // One worker core lambda is run in each worker thread.
+  auto worker_core = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (success && next_row < num_block_rows) {
+      // Claim the next block row, and wait for its band buffer to be free.
+      int v = next_row++;
+      band_consumed.wait(lock, [&]() {
+        return !success || v < next_to_consume + ring_size;
+      });
+      if (!success)
+        break;
+
+      // Decode the block row.
+      lock.unlock();
+      uint8_t *band = &bands[(v % ring_size) * band_size];
+      bool row_success = DecodeFullResBlockRow(*entropy_dec, v * 8, band);
+      lock.lock();
+      if (!row_success) {
+        success = false;
+        band_consumed.notify_all();
+        break;
+      }
+      band_ready[v % ring_size] = true;
+
+      // Hand over all consecutive decoded bands to the sink (unless another
+      // worker is already doing that, in which case it will pick up ours).
+      if (consuming)
+        continue;
+      consuming = true;
+      while (success && next_to_consume < num_block_rows &&
+             band_ready[next_to_consume % ring_size]) {
+        int slot = next_to_consume % ring_size;
+        int first_row = next_to_consume * 8;
+        int num_rows = std::min(8, m_height - first_row);
+        lock.unlock();
+        bool consumed = sink->ConsumeRows(
+            *this, &bands[slot * band_size], first_row, num_rows);
+        lock.lock();
+        band_ready[slot] = false;
+        ++next_to_consume;
+        if (!consumed)
           success = false;
-          break;
-        }
+        band_consumed.notify_all();
       }
-    };
-
-    // Start the worker threads (we start N - 1 new threads, and run one worker
-    // in the current thread).
-    int worker_threads = std::min((m_height + 7) / 8, m_max_threads);
-    std::vector<std::thread> threads;
-    for (int i = 0; i < worker_threads - 1; ++i)
-      threads.push_back(std::thread(worker_core));
+      consuming = false;
+    }
+  };
 
-    // One worker is always run in the current thread.
+  // Run one worker core per worker thread (a worker core that starts late
+  // finds no block rows left to decode).
+  RunParallel(m_thread_pool, worker_threads, worker_threads, [&](int) {
     worker_core();
+  });
 
-    // Wait for all the worker threads to finish.
-    for (auto &thread : threads)
-      thread.join();
+  return success;
+}
 
-    if (!success)
-      return false;
+bool Decoder::VerifyFullRes(VerifyError *error) {
+  // Find the FRES chunk.
+  int chunk_offset = m_packed_idx;
+  int chunk_size;
+  if (!FindRIFFChunk(ToFourcc("FRES"), &chunk_size))
+    return VerifyFailed(error, "FRES", chunk_offset, "Missing full-res data.");
+  chunk_offset = m_packed_idx;
+
+  // Recover the Huffman tree and the block table.
+  std::unique_ptr<EntropyDec> entropy_dec =
+      CreateEntropyDec(m_packed_data + m_packed_idx,
+                       chunk_size,
+                       UseFullResBlocks(),
+                       NumFullResSubstreams());
+  entropy_dec->SetBlockIndex(m_full_res_block_index);
+  if (!entropy_dec->Init()) {
+    return VerifyFailed(error,
+                        "FRES",
+                        chunk_offset,
+                        "Invalid full-res entropy coding table or blocks.");
+  }
+  m_packed_idx += chunk_size;
+
+  const int num_block_rows = (m_height + 7) >> 3;
+  const int blocks_per_row = NumFullResBlocksPerRow();
+  const int num_blocks = num_block_rows * blocks_per_row;
+  if (entropy_dec->NumAvailableBlocks() != num_blocks) {
+    return VerifyFailed(
+        error, "FRES", chunk_offset, "Incorrect number of full-res blocks.");
+  }
+
+  // Uncompress all the Huffman blocks in parallel, into per-worker scratch
+  // buffers. We keep track of the first failing block. A block holds an
+  // entire block row, or (with kFormatChannelBlocks) a single channel of a
+  // segment of a block row.
+  const int horizontal_blocks = (m_width + 7) >> 3;
+  const int num_segments = NumFullResSegments();
+  std::atomic_int next_block(0);
+  std::atomic_int first_failed_block(num_blocks);
+
+  // One worker core lambda is run in each worker thread.
+  auto worker_core = [&]() {
+    std::vector<uint8_t> scratch(horizontal_blocks * 64 * m_num_channels);
+    while (true) {
+      int block = next_block.fetch_add(1, std::memory_order_relaxed);
+      if (block >= first_failed_block.load(std::memory_order_relaxed))
+        break;
+      int block_size = horizontal_blocks * 64 * m_num_channels;
+      if (m_format_flags & kFormatChannelBlocks) {
+        int segment = (block / m_num_channels) % num_segments;
+        int segment_start = segment * kFullResSegmentWidth;
+        block_size =
+            std::min(kFullResSegmentWidth, horizontal_blocks - segment_start) *
+            64;
+      }
+      if (!entropy_dec->UncompressBlock(scratch.data(), block_size, block)) {
+        int failed_block = first_failed_block.load();
+        while (block < failed_block &&
+               !first_failed_block.compare_exchange_weak(failed_block,
+                                                         block)) {
+        }
+        break;
+      }
+    }
+  };
+
+  // Run one worker core per worker thread.
+  int worker_threads = std::min(num_blocks, NumWorkerThreads());
+  RunParallel(m_thread_pool, worker_threads, worker_threads, [&](int) {
+    worker_core();
+  });
+
+  if (first_failed_block < num_blocks) {
+    int block = first_failed_block;
+    VerifyFailed(error,
+                 "FRES",
+                 chunk_offset + entropy_dec->BlockOffset(block),
+                 "Invalid full-res entropy coded block.");
+    error->block_row = block / blocks_per_row;
+    return false;
   }
 
   return true;
 }
 
-bool Decoder::DecodeFullResBlockRow(const HuffmanDec &huffman_dec, int y) {
-  // Determine the number of horizontal blocks.
+bool Decoder::VerifyFailed(VerifyError *error,
+                           const char *chunk,
+                           int offset,
+                           const char *message) {
+  error->chunk = chunk;
+  error->offset = offset;
+  error->message = message;
+  return false;
+}
+
+bool Decoder::UseFullResBlocks() const {
+  return ((m_height + 7) >> 3) * NumFullResBlocksPerRow() > 1;
+}
+
+int Decoder::NumFullResSubstreams() const {
+  return (m_format_flags & kFormatInterleavedFullRes) ? kFullResSubstreams : 1;
+}
+
+int Decoder::NumFullResSegments() const {
+  if (!(m_format_flags & kFormatChannelBlocks))
+    return 1;
   const int horizontal_blocks = (m_width + 7) >> 3;
+  return (horizontal_blocks + kFullResSegmentWidth - 1) / kFullResSegmentWidth;
+}
 
-  // Vertical block coordinate (v).
-  int v = y >> 3;
-  int block_height = std::min(8, m_height - y);
+int Decoder::NumFullResChannelGroups() const {
+  return std::max(
+      1, (m_num_channels + m_channel_group_size - 1) / m_channel_group_size);
+}
+
+int Decoder::NumFullResBlocksPerRow() const {
+  if (!(m_format_flags & kFormatChannelBlocks))
+    return 1;
+  return NumFullResSegments() * m_num_channels;
+}
+
+int Decoder::FullResBlockIndex(int v, int segment, int chan) const {
+  if (!(m_format_flags & kFormatChannelBlocks))
+    return v;
+  return (v * NumFullResSegments() + segment) * m_num_channels + chan;
+}
+
+void Decoder::BeginFullRes() {
+  // Reserve space for the output data.
+  m_unpacked_data.resize(m_width * m_height * m_num_channels);
+
+  // Optionally report completed rows to the observer.
+  if (m_observer)
+    m_row_reporter.reset(new RowReporter(*this, m_observer, m_in_order));
+  else
+    m_row_reporter.reset();
+}
+
+bool Decoder::DecodeFullResBlockRows(const EntropyDec &entropy_dec,
+                                     int first_row,
+                                     int end_row) {
+  // Each block row is decoded in one or more independent parts (segments and
+  // channel groups), so that there is more parallel work than block rows for
+  // wide images and images with many channels.
+  const int num_segments = NumFullResSegments();
+  const int num_channel_groups = NumFullResChannelGroups();
+  const int parts_per_row = num_segments * num_channel_groups;
+  const int num_block_rows = (end_row - first_row + 7) / 8;
+  const int num_parts = num_block_rows * parts_per_row;
+
+  // Keep track of the remaining parts of each block row, so that we know
+  // when a block row is complete.
+  std::unique_ptr<std::atomic<int>[]> parts_left;
+  if (parts_per_row > 1) {
+    parts_left.reset(new std::atomic<int>[num_block_rows]);
+    for (int i = 0; i < num_block_rows; ++i)
+      parts_left[i].store(parts_per_row, std::memory_order_relaxed);
+  }
+
+  // Decode part number i (parts are numbered block row by block row).
+  auto decode_part = [this,
+                      &entropy_dec,
+                      &parts_left,
+                      first_row,
+                      num_channel_groups,
+                      parts_per_row](int i) {
+    int row = i / parts_per_row;
+    int y = first_row + row * 8;
+    uint8_t *out = &m_unpacked_data[y * m_width * m_num_channels];
+    if (parts_per_row == 1) {
+      if (!DecodeFullResBlockRow(entropy_dec, y, out))
+        return false;
+    } else {
+      int part = i - row * parts_per_row;
+      if (!DecodeFullResBlockRowPart(entropy_dec,
+                                     y,
+                                     part / num_channel_groups,
+                                     part % num_channel_groups,
+                                     out)) {
+        return false;
+      }
+      if (parts_left[row].fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return true;
+    }
+    if (m_row_reporter)
+      m_row_reporter->BlockRowDone(y >> 3);
+    return true;
+  };
+
+  // Decode all the parts (one task per part if we have a thread pool).
+  std::atomic_bool success(true);
+  RunParallel(m_thread_pool, num_parts, m_max_threads, [&](int i) {
+    if (success && !decode_part(i))
+      success = false;
+  });
+
+  if (m_row_reporter)
+    m_row_reporter->Flush();
+
+  return success;
+}
+
+bool Decoder::DecodeFullResBlockRow(const EntropyDec &entropy_dec,
+                                    int y,
+                                    uint8_t *out) {
+  // Deferred low-res data is decoded on demand.
+  if (m_low_res_rows && !m_low_res_rows->EnsureBlockRow(y >> 3))
+    return false;
 
-  // Prepare an unpacked buffer for all channels.
-  int full_res_data_size = horizontal_blocks * m_num_channels * 64;
-  std::vector<uint8_t> full_res_data(full_res_data_size);
+  return (this->*m_block_row_decoder)(
+      entropy_dec, y, 0, NumFullResSegments(), 0, m_num_channels, out);
+}
 
-  // Do Huffman decompression of a single block row.
-  if (!huffman_dec.UncompressBlock(full_res_data.data(), full_res_data_size, v)) {
-    std::cout << "Error: Invalid Huffman data.\n";
+bool Decoder::DecodeFullResBlockRowPart(const EntropyDec &entropy_dec,
+                                        int y,
+                                        int segment,
+                                        int channel_group,
+                                        uint8_t *out) {
+  // Deferred low-res data is decoded on demand.
+  if (m_low_res_rows && !m_low_res_rows->EnsureBlockRow(y >> 3))
     return false;
+
+  const int first_channel = channel_group * m_channel_group_size;
+  const int end_channel =
+      std::min(first_channel + m_channel_group_size, m_num_channels);
+  return (this->*m_block_row_decoder)(
+      entropy_dec, y, segment, segment + 1, first_channel, end_channel, out);
+}
+
+void Decoder::SelectBlockRowDecoder() {
+  // Use a specialized decoder for the common formats (gray, RGB and RGBA),
+  // and the generic decoder for everything else.
+  if (m_num_channels == 1) {
+    m_block_row_decoder = &Decoder::DecodeFullResBlockRowImpl<1, false>;
+  } else if (m_num_channels == 3 && HasChroma()) {
+    m_block_row_decoder = &Decoder::DecodeFullResBlockRowImpl<3, true>;
+  } else if (m_num_channels == 3) {
+    m_block_row_decoder = &Decoder::DecodeFullResBlockRowImpl<3, false>;
+  } else if (m_num_channels == 4 && HasChroma()) {
+    m_block_row_decoder = &Decoder::DecodeFullResBlockRowImpl<4, true>;
+  } else if (m_num_channels == 4) {
+    m_block_row_decoder = &Decoder::DecodeFullResBlockRowImpl<4, false>;
+  } else {
+    m_block_row_decoder = &Decoder::DecodeFullResBlockRowImpl<0, false>;
+  }
+
+  // The specialized decoders always decode all the channels of a segment
+  // together (they are interleaved in a single pass). The generic decoder can
+  // decode groups of channels separately, when each channel has Huffman blocks
+  // of its own.
+  m_channel_group_size = m_num_channels;
+  if ((m_format_flags & kFormatChannelBlocks) &&
+      m_block_row_decoder == &Decoder::DecodeFullResBlockRowImpl<0, false>) {
+    m_channel_group_size = std::min(kChannelGroupSize, m_num_channels);
   }
+  m_channel_group_size = std::max(m_channel_group_size, 1);
+}
 
-  int unpacked_idx = 0;
+template <int kNumChannels, bool kHasChroma>
+bool Decoder::DecodeFullResBlockRowImpl(const EntropyDec &entropy_dec,
+                                        int y,
+                                        int first_segment,
+                                        int end_segment,
+                                        int first_channel,
+                                        int end_channel,
+                                        uint8_t *out) {
+  // The channel count and the color mode are compile time constants, except
+  // for the generic decoder (kNumChannels == 0).
+  const int num_channels = kNumChannels > 0 ? kNumChannels : m_num_channels;
+  const bool has_chroma = kNumChannels > 0 ? kHasChroma : HasChroma();
+  const bool use_ycbcr = kNumChannels > 0 ? kHasChroma : m_use_ycbcr;
 
-  // Allocate aligned working buffers (enable aligned memory access & SIMD).
+  // Determine the number of horizontal blocks.
+  const int horizontal_blocks = (m_width + 7) >> 3;
+
+  // Determine the blocks [first_u, end_u) that are covered by the segments.
+  // Each channel of a segment has a Huffman block of its own if
+  // kFormatChannelBlocks is used, and otherwise the entire block row is a
+  // single Huffman block (and a single segment).
+  const bool use_channel_blocks = (m_format_flags & kFormatChannelBlocks) != 0;
+  const int segment_width =
+      use_channel_blocks ? kFullResSegmentWidth : horizontal_blocks;
+  const int first_u = first_segment * segment_width;
+  const int end_u = std::min(end_segment * segment_width, horizontal_blocks);
+  const int part_blocks = end_u - first_u;
+
+  // Vertical block coordinate (v).
+  int v = y >> 3;
+  int block_height = std::min(8, m_height - y);
+
+  // Get aligned working buffers (enable aligned memory access & SIMD). The
+  // specialized decoders keep one output buffer per channel.
+  BlockRowScratch &scratch = GetBlockRowScratch();
+  const int num_out_buffers = kNumChannels > 0 ? kNumChannels : 1;
   int16_t *buf0, *buf1, *lowres;
   static const int kBufferAlignment = 16;
-  std::unique_ptr<int16_t> buffers(new int16_t[3 * 64 + kBufferAlignment - 1]);
+  int16_t *buffers = GrowScratch(
+      &scratch.buffers, (2 + num_out_buffers) * 64 + kBufferAlignment - 1);
   {
     intptr_t alignment_adjust =
-        reinterpret_cast<intptr_t>(buffers.get()) & (kBufferAlignment - 1);
+        reinterpret_cast<intptr_t>(buffers) & (kBufferAlignment - 1);
     if (alignment_adjust)
       alignment_adjust = kBufferAlignment - alignment_adjust;
     buf1 = reinterpret_cast<int16_t*>(
-        ASSUME_ALIGNED16(buffers.get() + alignment_adjust));
-    buf0 = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(buf1 + 64));
-    lowres = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(buf0 + 64));
+        ASSUME_ALIGNED16(buffers + alignment_adjust));
+    lowres = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(buf1 + 64));
+    buf0 = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(lowres + 64));
   }
 
-  // All channels are inteleaved per block row.
-  for (int chan = 0; chan < m_num_channels; ++chan) {
-    // Get the low-res (divided by 8x8) image for this channel.
-    Downsampled &downsampled = m_downsampled[chan];
+  if (kNumChannels > 0) {
+    // The full-res data of a block row is stored one coefficient plane at a
+    // time, so we can dequantize and inverse transform all the blocks of a
+    // channel at once, with one lane per block (this avoids the deinterleave
+    // gather, and lets the compiler vectorize across blocks).
+    //
+    // The Huffman decoder dequantizes the coefficients on the fly, and writes
+    // them straight to their coefficient planes.
+    //
+    // While decoding, we also keep track of the last nonzero coefficient of
+    // each block, so that sparse blocks can use cheaper inverse transforms.
+    //
+    // The planes need no initialization, since the Huffman decoder writes all
+    // the coefficients (including the zeros), but the last nonzero positions
+    // must start out as zero.
+    const int plane_stride = (part_blocks + 15) & ~15;
+    int16_t *planes =
+        GrowScratch(&scratch.planes, num_channels * 64 * plane_stride);
+    uint8_t *last_nonzero =
+        GrowScratch(&scratch.last_nonzero, num_channels * plane_stride);
+    std::fill_n(last_nonzero, num_channels * plane_stride, 0);
+    static const int kNumRows = 64 * (kNumChannels > 0 ? kNumChannels : 1);
+    int16_t *rows[kNumRows];
+    const int16_t *luts[kNumRows];
+    uint8_t *row_last_nonzero[kNumRows];
+    for (int chan = 0; chan < num_channels; ++chan) {
+      bool is_chroma_channel = kHasChroma && (chan == 1 || chan == 2);
+      for (int i = 0; i < 64; ++i)
+        luts[chan * 64 + i] = m_quantize.UnpackLut(i, is_chroma_channel);
+    }
+    for (int segment = first_segment; segment < end_segment; ++segment) {
+      const int segment_start = segment * segment_width;
+      const int segment_blocks =
+          std::min(segment_width, horizontal_blocks - segment_start);
+      const int offset = segment_start - first_u;
+      for (int chan = 0; chan < num_channels; ++chan) {
+        for (int i = 0; i < 64; ++i) {
+          rows[chan * 64 + i] =
+              &planes[(chan * 64 + kIndexLUT[i]) * plane_stride + offset];
+          row_last_nonzero[chan * 64 + i] =
+              &last_nonzero[chan * plane_stride + offset];
+        }
+      }
 
-    // Create an inverse index LUT for reading back the interleaved elements.
-    int deinterleave_index[64];
-    for (int i = 0; i < 64; ++i)
-      deinterleave_index[kIndexLUT[i]] = i * horizontal_blocks;
+      // All the channels are either in a single Huffman block, or in one
+      // Huffman block per channel.
+      const int num_huffman_blocks = use_channel_blocks ? num_channels : 1;
+      const int rows_per_huffman_block = kNumRows / num_huffman_blocks;
+      for (int k = 0; k < num_huffman_blocks; ++k) {
+        EntropyDec::RowOutput row_output;
+        row_output.row_length = segment_blocks;
+        row_output.num_rows = rows_per_huffman_block;
+        row_output.rows = &rows[k * rows_per_huffman_block];
+        row_output.luts = &luts[k * rows_per_huffman_block];
+        row_output.last_nonzero = &row_last_nonzero[k * rows_per_huffman_block];
+        if (!entropy_dec.UncompressBlock(
+                row_output, FullResBlockIndex(v, segment, k))) {
+          std::cout << "Error: Invalid entropy coded data.\n";
+          return false;
+        }
+      }
+    }
 
-    bool is_chroma_channel = m_use_ycbcr && (chan == 1 || chan == 2);
+    for (int chan = 0; chan < num_channels; ++chan) {
+      Hadamard::InverseLanesSparse(&planes[chan * 64 * plane_stride],
+                                   plane_stride,
+                                   part_blocks,
+                                   &last_nonzero[chan * plane_stride]);
+    }
 
-    for (int x = 0; x < m_width; x += 8) {
-      // Horizontal block coordinate (u).
+    // Transpose the blocks back to pixel order and add the low-res component.
+    // All the channels of a block are reconstructed before moving on to the
+    // next block, and the final (color converted) pixels are written in a
+    // single pass.
+    const int end_x = std::min(end_u * 8, m_width);
+    for (int x = first_u * 8; x < end_x; x += 8) {
       int u = x >> 3;
-      int block_width = std::min(8, m_width - x);
-
-      // Get quantized data from the unpacked buffer.
-      // NOTE: This seems to be a bottleneck on x86 (64). The irregular
-      // addressing pattern and two levels of indirection seem to be the main
-      // issues. Loop unrolling (e.g. -funroll-loops) helps to some extent.
-      uint8_t packed[64];
-      {
-        const uint8_t *src = &full_res_data[unpacked_idx + u];
+      for (int chan = 0; chan < num_channels; ++chan) {
+        const int16_t *src = &planes[chan * 64 * plane_stride + u - first_u];
+        int16_t *block = &buf0[chan * 64];
+        m_downsampled[chan].GetLowresBlock(lowres, u, v);
         for (int i = 0; i < 64; ++i)
-          packed[i] = src[deinterleave_index[i]];
+          block[i] = src[i * plane_stride] + lowres[i];
+      }
+      if (kHasChroma)
+        YCbCr::YCbCrToRGB(buf0, &buf0[64], &buf0[128], 64);
+      StoreBlock<kNumChannels>(&out[x * num_channels],
+                               buf0,
+                               m_width * num_channels,
+                               std::min(8, m_width - x),
+                               block_height);
+    }
+  } else {
+    // Generic version: Reconstruct one channel at a time, and do the color
+    // conversion on the entire block row afterwards. This version also serves
+    // as the reference for the fused decoding above, since it uses the plain
+    // byte output of the Huffman decoder.
+
+    // Prepare an unpacked buffer for all channels (or for a single channel,
+    // when each channel has Huffman blocks of its own).
+    std::vector<uint8_t> full_res_data;
+    const int num_substreams = NumFullResSubstreams();
+
+    for (int segment = first_segment; segment < end_segment; ++segment) {
+      const int segment_start = segment * segment_width;
+      const int segment_blocks =
+          std::min(segment_width, horizontal_blocks - segment_start);
+
+      // Do Huffman decompression of a single block row.
+      if (!use_channel_blocks) {
+        full_res_data.resize(segment_blocks * num_channels * 64);
+        if (!entropy_dec.UncompressBlock(
+                full_res_data.data(), full_res_data.size(), v)) {
+          std::cout << "Error: Invalid entropy coded data.\n";
+          return false;
+        }
       }
 
-      // De-quantize.
-      m_quantize.Unpack(buf1, packed, is_chroma_channel, m_full_res_mapper);
-
-      // Inverse transform.
-      Hadamard::Inverse(buf0, buf1);
+      // All channels are inteleaved per segment.
+      for (int chan = first_channel; chan < end_channel; ++chan) {
+        // Create an inverse index LUT for reading back the interleaved
+        // elements (the rows of the Huffman block may be reordered for
+        // substreams).
+        const int huffman_block_rows =
+            use_channel_blocks ? 64 : 64 * num_channels;
+        const int first_row = use_channel_blocks ? 0 : chan * 64;
+        int deinterleave_index[64];
+        for (int i = 0; i < 64; ++i) {
+          int row = SubstreamRowIndex(
+              first_row + i, huffman_block_rows, num_substreams);
+          deinterleave_index[kIndexLUT[i]] = row * segment_blocks;
+        }
 
-      // Add low-res component.
-      downsampled.GetLowresBlock(lowres, u, v);
-      for (int i = 0; i < 64; ++i) {
-        buf0[i] += lowres[i];
+        // Do Huffman decompression of a single channel of the segment.
+        if (use_channel_blocks) {
+          full_res_data.resize(segment_blocks * 64);
+          int block_no = FullResBlockIndex(v, segment, chan);
+          if (!entropy_dec.UncompressBlock(
+                  full_res_data.data(), full_res_data.size(), block_no)) {
+            std::cout << "Error: Invalid entropy coded data.\n";
+            return false;
+          }
+        }
+        const uint8_t *channel_data = full_res_data.data();
+
+        // Get the low-res (divided by 8x8) image for this channel.
+        Downsampled &downsampled = m_downsampled[chan];
+
+        bool is_chroma_channel = use_ycbcr && (chan == 1 || chan == 2);
+
+        const int end_x =
+            std::min((segment_start + segment_blocks) * 8, m_width);
+        for (int x = segment_start * 8; x < end_x; x += 8) {
+          // Horizontal block coordinate (u).
+          int u = x >> 3;
+          int block_width = std::min(8, m_width - x);
+
+          // Get quantized data from the unpacked buffer.
+          // NOTE: This seems to be a bottleneck on x86 (64). The irregular
+          // addressing pattern and two levels of indirection seem to be the
+          // main issues. Loop unrolling (e.g. -funroll-loops) helps to some
+          // extent.
+          uint8_t packed[64];
+          {
+            const uint8_t *src = &channel_data[u - segment_start];
+            for (int i = 0; i < 64; ++i)
+              packed[i] = src[deinterleave_index[i]];
+          }
+
+          // De-quantize.
+          m_quantize.Unpack(
+              buf1, packed, is_chroma_channel, m_full_res_mapper);
+
+          // Inverse transform.
+          Hadamard::Inverse(buf0, buf1);
+
+          // Add low-res component.
+          downsampled.GetLowresBlock(lowres, u, v);
+          for (int i = 0; i < 64; ++i) {
+            buf0[i] += lowres[i];
+          }
+
+          // Copy color channel to destination data.
+          RestoreChannelBlock<kNumChannels>(&out[x * num_channels + chan],
+                                            buf0,
+                                            num_channels,
+                                            m_width * num_channels,
+                                            block_width,
+                                            block_height);
+        }
       }
-
-      // Copy color channel to destination data.
-      RestoreChannelBlock(
-          &m_unpacked_data[(y * m_width + x) * m_num_channels + chan],
-          buf0,
-          m_num_channels,
-          m_width * m_num_channels,
-          block_width,
-          block_height);
     }
 
-    unpacked_idx += horizontal_blocks * 64;
-  }
-
-  // Do YCbCr->RGB conversion for this block row if necessary.
-  if (HasChroma()) {
-    uint8_t *buf = &m_unpacked_data[y * m_width * m_num_channels];
-    YCbCr::YCbCrToRGB(buf, m_width, block_height, m_num_channels);
+    // Do YCbCr->RGB conversion for the decoded part of this block row if
+    // necessary (the color channels are always in the first channel group).
+    if (has_chroma && first_channel == 0) {
+      const int first_x = first_u * 8;
+      const int end_x = std::min(end_u * 8, m_width);
+      if (first_x == 0 && end_x == m_width) {
+        YCbCr::YCbCrToRGB(out, m_width, block_height, num_channels);
+      } else {
+        for (int row = 0; row < block_height; ++row) {
+          YCbCr::YCbCrToRGB(&out[(row * m_width + first_x) * num_channels],
+                            end_x - first_x,
+                            1,
+                            num_channels);
+        }
+      }
+    }
   }
 
   return true;
 }
 
 bool Decoder::DecodeRIFFChunk(uint32_t *fourcc, int *size) {
-  if ((m_packed_idx + 8) > m_packed_size)
-    return false;
-
-  *fourcc = static_cast<uint32_t>(m_packed_data[m_packed_idx]) |
-            (static_cast<uint32_t>(m_packed_data[m_packed_idx + 1]) << 8) |
-            (static_cast<uint32_t>(m_packed_data[m_packed_idx + 2]) << 16) |
-            (static_cast<uint32_t>(m_packed_data[m_packed_idx + 3]) << 24);
-  *size = static_cast<int>(m_packed_data[m_packed_idx + 4]) |
-          (static_cast<int>(m_packed_data[m_packed_idx + 5]) << 8) |
-          (static_cast<int>(m_packed_data[m_packed_idx + 6]) << 16) |
-          (static_cast<int>(m_packed_data[m_packed_idx + 7]) << 24);
-
-  m_packed_idx += 8;
-  return m_packed_idx + *size <= m_packed_size;
+  return ParseRIFFChunk(
+      m_packed_data, m_packed_size, &m_packed_idx, fourcc, size);
 }
 
 bool Decoder::FindRIFFChunk(uint32_t fourcc, int *size) {
-  uint32_t chunk_fourcc;
-  int chunk_size;
-  while (DecodeRIFFChunk(&chunk_fourcc, &chunk_size)) {
-    // Did we find the requested chunk?
-    if (chunk_fourcc == fourcc) {
-      *size = chunk_size;
-      return true;
-    }
-
-    // Unrecognized chunk. Skip to the next one.
-    m_packed_idx += chunk_size;
-  }
-
-  // We didn't find the chunk.
-  return false;
+  return FindRIFFChunkIn(
+      m_packed_data, m_packed_size, &m_packed_idx, fourcc, size);
 }
 
 }  // namespace himg
@@ -10,21 +10,138 @@
 #define DECODER_H_
 
 #include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "downsampled.h"
-#include "huffman_dec.h"
+#include "entropy_dec.h"
 #include "mapper.h"
 #include "quantize.h"
 
 namespace himg {
 
+class Decoder;
+class ThreadPool;
+
+// Basic information about a packed image (see Decoder::Probe()).
+struct ImageInfo {
+  int version;
+  int width;
+  int height;
+  int num_channels;
+  bool use_ycbcr;
+
+  // Optional format features (kFormat* flags, see common.h).
+  int format_flags;
+
+  // Size of the low-res and full-res data chunks (in bytes), or -1 if unknown.
+  int low_res_size;
+  int full_res_size;
+};
+
+// Interface for receiving progress notifications from the decoder.
+class DecodeObserver {
+ public:
+  virtual ~DecodeObserver() {}
+
+  // Called once the low-res image is available (see Decoder::GetLowResImage()
+  // and Decoder::GetUpsampledLowResImage()).
+  virtual void LowResReady(const Decoder & /* decoder */) {}
+
+  // Called when the rows [first_row, first_row + num_rows) of the full
+  // resolution image have been decoded (i.e. are available in
+  // Decoder::unpacked_data()). Unless in-order reporting is requested, this
+  // may be called from several worker threads concurrently, and rows may be
+  // reported out of order.
+  virtual void RowsReady(const Decoder & /* decoder */,
+                         int /* first_row */,
+                         int /* num_rows */) {}
+};
+
+// Interface for receiving the decoded image a few rows at a time (see
+// Decoder::DecodeStreaming()).
+class RowSink {
+ public:
+  virtual ~RowSink() {}
+
+  // Called for each band of decoded rows, in order from top to bottom. The
+  // band holds num_rows rows of width() * num_channels() bytes each, and is
+  // only valid during the call. Return false to abort decoding.
+  virtual bool ConsumeRows(const Decoder &decoder,
+                           const uint8_t *rows,
+                           int first_row,
+                           int num_rows) = 0;
+};
+
+// Describes why an image failed to verify (see Decoder::Verify()).
+struct VerifyError {
+  // A description of the error (empty if there was no error).
+  std::string message;
+
+  // The fourcc of the failing chunk (e.g. "FRES").
+  std::string chunk;
+
+  // The byte offset into the packed data of the failing chunk or Huffman
+  // block (-1 if unknown).
+  int offset;
+
+  // The failing full-res block row (-1 if not applicable).
+  int block_row;
+};
+
 class Decoder {
  public:
   Decoder(int max_threads = 0);
+  virtual ~Decoder();
 
   bool Decode(const uint8_t *packed_data, int packed_size);
 
+  // Check that all the chunks in a packed image can be parsed, and that all
+  // the Huffman data decodes to the expected number of bytes, without
+  // reconstructing the image (no output image is allocated). On failure, the
+  // location of the first error is described in *error.
+  bool Verify(const uint8_t *packed_data,
+              int packed_size,
+              VerifyError *error);
+
+  // Get basic information about a packed image without decoding it. Only the
+  // RIFF header and the FRMT chunk are parsed (plus the remaining chunk
+  // headers, if get_chunk_sizes is true), and no memory is allocated.
+  static bool Probe(const uint8_t *packed_data,
+                    int packed_size,
+                    ImageInfo *info,
+                    bool get_chunk_sizes = false);
+
+  // Decode an image without storing the entire decoded image in memory.
+  // Instead, the decoded rows are passed to the sink in small bands (only a
+  // couple of bands per thread are kept in memory). Note that the observer
+  // is not notified about decoded rows in this mode, and unpacked_data() is
+  // not available.
+  bool DecodeStreaming(const uint8_t *packed_data,
+                       int packed_size,
+                       RowSink *sink);
+
+  // Set an observer that gets notified during Decode() (nullptr disables
+  // notifications). If in_order is true, rows are reported top to bottom.
+  void SetObserver(DecodeObserver *observer, bool in_order = false);
+
+  // Run the parallel parts of decoding (e.g. the full-res block rows) as tasks
+  // in the given thread pool instead of starting new threads (nullptr
+  // restores the default behavior). The pool must outlive the decoder.
+  void SetThreadPool(ThreadPool *pool);
+
+  // Get the low-res (1/8 scale) image. The output buffer must hold
+  // low_res_width() * low_res_height() * num_channels() bytes.
+  void GetLowResImage(uint8_t *out) const;
+
+  // Get the low-res image, upsampled to full size. The output buffer must hold
+  // width() * height() * num_channels() bytes.
+  void GetUpsampledLowResImage(uint8_t *out) const;
+
+  int low_res_width() const;
+  int low_res_height() const;
+
   const uint8_t *unpacked_data() const { return m_unpacked_data.data(); }
   int unpacked_size() const { return static_cast<int>(m_unpacked_data.size()); }
 
@@ -32,23 +149,125 @@ class Decoder {
   int height() const { return m_height; }
   int num_channels() const { return m_num_channels; }
 
- private:
+ protected:
+  class LowResRows;
+  class RowReporter;
+
   bool HasChroma() const;
 
+  // Decode everything up to (but not including) the full-res data. If
+  // defer_low_res is true and there is no observer, blocked low-res data is
+  // only prepared, and its macro rows are decoded on demand by the full-res
+  // block rows that need them (m_low_res_rows must then be reset once the
+  // full-res data has been decoded).
+  bool DecodeUpToFullRes(const uint8_t *packed_data,
+                         int packed_size,
+                         bool defer_low_res = false);
+
   bool DecodeRIFFStart();
   bool DecodeHeader();
+  bool DecodeBlockIndex();
   bool DecodeLowResMappingFunction();
   bool DecodeLowRes();
+  bool DecodeLowResMacroRow(const EntropyDec &entropy_dec, int macro_row);
   bool DecodeQuantizationConfig();
   bool DecodeFullResMappingFunction();
   bool DecodeFullRes();
+  bool DecodeFullResStreaming(RowSink *sink);
+
+  bool VerifyLowRes();
+  bool VerifyFullRes(VerifyError *error);
+  static bool VerifyFailed(VerifyError *error,
+                           const char *chunk,
+                           int offset,
+                           const char *message);
+
+  // Create an entropy decoder for LRES or FRES data (Huffman, or ANS with
+  // kFormatAnsCoding), see EntropyDec::Create().
+  std::unique_ptr<EntropyDec> CreateEntropyDec(const uint8_t *in,
+                                               int in_size,
+                                               bool use_blocks,
+                                               int num_substreams = 1) const;
+
+  // Find the FRES chunk and prepare an entropy decoder for it.
+  std::unique_ptr<EntropyDec> InitFullResDecoder();
 
-  bool DecodeFullResBlockRow(const HuffmanDec &huffman_dec, int y);
+  // Does the full-res Huffman stream have more than one block?
+  bool UseFullResBlocks() const;
+
+  // The number of substreams per full-res Huffman block (more than one with
+  // kFormatInterleavedFullRes).
+  int NumFullResSubstreams() const;
+
+  // The full-res Huffman blocks. Each block row is split into one or more
+  // segments (more than one with kFormatChannelBlocks), and each segment
+  // into one or more channel groups, which can be decoded independently.
+  int NumFullResSegments() const;
+  int NumFullResChannelGroups() const;
+  int NumFullResBlocksPerRow() const;
+  int FullResBlockIndex(int v, int segment, int chan) const;
+
+  // Prepare the output buffer (and row reporting) for full-res decoding.
+  void BeginFullRes();
+
+  // Decode the rows [first_row, end_row) (must be multiples of 8, except for
+  // the end of the image), using several threads if possible.
+  bool DecodeFullResBlockRows(const EntropyDec &entropy_dec,
+                              int first_row,
+                              int end_row);
+  // Decode the block row that starts at row y, and write the pixels to out
+  // (which points to the first pixel of the block row).
+  bool DecodeFullResBlockRow(const EntropyDec &entropy_dec,
+                             int y,
+                             uint8_t *out);
+  // Decode a single segment and channel group of a block row (see above).
+  bool DecodeFullResBlockRowPart(const EntropyDec &entropy_dec,
+                                 int y,
+                                 int segment,
+                                 int channel_group,
+                                 uint8_t *out);
+
+  // Versions of DecodeFullResBlockRowPart() that are specialized for a given
+  // number of channels (0 = any) and color mode, and that decode the segments
+  // [first_segment, end_segment) and the channels [first_channel,
+  // end_channel) of a block row. SelectBlockRowDecoder() picks one of them
+  // once the header has been decoded.
+  template <int kNumChannels, bool kHasChroma>
+  bool DecodeFullResBlockRowImpl(const EntropyDec &entropy_dec,
+                                 int y,
+                                 int first_segment,
+                                 int end_segment,
+                                 int first_channel,
+                                 int end_channel,
+                                 uint8_t *out);
+  void SelectBlockRowDecoder();
 
   bool DecodeRIFFChunk(uint32_t *fourcc, int *size);
   bool FindRIFFChunk(uint32_t fourcc, int *size);
 
+  // The number of threads that work in parallel (the number of threads in the
+  // thread pool, or m_max_threads).
+  int NumWorkerThreads() const;
+
   int m_max_threads;
+  ThreadPool *m_thread_pool;
+
+  typedef bool (Decoder::*BlockRowDecoder)(const EntropyDec &entropy_dec,
+                                           int y,
+                                           int first_segment,
+                                           int end_segment,
+                                           int first_channel,
+                                           int end_channel,
+                                           uint8_t *out);
+  BlockRowDecoder m_block_row_decoder;
+  int m_channel_group_size;
+
+  DecodeObserver *m_observer;
+  bool m_in_order;
+  std::unique_ptr<RowReporter> m_row_reporter;
+
+  bool m_defer_low_res;
+  std::unique_ptr<LowResRows> m_low_res_rows;
 
   Quantize m_quantize;
   LowResMapper m_low_res_mapper;
@@ -56,6 +275,11 @@ class Decoder {
   std::vector<Downsampled> m_downsampled;
   std::vector<uint8_t> m_unpacked_data;
 
+  // The block offsets of the LRES and FRES data, from the optional BIDX chunk
+  // (empty if there is no index).
+  std::vector<int> m_low_res_block_index;
+  std::vector<int> m_full_res_block_index;
+
   const uint8_t *m_packed_data;
   int m_packed_size;
   int m_packed_idx;
@@ -64,6 +288,7 @@ class Decoder {
   int m_height;
   int m_num_channels;
   bool m_use_ycbcr;
+  uint8_t m_format_flags;
 };
 
 }  // namespace himg
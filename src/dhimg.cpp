@@ -6,44 +6,98 @@
 // See LICENSE for details.
 //-----------------------------------------------------------------------------
 
+#include <climits>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
 #include <iostream>
+#include <string>
 
 #include <FreeImage.h>
 
 #include "decoder.h"
+#include "file_io.h"
+
+namespace {
+
+// A row sink that writes the decoded rows straight to a raw output file.
+class RawFileSink : public himg::RowSink {
+ public:
+  explicit RawFileSink(uint8_t *out) : m_out(out) {}
+
+  bool ConsumeRows(const himg::Decoder &decoder,
+                   const uint8_t *rows,
+                   int first_row,
+                   int num_rows) override {
+    const int64_t row_size =
+        static_cast<int64_t>(decoder.width()) * decoder.num_channels();
+    std::memcpy(m_out + first_row * row_size, rows, num_rows * row_size);
+    return true;
+  }
+
+ private:
+  uint8_t *m_out;
+};
+
+bool HasSuffix(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
 
 int main(int argc, const char **argv) {
   if (argc < 3) {
     std::cout << "Usage: " << argv[0] << " image outfile" << std::endl;
+    std::cout << "(the output is written as raw pixels if outfile ends with "
+                 "\".raw\")" << std::endl;
     return 0;
   }
 
-  // Load the packed data from a file.
-  std::vector<uint8_t> packed_data;
-  {
-    // Open file.
-    std::ifstream f(argv[1], std::ifstream::in | std::ifstream::binary);
-    if (!f.good()) {
-      std::cout << "Unable to read file " << argv[1] << std::endl;
+  // Map the packed data from the file (it is decoded in place).
+  himg::InputFile packed_file;
+  if (!packed_file.Open(argv[1])) {
+    std::cout << "Unable to read file " << argv[1] << std::endl;
+    return -1;
+  }
+  std::cout << "File size: " << packed_file.size() << std::endl;
+  if (packed_file.size() > INT_MAX) {
+    std::cout << "The file is too large." << std::endl;
+    return -1;
+  }
+  const uint8_t *packed_data = packed_file.data();
+  const int packed_size = static_cast<int>(packed_file.size());
+
+  // Raw output (interleaved 8-bit channels, top to bottom) is decoded a few
+  // rows at a time, straight into the output file.
+  if (HasSuffix(argv[2], ".raw")) {
+    himg::ImageInfo info;
+    if (!himg::Decoder::Probe(packed_data, packed_size, &info)) {
+      std::cout << "Unable to decode image." << std::endl;
       return -1;
     }
-
-    // Get file size.
-    f.seekg(0, std::ifstream::end);
-    int file_size = static_cast<int>(f.tellg());
-    f.seekg(0, std::ifstream::beg);
-    std::cout << "File size: " << file_size << std::endl;
-
-    // Read the file data into our buffer.
-    packed_data.resize(file_size);
-    f.read(reinterpret_cast<char *>(packed_data.data()), file_size);
+    himg::OutputFile raw_file;
+    const int64_t raw_size = static_cast<int64_t>(info.width) * info.height *
+                             info.num_channels;
+    if (!raw_file.Create(argv[2], raw_size)) {
+      std::cout << "Unable to write file " << argv[2] << std::endl;
+      return -1;
+    }
+    himg::Decoder decoder;
+    RawFileSink sink(raw_file.data());
+    if (!decoder.DecodeStreaming(packed_data, packed_size, &sink)) {
+      std::cout << "Unable to decode image." << std::endl;
+      return -1;
+    }
+    if (!raw_file.Close()) {
+      std::cout << "Unable to write file " << argv[2] << std::endl;
+      return -1;
+    }
+    return 0;
   }
 
   // Decode the image.
   himg::Decoder decoder;
-  if (!decoder.Decode(packed_data.data(), packed_data.size())) {
+  if (!decoder.Decode(packed_data, packed_size)) {
     std::cout << "Unable to decode image." << std::endl;
     return -1;
   }
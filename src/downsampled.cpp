@@ -174,143 +174,38 @@ int Downsampled::BlockDataSizePerChannel(int rows, int columns) {
   return macro_rows * macro_columns + rows * columns;
 }
 
+int Downsampled::NumMacroRows(int rows) {
+  return NumMacroBlocks(rows);
+}
+
+int Downsampled::MacroRow(int row) {
+  return row / kMacroBlockSize;
+}
+
+int Downsampled::MacroRowDataSize(int rows, int columns, int macro_row) {
+  const int macro_columns = NumMacroBlocks(columns);
+  const int v0 = macro_row * kMacroBlockSize;
+  const int rows_in_macro_row = std::min(kMacroBlockSize, rows - v0);
+  return macro_columns + rows_in_macro_row * columns;
+}
+
 void Downsampled::GetBlockData(uint8_t *out, const Mapper &mapper) const {
   const int macro_rows = NumMacroBlocks(m_rows);
   const int macro_columns = NumMacroBlocks(m_columns);
 
   // Determine the best predictor for each macro block.
   uint8_t *predictor_selection = out;
-  {
-    int predictor_error[kNumPredictors];
-    for (int mv = 0; mv < macro_rows; ++mv) {
-      int v0 = mv * kMacroBlockSize;
-      for (int mu = 0; mu < macro_columns; ++mu) {
-        int u0 = mu * kMacroBlockSize;
-
-        // Clear the prediction error vector.
-        for (int i = 0; i < kNumPredictors; ++i)
-          predictor_error[i] = 0;
-
-        // Iterate over all the pixels of this macro block.
-        for (int dv = 0; dv < kMacroBlockSize; ++dv) {
-          int v = v0 + dv;
-          if (v >= m_rows)
-            break;
-
-          for (int du = 0; du < kMacroBlockSize; ++du) {
-            int u = u0 + du;
-            if (u >= m_columns)
-              break;
-
-            // Extract the three neighbour samples that we use for
-            // prediction.
-            int16_t s1, s2, s3;
-            if (du > 0 && dv > 0) {
-              s1 =
-                  static_cast<int16_t>(m_data[(v - 1) * m_columns + u - 1]);
-              s2 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-              s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-            } else if (du > 0) {
-              s1 = s2 = s3 =
-                  static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-            } else if (dv > 0) {
-              s1 = s2 = s3 =
-                  static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-            } else {
-              s1 = s2 = s3 = 128;
-            }
-
-            // Try all the predictors.
-            for (int predictor = 0; predictor < kNumPredictors;
-                 ++predictor) {
-              // Calculate the prediction error for this predictor.
-              int16_t predicted = PredictSample(s1, s2, s3, predictor);
-              int16_t actual =
-                  static_cast<int16_t>(m_data[v * m_columns + u]);
-              int delta = static_cast<int>(actual - predicted);
-              int err = delta * delta;
-
-              // Accumulate the prediction error for this predictor.
-              predictor_error[predictor] += err;
-            }
-          }
-        }
-
-        // Select the best predictor for this macro block.
-        int best_predictor = 0;
-        int best_error = predictor_error[0];
-        for (int predictor = 1; predictor < kNumPredictors; ++predictor) {
-          if (predictor_error[predictor] < best_error) {
-            best_predictor = predictor;
-            best_error = predictor_error[predictor];
-          }
-        }
-
-        // Output the predictor.
-        *out++ = EncodePredictor(best_predictor);
-      }
-    }
+  for (int mv = 0; mv < macro_rows; ++mv) {
+    for (int mu = 0; mu < macro_columns; ++mu)
+      *out++ = EncodePredictor(SelectPredictor(mu, mv));
   }
 
-  // We use a temporary working buffer for the two most recent lines in the
-  // macro block.
-  uint8_t work_buf[kMacroBlockSize * 2];
-  uint8_t *lines[2] = {&work_buf[0], &work_buf[kMacroBlockSize]};
-
   // Iterate over all macro blocks.
   for (int mv = 0; mv < macro_rows; ++mv) {
-    int v0 = mv * kMacroBlockSize;
     for (int mu = 0; mu < macro_columns; ++mu) {
-      int u0 = mu * kMacroBlockSize;
-
-      // Get the predictor for this macro block.
       int predictor =
           DecodePredictor(predictor_selection[mv * macro_columns + mu]);
-
-      // Iterate over all the pixels of this macro block.
-      for (int dv = 0; dv < kMacroBlockSize; ++dv) {
-        int v = v0 + dv;
-        if (v >= m_rows)
-          break;
-
-        for (int du = 0; du < kMacroBlockSize; ++du) {
-          int u = u0 + du;
-          if (u >= m_columns)
-            break;
-
-          // Extract the three neighbour samples that we use for prediction.
-          int16_t s1, s2, s3;
-          if (du > 0 && dv > 0) {
-            s1 = static_cast<int16_t>(lines[0][du - 1]);
-            s2 = static_cast<int16_t>(lines[0][du]);
-            s3 = static_cast<int16_t>(lines[1][du - 1]);
-          } else if (du > 0) {
-            s1 = s2 = s3 = static_cast<int16_t>(lines[1][du - 1]);
-          } else if (dv > 0) {
-            s1 = s2 = s3 = static_cast<int16_t>(lines[0][du]);
-          } else {
-            s1 = s2 = s3 = 128;
-          }
-
-          // Predict the current sample.
-          int16_t predicted = PredictSample(s1, s2, s3, predictor);
-
-          // Calculate the delta to the prediction.
-          int16_t actual = static_cast<int16_t>(m_data[v * m_columns + u]);
-          int16_t delta = actual - predicted;
-          uint8_t delta8 = mapper.MapTo8Bit(delta);
-
-          // Compensate actual value for quantization (i.e. mimic the decoder).
-          actual = predicted + mapper.UnmapFrom8Bit(delta8);
-          actual = std::max(int16_t(0), std::min(actual, int16_t(255)));
-          lines[1][du] = static_cast<uint8_t>(actual);
-
-          // Output the quantized delta value.
-          *out++ = delta8;
-        }
-
-        std::swap(lines[0], lines[1]);
-      }
+      out = PackMacroBlock(out, mu, mv, predictor, mapper);
     }
   }
 }
@@ -320,9 +215,7 @@ void Downsampled::SetBlockData(
   const int macro_rows = NumMacroBlocks(rows);
   const int macro_columns = NumMacroBlocks(columns);
 
-  m_rows = rows;
-  m_columns = columns;
-  m_data.resize(m_rows * m_columns);
+  InitBlockData(rows, columns);
 
   // The per macro-block predictor selection comes first (one byte per macro
   // block).
@@ -331,54 +224,216 @@ void Downsampled::SetBlockData(
 
   // Reconstruct samples (integrate deltas) for all macro blocks.
   for (int mv = 0; mv < macro_rows; ++mv) {
-    int v0 = mv * kMacroBlockSize;
     for (int mu = 0; mu < macro_columns; ++mu) {
-      int u0 = mu * kMacroBlockSize;
-
-      // Get the predictor for this macro block.
       int predictor =
           DecodePredictor(predictor_selection[mv * macro_columns + mu]);
+      in = UnpackMacroBlock(in, mu, mv, predictor, mapper);
+    }
+  }
+}
 
-      // Iterate over all the pixels of this macro block.
-      for (int dv = 0; dv < kMacroBlockSize; ++dv) {
-        int v = v0 + dv;
-        if (v >= m_rows)
-          break;
-
-        for (int du = 0; du < kMacroBlockSize; ++du) {
-          int u = u0 + du;
-          if (u >= m_columns)
-            break;
-
-          // Extract the three neighbour samples that we use for prediction.
-          int16_t s1, s2, s3;
-          if (du > 0 && dv > 0) {
-            s1 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u - 1]);
-            s2 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-            s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-          } else if (du > 0) {
-            s1 = s2 = s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
-          } else if (dv > 0) {
-            s1 = s2 = s3 =
-                static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
-          } else {
-            s1 = s2 = s3 = 128;
-          }
-
-          // Predict the current sample.
-          int16_t predicted = PredictSample(s1, s2, s3, predictor);
-
-          // Restore actual value.
-          int16_t delta = mapper.UnmapFrom8Bit(*in++);
-          int16_t actual = predicted + delta;
-          actual = std::max(int16_t(0), std::min(actual, int16_t(255)));
-
-          // Output the restored sample value.
-          m_data[v * m_columns + u] = static_cast<uint8_t>(actual);
-        }
+void Downsampled::GetMacroRowData(uint8_t *out,
+                                  int macro_row,
+                                  const Mapper &mapper) const {
+  const int macro_columns = NumMacroBlocks(m_columns);
+
+  // The predictors of the macro row come first, followed by the deltas.
+  uint8_t *predictor_selection = out;
+  for (int mu = 0; mu < macro_columns; ++mu)
+    *out++ = EncodePredictor(SelectPredictor(mu, macro_row));
+  for (int mu = 0; mu < macro_columns; ++mu) {
+    int predictor = DecodePredictor(predictor_selection[mu]);
+    out = PackMacroBlock(out, mu, macro_row, predictor, mapper);
+  }
+}
+
+void Downsampled::InitBlockData(int rows, int columns) {
+  m_rows = rows;
+  m_columns = columns;
+  m_data.resize(m_rows * m_columns);
+}
+
+void Downsampled::SetMacroRowData(const uint8_t *in,
+                                  int macro_row,
+                                  const Mapper &mapper) {
+  const int macro_columns = NumMacroBlocks(m_columns);
+
+  const uint8_t *predictor_selection = in;
+  in += macro_columns;
+  for (int mu = 0; mu < macro_columns; ++mu) {
+    int predictor = DecodePredictor(predictor_selection[mu]);
+    in = UnpackMacroBlock(in, mu, macro_row, predictor, mapper);
+  }
+}
+
+int Downsampled::SelectPredictor(int mu, int mv) const {
+  const int u0 = mu * kMacroBlockSize;
+  const int v0 = mv * kMacroBlockSize;
+
+  // Clear the prediction error vector.
+  int predictor_error[kNumPredictors];
+  for (int i = 0; i < kNumPredictors; ++i)
+    predictor_error[i] = 0;
+
+  // Iterate over all the pixels of this macro block.
+  for (int dv = 0; dv < kMacroBlockSize; ++dv) {
+    int v = v0 + dv;
+    if (v >= m_rows)
+      break;
+
+    for (int du = 0; du < kMacroBlockSize; ++du) {
+      int u = u0 + du;
+      if (u >= m_columns)
+        break;
+
+      // Extract the three neighbour samples that we use for prediction.
+      int16_t s1, s2, s3;
+      if (du > 0 && dv > 0) {
+        s1 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u - 1]);
+        s2 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
+        s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
+      } else if (du > 0) {
+        s1 = s2 = s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
+      } else if (dv > 0) {
+        s1 = s2 = s3 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
+      } else {
+        s1 = s2 = s3 = 128;
+      }
+
+      // Try all the predictors.
+      for (int predictor = 0; predictor < kNumPredictors; ++predictor) {
+        // Calculate the prediction error for this predictor.
+        int16_t predicted = PredictSample(s1, s2, s3, predictor);
+        int16_t actual = static_cast<int16_t>(m_data[v * m_columns + u]);
+        int delta = static_cast<int>(actual - predicted);
+        int err = delta * delta;
+
+        // Accumulate the prediction error for this predictor.
+        predictor_error[predictor] += err;
+      }
+    }
+  }
+
+  // Select the best predictor for this macro block.
+  int best_predictor = 0;
+  int best_error = predictor_error[0];
+  for (int predictor = 1; predictor < kNumPredictors; ++predictor) {
+    if (predictor_error[predictor] < best_error) {
+      best_predictor = predictor;
+      best_error = predictor_error[predictor];
+    }
+  }
+  return best_predictor;
+}
+
+uint8_t *Downsampled::PackMacroBlock(uint8_t *out,
+                                     int mu,
+                                     int mv,
+                                     int predictor,
+                                     const Mapper &mapper) const {
+  const int u0 = mu * kMacroBlockSize;
+  const int v0 = mv * kMacroBlockSize;
+
+  // We use a temporary working buffer for the two most recent lines in the
+  // macro block.
+  uint8_t work_buf[kMacroBlockSize * 2];
+  uint8_t *lines[2] = {&work_buf[0], &work_buf[kMacroBlockSize]};
+
+  // Iterate over all the pixels of this macro block.
+  for (int dv = 0; dv < kMacroBlockSize; ++dv) {
+    int v = v0 + dv;
+    if (v >= m_rows)
+      break;
+
+    for (int du = 0; du < kMacroBlockSize; ++du) {
+      int u = u0 + du;
+      if (u >= m_columns)
+        break;
+
+      // Extract the three neighbour samples that we use for prediction.
+      int16_t s1, s2, s3;
+      if (du > 0 && dv > 0) {
+        s1 = static_cast<int16_t>(lines[0][du - 1]);
+        s2 = static_cast<int16_t>(lines[0][du]);
+        s3 = static_cast<int16_t>(lines[1][du - 1]);
+      } else if (du > 0) {
+        s1 = s2 = s3 = static_cast<int16_t>(lines[1][du - 1]);
+      } else if (dv > 0) {
+        s1 = s2 = s3 = static_cast<int16_t>(lines[0][du]);
+      } else {
+        s1 = s2 = s3 = 128;
+      }
+
+      // Predict the current sample.
+      int16_t predicted = PredictSample(s1, s2, s3, predictor);
+
+      // Calculate the delta to the prediction.
+      int16_t actual = static_cast<int16_t>(m_data[v * m_columns + u]);
+      int16_t delta = actual - predicted;
+      uint8_t delta8 = mapper.MapTo8Bit(delta);
+
+      // Compensate actual value for quantization (i.e. mimic the decoder).
+      actual = predicted + mapper.UnmapFrom8Bit(delta8);
+      actual = std::max(int16_t(0), std::min(actual, int16_t(255)));
+      lines[1][du] = static_cast<uint8_t>(actual);
+
+      // Output the quantized delta value.
+      *out++ = delta8;
+    }
+
+    std::swap(lines[0], lines[1]);
+  }
+
+  return out;
+}
+
+const uint8_t *Downsampled::UnpackMacroBlock(const uint8_t *in,
+                                             int mu,
+                                             int mv,
+                                             int predictor,
+                                             const Mapper &mapper) {
+  const int u0 = mu * kMacroBlockSize;
+  const int v0 = mv * kMacroBlockSize;
+
+  // Iterate over all the pixels of this macro block.
+  for (int dv = 0; dv < kMacroBlockSize; ++dv) {
+    int v = v0 + dv;
+    if (v >= m_rows)
+      break;
+
+    for (int du = 0; du < kMacroBlockSize; ++du) {
+      int u = u0 + du;
+      if (u >= m_columns)
+        break;
+
+      // Extract the three neighbour samples that we use for prediction.
+      int16_t s1, s2, s3;
+      if (du > 0 && dv > 0) {
+        s1 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u - 1]);
+        s2 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
+        s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
+      } else if (du > 0) {
+        s1 = s2 = s3 = static_cast<int16_t>(m_data[v * m_columns + u - 1]);
+      } else if (dv > 0) {
+        s1 = s2 = s3 = static_cast<int16_t>(m_data[(v - 1) * m_columns + u]);
+      } else {
+        s1 = s2 = s3 = 128;
       }
+
+      // Predict the current sample.
+      int16_t predicted = PredictSample(s1, s2, s3, predictor);
+
+      // Restore actual value.
+      int16_t delta = mapper.UnmapFrom8Bit(*in++);
+      int16_t actual = predicted + delta;
+      actual = std::max(int16_t(0), std::min(actual, int16_t(255)));
+
+      // Output the restored sample value.
+      m_data[v * m_columns + u] = static_cast<uint8_t>(actual);
     }
   }
+
+  return in;
 }
 
 }  // namespace himg
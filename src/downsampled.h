@@ -30,13 +30,44 @@ class Downsampled {
   void SetBlockData(
       const uint8_t *in, int rows, int columns, const Mapper &mapper);
 
+  // Blocked layout: Prediction never crosses a macro block boundary, so the
+  // block data can also be split into one independent part per macro block
+  // row (16 rows), each holding the predictors and the deltas of that row.
+  static int NumMacroRows(int rows);
+  static int MacroRow(int row);
+  static int MacroRowDataSize(int rows, int columns, int macro_row);
+  void GetMacroRowData(uint8_t *out,
+                       int macro_row,
+                       const Mapper &mapper) const;
+
+  // Allocate the samples, for use with SetMacroRowData(). Different macro
+  // rows may be set concurrently.
+  void InitBlockData(int rows, int columns);
+  void SetMacroRowData(const uint8_t *in,
+                       int macro_row,
+                       const Mapper &mapper);
+
   int rows() const { return m_rows; }
 
   int columns() const { return m_columns; }
 
   int Size() const { return m_rows * m_columns; }
 
+  const uint8_t *data() const { return m_data.data(); }
+
  private:
+  int SelectPredictor(int mu, int mv) const;
+  uint8_t *PackMacroBlock(uint8_t *out,
+                          int mu,
+                          int mv,
+                          int predictor,
+                          const Mapper &mapper) const;
+  const uint8_t *UnpackMacroBlock(const uint8_t *in,
+                                  int mu,
+                                  int mv,
+                                  int predictor,
+                                  const Mapper &mapper);
+
   int m_rows;
   int m_columns;
   std::vector<uint8_t> m_data;
@@ -14,7 +14,7 @@
 #include "common.h"
 #include "downsampled.h"
 #include "hadamard.h"
-#include "huffman_enc.h"
+#include "entropy_enc.h"
 #include "mapper.h"
 #include "quantize.h"
 #include "ycbcr.h"
@@ -53,7 +53,7 @@ void ExtractChannelBlock(int16_t *out,
 
 }  // namespace
 
-Encoder::Encoder() {
+Encoder::Encoder() : m_format_flags(0), m_write_block_index(false) {
 }
 
 bool Encoder::Encode(const uint8_t *data,
@@ -64,6 +64,8 @@ bool Encoder::Encode(const uint8_t *data,
                      int quality,
                      bool use_ycbcr) {
   m_packed_data.clear();
+  m_low_res_block_offsets.clear();
+  m_full_res_block_offsets.clear();
 
   m_quality = quality;
   m_use_ycbcr = use_ycbcr && (num_channels >= 3);
@@ -102,6 +104,10 @@ bool Encoder::Encode(const uint8_t *data,
   // Full resolution data.
   EncodeFullRes(color_space_data, width, height, pixel_stride, num_channels);
 
+  // Block index (optional).
+  if (m_write_block_index)
+    EncodeBlockIndex();
+
   // Update the RIFF header.
   UpdateRIFFStart();
 
@@ -139,7 +145,9 @@ void Encoder::UpdateRIFFStart() {
 void Encoder::EncodeHeader(int width,
                            int height,
                            int num_channels) {
-  const int header_size = 11;
+  // Format version 2 adds the format flags.
+  const int version = m_format_flags ? 2 : 1;
+  const int header_size = version >= 2 ? 12 : 11;
   m_packed_data.reserve(m_packed_data.size() + 8 + header_size);
 
   m_packed_data.push_back('F');
@@ -152,7 +160,7 @@ void Encoder::EncodeHeader(int width,
   m_packed_data.push_back((header_size >> 16) & 255);
   m_packed_data.push_back((header_size >> 24) & 255);
 
-  m_packed_data.push_back(1);  // Version
+  m_packed_data.push_back(version);
   m_packed_data.push_back(width & 255);
   m_packed_data.push_back((width >> 8) & 255);
   m_packed_data.push_back((width >> 16) & 255);
@@ -163,6 +171,8 @@ void Encoder::EncodeHeader(int width,
   m_packed_data.push_back((height >> 24) & 255);
   m_packed_data.push_back(num_channels);
   m_packed_data.push_back(m_use_ycbcr ? 1 : 0);  // Color space (RGB / YCbCr).
+  if (version >= 2)
+    m_packed_data.push_back(m_format_flags);
 }
 
 void Encoder::EncodeLowResMappingFunction() {
@@ -208,14 +218,43 @@ void Encoder::EncodeLowRes(const uint8_t *data,
   const int unpacked_size = channel_size * num_channels;
   std::vector<uint8_t> unpacked_data(unpacked_size);
 
-  // Get the low-res versions of the image fo all channels (delta encoded).
-  for (int chan = 0; chan < num_channels; ++chan) {
-    m_downsampled[chan].GetBlockData(unpacked_data.data() + chan * channel_size,
-                                     m_low_res_mapper);
-  }
+  int packed_size;
+  if (m_format_flags & kFormatBlockedLowRes) {
+    // Blocked layout: One Huffman block per macro block row, holding the
+    // data of all channels for that row, so that the decoder can decode the
+    // macro rows in parallel.
+    const int num_macro_rows = Downsampled::NumMacroRows(num_rows);
+    std::vector<int> block_sizes;
+    uint8_t *out = unpacked_data.data();
+    for (int macro_row = 0; macro_row < num_macro_rows; ++macro_row) {
+      const int macro_row_size =
+          Downsampled::MacroRowDataSize(num_rows, num_cols, macro_row);
+      for (int chan = 0; chan < num_channels; ++chan) {
+        m_downsampled[chan].GetMacroRowData(
+            out, macro_row, m_low_res_mapper);
+        out += macro_row_size;
+      }
+      block_sizes.push_back(macro_row_size * num_channels);
+    }
+
+    // Compress data.
+    packed_size = AppendPackedData(unpacked_data.data(),
+                                   unpacked_size,
+                                   block_sizes,
+                                   1,
+                                   &m_low_res_block_offsets);
+  } else {
+    // Get the low-res versions of the image fo all channels (delta encoded).
+    for (int chan = 0; chan < num_channels; ++chan) {
+      m_downsampled[chan].GetBlockData(
+          unpacked_data.data() + chan * channel_size, m_low_res_mapper);
+    }
 
-  // Compress data.
-  int packed_size = AppendPackedData(unpacked_data.data(), unpacked_size, 0);
+    // Compress data.
+    packed_size = AppendPackedData(unpacked_data.data(),
+                                   unpacked_size,
+                                   std::vector<int>(1, unpacked_size));
+  }
   std::cout << "Low resolution data: " << packed_size << " bytes.\n";
 }
 
@@ -270,13 +309,29 @@ void Encoder::EncodeFullRes(const uint8_t *data,
   const int unpacked_size = num_blocks * 64 * num_channels;
   std::vector<uint8_t> unpacked_data(unpacked_size);
 
+  // Each block row is normally stored as one segment (one Huffman block for
+  // all channels). With kFormatChannelBlocks, it is split into narrower
+  // segments, and each channel of a segment is stored in a Huffman block of
+  // its own.
+  const int horizontal_blocks = (width + 7) >> 3;
+  const bool use_channel_blocks = (m_format_flags & kFormatChannelBlocks) != 0;
+  const int segment_width =
+      use_channel_blocks ? kFullResSegmentWidth : horizontal_blocks;
+
+  // With kFormatInterleavedFullRes, the rows (coefficient planes) of each
+  // Huffman block are reordered so that they can be coded as substreams.
+  const int num_substreams = (m_format_flags & kFormatInterleavedFullRes)
+                                 ? kFullResSubstreams
+                                 : 1;
+  const int huffman_block_rows = use_channel_blocks ? 64 : 64 * num_channels;
+
   // Process all the 8x8 blocks.
-  int unpacked_idx = 0;
+  int row_idx = 0;
   for (int y = 0; y < height; y += 8) {
     // Vertical block coordinate (v).
     int v = y >> 3;
 
-    // Interleave all channels per block row.
+    // Interleave all channels per block row (or per segment).
     for (int chan = 0; chan < num_channels; ++chan) {
       // Get the low-res (divided by 8x8) image for this channel.
       Downsampled &downsampled = m_downsampled[chan];
@@ -316,34 +371,111 @@ void Encoder::EncodeFullRes(const uint8_t *data,
         uint8_t packed[64];
         m_quantize.Pack(packed, buf1, is_chroma_channel, m_full_res_mapper);
 
-        // Store quantized data in the unpacked buffer.
+        // Store quantized data in the unpacked buffer (one coefficient plane
+        // at a time within the segment of this block).
+        int segment_start = u - (u % segment_width);
+        int segment_blocks =
+            std::min(segment_width, horizontal_blocks - segment_start);
+        uint8_t *dst = &unpacked_data[row_idx +
+                                      segment_start * 64 * num_channels +
+                                      (u - segment_start)];
+        int first_row = chan * 64;
+        if (use_channel_blocks) {
+          dst += chan * segment_blocks * 64;
+          first_row = 0;
+        }
         for (int i = 0; i < 64; ++i) {
-          unpacked_data[unpacked_idx + u + i * downsampled.columns()] =
-              packed[kIndexLUT[i]];
+          int row = SubstreamRowIndex(
+              first_row + i, huffman_block_rows, num_substreams);
+          dst[row * segment_blocks] = packed[kIndexLUT[i]];
         }
       }
-
-      unpacked_idx += downsampled.columns() * 64;
     }
+
+    row_idx += horizontal_blocks * 64 * num_channels;
   }
 
   // Compress all channels.
-  int block_size = m_downsampled[0].columns() * num_channels * 64;
-  int packed_size = AppendPackedData(
-      unpacked_data.data(), unpacked_size, block_size);
+  std::vector<int> block_sizes;
+  for (int y = 0; y < height; y += 8) {
+    for (int u = 0; u < horizontal_blocks; u += segment_width) {
+      int segment_blocks = std::min(segment_width, horizontal_blocks - u);
+      if (use_channel_blocks) {
+        for (int chan = 0; chan < num_channels; ++chan)
+          block_sizes.push_back(segment_blocks * 64);
+      } else {
+        block_sizes.push_back(segment_blocks * num_channels * 64);
+      }
+    }
+  }
+  int packed_size = AppendPackedData(unpacked_data.data(),
+                                     unpacked_size,
+                                     block_sizes,
+                                     num_substreams,
+                                     &m_full_res_block_offsets);
   std::cout << "Full resolution data: " << packed_size << " bytes.\n";
 }
 
-int Encoder::AppendPackedData(
-    const uint8_t *unpacked_data, int unpacked_size, int block_size) {
+void Encoder::EncodeBlockIndex() {
+  // The block tables of the LRES and FRES data: The number of blocks,
+  // followed by the offset of each block (relative to the start of the chunk
+  // data). Data without blocks has an empty table.
+  std::vector<uint32_t> index;
+  const std::vector<int> *tables[] = {&m_low_res_block_offsets,
+                                      &m_full_res_block_offsets};
+  for (const std::vector<int> *offsets : tables) {
+    if (offsets->size() > 1) {
+      index.push_back(static_cast<uint32_t>(offsets->size()));
+      index.insert(index.end(), offsets->begin(), offsets->end());
+    } else {
+      index.push_back(0);
+    }
+  }
+
+  m_packed_data.push_back('B');
+  m_packed_data.push_back('I');
+  m_packed_data.push_back('D');
+  m_packed_data.push_back('X');
+
+  const int index_size = static_cast<int>(index.size()) * 4;
+  m_packed_data.push_back(index_size & 255);
+  m_packed_data.push_back((index_size >> 8) & 255);
+  m_packed_data.push_back((index_size >> 16) & 255);
+  m_packed_data.push_back((index_size >> 24) & 255);
+
+  for (uint32_t value : index) {
+    m_packed_data.push_back(value & 255);
+    m_packed_data.push_back((value >> 8) & 255);
+    m_packed_data.push_back((value >> 16) & 255);
+    m_packed_data.push_back((value >> 24) & 255);
+  }
+}
+
+int Encoder::AppendPackedData(const uint8_t *unpacked_data,
+                              int unpacked_size,
+                              const std::vector<int> &block_sizes,
+                              int num_substreams,
+                              std::vector<int> *block_offsets) {
+  // The LRES and FRES data are coded with the same entropy coder.
+  const EntropyCoder coder =
+      (m_format_flags & kFormatAnsCoding) ? kEntropyAns : kEntropyHuffman;
+  const int num_blocks = static_cast<int>(block_sizes.size());
   const int packed_base_idx = static_cast<int>(m_packed_data.size());
-  m_packed_data.resize(packed_base_idx + 4 +
-                       HuffmanEnc::MaxCompressedSize(unpacked_size));
+  if (block_offsets)
+    block_offsets->resize(num_blocks);
+  m_packed_data.resize(
+      packed_base_idx + 4 +
+      EntropyEnc::MaxCompressedSize(
+          coder, unpacked_size, num_blocks * num_substreams));
   int packed_size =
-      HuffmanEnc::Compress(m_packed_data.data() + packed_base_idx + 4,
+      EntropyEnc::Compress(coder,
+                           m_packed_data.data() + packed_base_idx + 4,
                            unpacked_data,
                            unpacked_size,
-                           block_size);
+                           block_sizes.data(),
+                           num_blocks,
+                           num_substreams,
+                           block_offsets ? block_offsets->data() : nullptr);
   m_packed_data[packed_base_idx] = packed_size & 255;
   m_packed_data[packed_base_idx + 1] = (packed_size >> 8) & 255;
   m_packed_data[packed_base_idx + 2] = (packed_size >> 16) & 255;
@@ -21,6 +21,17 @@ class Encoder {
  public:
   Encoder();
 
+  // Enable optional format features (a combination of the kFormat* flags in
+  // common.h). Older decoders can not read images that use them.
+  void SetFormatFlags(uint8_t flags) { m_format_flags = flags; }
+
+  // Write a block index chunk (BIDX), that gives the offsets of the LRES and
+  // FRES blocks so that decoders can find them without scanning the data.
+  // Decoders that do not know about the index ignore it.
+  void SetWriteBlockIndex(bool write_block_index) {
+    m_write_block_index = write_block_index;
+  }
+
   bool Encode(const uint8_t *data,
               int width,
               int height,
@@ -50,16 +61,24 @@ class Encoder {
                      int height,
                      int pixel_stride,
                      int num_channels);
+  void EncodeBlockIndex();
 
-  int AppendPackedData(
-      const uint8_t *unpacked_data, int unpacked_size, int block_size);
+  int AppendPackedData(const uint8_t *unpacked_data,
+                       int unpacked_size,
+                       const std::vector<int> &block_sizes,
+                       int num_substreams = 1,
+                       std::vector<int> *block_offsets = nullptr);
 
+  uint8_t m_format_flags;
+  bool m_write_block_index;
   int m_quality;
   bool m_use_ycbcr;
   Quantize m_quantize;
   LowResMapper m_low_res_mapper;
   FullResMapper m_full_res_mapper;
   std::vector<Downsampled> m_downsampled;
+  std::vector<int> m_low_res_block_offsets;
+  std::vector<int> m_full_res_block_offsets;
   std::vector<uint8_t> m_packed_data;
 };
 
@@ -0,0 +1,315 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ENTROPY_COMMON_H_
+#define ENTROPY_COMMON_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "common.h"
+
+namespace himg {
+
+// The stream layout that is shared by all the entropy coders (see EntropyDec):
+// The bit order of the (sub)streams, and the packed sizes of the blocks and
+// substreams.
+
+// The maximum number of substreams per block.
+const int kMaxSubstreams = 4;
+
+// A class to help decoding binary data. The bits are read through a 64-bit
+// bit buffer that is refilled with (unaligned) 64-bit loads, so peeking and
+// consuming bits are single shift and mask operations.
+class BitStream {
+ public:
+  // Initialize a bitstream (the default is an empty bitstream).
+  BitStream()
+      : m_ptr(nullptr),
+        m_end_ptr(nullptr),
+        m_bits(0),
+        m_bit_count(0),
+        m_read_failed(false) {}
+  BitStream(const uint8_t *buf, int size)
+      : m_ptr(buf),
+        m_end_ptr(buf + size),
+        m_bits(0),
+        m_bit_count(0),
+        m_read_failed(false) {}
+
+  // Refill the bit buffer. Afterwards at least 56 bits are available, unless
+  // the end of the stream is reached (the bits past the end read as zeros).
+  FORCE_INLINE void Refill() {
+    if (LIKELY(HasSlack())) {
+      // Load the next eight bytes, and append as many whole bytes as fit in
+      // the bit buffer (at least seven). Bits that are shifted out are loaded
+      // again by the next refill, and the ones that remain above m_bit_count
+      // are the same as the next refill will append, so they do no harm.
+      uint64_t word;
+      std::memcpy(&word, m_ptr, sizeof(word));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+      word = __builtin_bswap64(word);
+#endif
+      m_bits |= word << m_bit_count;
+      m_ptr += (63 - m_bit_count) >> 3;
+      m_bit_count |= 56;
+    } else {
+      RefillTail();
+    }
+  }
+
+  // Check if there is enough input left for the next Refill() to load a
+  // whole 64-bit word, i.e. that it will make at least 56 bits available.
+  FORCE_INLINE bool HasSlack() const {
+    return m_end_ptr - m_ptr >= 8;
+  }
+
+  // Get the number of bits that are available in the bit buffer.
+  int bits_available() const {
+    return m_bit_count;
+  }
+
+  // Peek bits from the bit buffer (read without advancing the pointer).
+  // Only bits that are available may be peeked.
+  FORCE_INLINE uint32_t PeekBits(int bits) const {
+    // Note: With BMI2 this compiles to a single BZHI instruction.
+    uint64_t mask = (static_cast<uint64_t>(1) << bits) - 1;
+    return static_cast<uint32_t>(m_bits & mask);
+  }
+
+  // Advance the pointer by N bits (N must not exceed the available bits).
+  FORCE_INLINE void Advance(int N) {
+    m_bits >>= N;
+    m_bit_count -= N;
+  }
+
+  // Read one bit from a bitstream (refilling the bit buffer if necessary).
+  FORCE_INLINE int ReadBit() {
+    if (UNLIKELY(m_bit_count < 1)) {
+      Refill();
+      if (UNLIKELY(m_bit_count < 1)) {
+        m_read_failed = true;
+        return 0;
+      }
+    }
+    int x = static_cast<int>(m_bits & 1);
+    Advance(1);
+    return x;
+  }
+
+  // Read up to 32 bits from a bitstream (refilling the bit buffer if
+  // necessary).
+  FORCE_INLINE uint32_t ReadBits(int bits) {
+    if (UNLIKELY(m_bit_count < bits)) {
+      Refill();
+      if (UNLIKELY(m_bit_count < bits)) {
+        m_read_failed = true;
+        return 0;
+      }
+    }
+    uint32_t x = PeekBits(bits);
+    Advance(bits);
+    return x;
+  }
+
+  // Align the stream to a byte boundary (do nothing if already aligned).
+  void AlignToByte() {
+    Advance(m_bit_count & 7);
+  }
+
+  // Check if we have reached the end of the buffer. This is a rough estimate
+  // (not too short, and not too far): only padding may be left.
+  bool AtTheEnd() const {
+    return (m_end_ptr - m_ptr) * 8 + m_bit_count < 8;
+  }
+
+  // Get the current position (only valid when aligned to a byte boundary).
+  const uint8_t *byte_ptr() const {
+    return m_ptr - (m_bit_count >> 3);
+  }
+
+  const uint8_t *end_ptr() const {
+    return m_end_ptr;
+  }
+
+  // Check if any of the Read*() methods tried to read past the end.
+  bool read_failed() const {
+    return m_read_failed;
+  }
+
+ private:
+  void RefillTail() {
+    // Near the end of the stream, load a byte at a time.
+    while (m_bit_count <= 56 && m_ptr < m_end_ptr) {
+      m_bits |= static_cast<uint64_t>(*m_ptr++) << m_bit_count;
+      m_bit_count += 8;
+    }
+  }
+
+  // Next byte to load into the bit buffer.
+  const uint8_t *m_ptr;
+  const uint8_t *m_end_ptr;
+
+  // The bit buffer holds m_bit_count bits, starting with the next bit in the
+  // least significant bit. Any bits above those are zero or hold the
+  // following bits of the stream.
+  uint64_t m_bits;
+  int m_bit_count;
+
+  bool m_read_failed;
+};
+
+// A class to help encoding binary data (the counterpart of BitStream). The
+// bits are collected in a 64-bit bit buffer, and written a byte at a time.
+class OutBitstream {
+ public:
+  // Initialize a bitstream.
+  explicit OutBitstream(uint8_t *buf)
+      : m_base_ptr(buf), m_byte_ptr(buf), m_bits(0), m_bit_count(0) {}
+
+  // Write up to 32 bits to a bitstream (the least significant bit first).
+  void WriteBits(uint32_t x, int bits) {
+    m_bits |= static_cast<uint64_t>(x) << m_bit_count;
+    m_bit_count += bits;
+    while (m_bit_count >= 8) {
+      *m_byte_ptr++ = static_cast<uint8_t>(m_bits);
+      m_bits >>= 8;
+      m_bit_count -= 8;
+    }
+  }
+
+  // Align the stream to a byte boundary, writing zero bits (do nothing if
+  // already aligned).
+  void AlignToByte() {
+    if (m_bit_count > 0)
+      WriteBits(0, 8 - m_bit_count);
+  }
+
+  // Advance N bytes (the stream must be aligned).
+  void AdvanceBytes(int N) {
+    m_byte_ptr += N;
+  }
+
+  // Get the size of the stream, in bytes. A partial byte is counted, but is
+  // only written by AlignToByte().
+  int Size() const {
+    int total_bytes = static_cast<int>(m_byte_ptr - m_base_ptr);
+    if (m_bit_count > 0) {
+      ++total_bytes;
+    }
+    return total_bytes;
+  }
+
+  uint8_t *byte_ptr() {
+    return m_byte_ptr;
+  }
+
+ private:
+  uint8_t *m_base_ptr;
+  uint8_t *m_byte_ptr;
+  uint64_t m_bits;
+  int m_bit_count;
+};
+
+// Block and substream sizes are stored as two bytes, or as four bytes if the
+// high bit of the first two is set.
+
+// Get the number of bytes that a packed size takes.
+inline int PackedSizeBytes(int packed_size) {
+  return packed_size <= 0x7fff ? 2 : 4;
+}
+
+// Read a packed size from [ptr, end). Returns the number of bytes read, or
+// zero if there is not enough data.
+inline int ReadPackedSize(const uint8_t *ptr,
+                          const uint8_t *end,
+                          uint32_t *size) {
+  if (end - ptr < 2)
+    return 0;
+  *size = static_cast<uint32_t>(ptr[0]) | (static_cast<uint32_t>(ptr[1]) << 8);
+  if (!(*size & 0x8000))
+    return 2;
+  if (end - ptr < 4)
+    return 0;
+  *size = (*size & 0x7fff) | (static_cast<uint32_t>(ptr[2]) << 15) |
+          (static_cast<uint32_t>(ptr[3]) << 23);
+  return 4;
+}
+
+// Write a packed size (the stream is first aligned to a byte boundary).
+inline void WritePackedSize(OutBitstream *stream, int packed_size) {
+  stream->AlignToByte();
+  if (packed_size <= 0x7fff) {
+    stream->WriteBits(packed_size, 16);
+  } else {
+    stream->WriteBits((packed_size & 0x7fff) | 0x8000, 16);
+    stream->WriteBits(packed_size >> 15, 16);
+  }
+}
+
+// Split a block into its substreams. The block starts with the packed sizes of
+// all the substreams except the last one, followed by the substreams. Returns
+// false if the sizes do not fit in the block.
+inline bool ReadSubstreams(const uint8_t *block,
+                           int block_size,
+                           int num_substreams,
+                           BitStream *substreams) {
+  const uint8_t *ptr = block;
+  const uint8_t *end = block + block_size;
+  uint32_t sizes[kMaxSubstreams];
+  if (num_substreams < 1 || num_substreams > kMaxSubstreams)
+    return false;
+  for (int k = 0; k < num_substreams - 1; ++k) {
+    int size_bytes = ReadPackedSize(ptr, end, &sizes[k]);
+    if (size_bytes == 0)
+      return false;
+    ptr += size_bytes;
+  }
+  for (int k = 0; k < num_substreams - 1; ++k) {
+    if (sizes[k] > static_cast<uint32_t>(end - ptr))
+      return false;
+    substreams[k] = BitStream(ptr, static_cast<int>(sizes[k]));
+    ptr += sizes[k];
+  }
+  substreams[num_substreams - 1] = BitStream(ptr, static_cast<int>(end - ptr));
+  return true;
+}
+
+// Write a block that is made up of num_substreams packed substreams (substream
+// k is part_sizes[k] bytes at parts + k * part_stride): The packed size of the
+// block (if use_blocks is true), the packed sizes of all the substreams except
+// the last one, and the substreams. The block starts at a byte boundary.
+inline void WriteBlock(OutBitstream *stream,
+                       bool use_blocks,
+                       const uint8_t *parts,
+                       int part_stride,
+                       const int *part_sizes,
+                       int num_substreams) {
+  if (use_blocks) {
+    int packed_size = 0;
+    for (int k = 0; k < num_substreams; ++k) {
+      packed_size += part_sizes[k];
+      if (k < num_substreams - 1)
+        packed_size += PackedSizeBytes(part_sizes[k]);
+    }
+    WritePackedSize(stream, packed_size);
+  }
+  for (int k = 0; k < num_substreams - 1; ++k)
+    WritePackedSize(stream, part_sizes[k]);
+  stream->AlignToByte();
+  for (int k = 0; k < num_substreams; ++k) {
+    const uint8_t *part = parts + part_stride * k;
+    std::copy(part, part + part_sizes[k], stream->byte_ptr());
+    stream->AdvanceBytes(part_sizes[k]);
+  }
+}
+
+}  // namespace himg
+
+#endif  // ENTROPY_COMMON_H_
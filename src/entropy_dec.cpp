@@ -0,0 +1,154 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "entropy_dec.h"
+
+#include <algorithm>
+
+#include "ans_dec.h"
+#include "entropy_common.h"
+#include "huffman_dec.h"
+
+namespace himg {
+
+std::unique_ptr<EntropyDec> EntropyDec::Create(EntropyCoder coder,
+                                               const uint8_t *in,
+                                               int in_size,
+                                               bool use_blocks,
+                                               int num_substreams) {
+  std::unique_ptr<EntropyDec> dec;
+  switch (coder) {
+    case kEntropyHuffman:
+      dec.reset(new HuffmanDec(in, in_size, use_blocks, num_substreams));
+      break;
+    case kEntropyAns:
+      dec.reset(new AnsDec(in, in_size, use_blocks, num_substreams));
+      break;
+  }
+  return dec;
+}
+
+int EntropyDec::BlockOffset(int block_no) const {
+  Block block;
+  if (!m_use_blocks || !GetBlock(block_no, &block))
+    return 0;
+  return static_cast<int>(block.data - m_in);
+}
+
+bool EntropyDec::UncompressBlock(const RowOutput &out, int block_no) const {
+  // The block is first uncompressed to bytes, and then translated to rows.
+  // Substream k holds rows k, k + N, k + 2N, ... so the rows are stored in the
+  // order 0, N, 2N, ..., 1, N + 1, 2N + 1, ...
+  const int n = m_num_substreams;
+  const int row_length = out.row_length;
+  const int num_rows = out.num_rows;
+  if (num_rows % n != 0)
+    return false;
+  std::unique_ptr<uint8_t[]> symbols(new uint8_t[row_length * num_rows]);
+  if (!UncompressBlock(symbols.get(), row_length * num_rows, block_no))
+    return false;
+  for (int row = 0; row < num_rows; ++row) {
+    const uint8_t *src =
+        &symbols[SubstreamRowIndex(row, num_rows, n) * row_length];
+    int16_t *dst = out.rows[row];
+    const int16_t *lut = out.luts[row];
+    for (int x = 0; x < row_length; ++x)
+      dst[x] = lut[src[x]];
+    if (out.last_nonzero) {
+      // Note: We tag the nonzero symbols rather than the literals (the result
+      // is the same, or more exact).
+      uint8_t *last = out.last_nonzero[row];
+      const uint8_t tag = static_cast<uint8_t>(row & 63);
+      for (int x = 0; x < row_length; ++x) {
+        uint8_t nonzero_tag = src[x] != 0 ? tag : 0;
+        last[x] = std::max(last[x], nonzero_tag);
+      }
+    }
+  }
+  return true;
+}
+
+bool EntropyDec::FindBlocks() {
+  const uint8_t *in_end = m_in + m_in_size;
+  const uint8_t *available_end = m_in + m_available_size;
+
+  // A stream without blocks is a single block, that is available once the
+  // entire stream has been received.
+  if (!m_use_blocks) {
+    if (m_blocks.empty() && available_end == in_end) {
+      Block block = {m_next_block_ptr,
+                     static_cast<int>(in_end - m_next_block_ptr)};
+      m_blocks.push_back(block);
+    }
+    return true;
+  }
+
+  // With a block index, each block extends to the start of the next one (the
+  // packed sizes are checked by GetBlock()).
+  if (!m_block_index.empty()) {
+    const int num_blocks = static_cast<int>(m_block_index.size());
+    while (static_cast<int>(m_blocks.size()) < num_blocks) {
+      const int k = static_cast<int>(m_blocks.size());
+      const int start = static_cast<int>(m_next_block_ptr - m_in);
+      const int end = k + 1 < num_blocks ? m_block_index[k + 1] : m_in_size;
+      if (m_block_index[k] != start || end <= start || end > m_in_size)
+        return false;
+      if (end > m_available_size)
+        break;
+      Block block = {m_next_block_ptr, end - start};
+      m_blocks.push_back(block);
+      m_next_block_ptr = m_in + end;
+    }
+    return true;
+  }
+
+  // Recover the individual blocks that have been received.
+  while (m_next_block_ptr < in_end) {
+    // Read the packed size (two or four bytes).
+    const uint8_t *ptr = m_next_block_ptr;
+    uint32_t packed_block_size;
+    int size_bytes = ReadPackedSize(ptr, available_end, &packed_block_size);
+    if (size_bytes == 0)
+      break;
+    ptr += size_bytes;
+
+    // Check that the block fits in the stream, and wait for it to arrive.
+    if (packed_block_size > static_cast<uint32_t>(in_end - ptr))
+      return false;
+    if (packed_block_size > static_cast<uint32_t>(available_end - ptr))
+      break;
+
+    Block block = {ptr, static_cast<int>(packed_block_size)};
+    m_blocks.push_back(block);
+    m_next_block_ptr = ptr + packed_block_size;
+  }
+
+  return true;
+}
+
+bool EntropyDec::GetBlock(int block_no, Block *block) const {
+  if (block_no < 0 || block_no >= static_cast<int>(m_blocks.size()))
+    return false;
+  *block = m_blocks[block_no];
+
+  // The packed size of an indexed block must fill the rest of the block.
+  if (m_use_blocks && !m_block_index.empty()) {
+    uint32_t packed_block_size;
+    int size_bytes = ReadPackedSize(
+        block->data, block->data + block->size, &packed_block_size);
+    if (size_bytes == 0 ||
+        packed_block_size != static_cast<uint32_t>(block->size - size_bytes)) {
+      return false;
+    }
+    block->data += size_bytes;
+    block->size -= size_bytes;
+  }
+  return true;
+}
+
+}  // namespace himg
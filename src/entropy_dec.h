@@ -0,0 +1,161 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ENTROPY_DEC_H_
+#define ENTROPY_DEC_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+namespace himg {
+
+// The interface of the entropy decoders (one per EntropyCoder). All coders
+// use the same stream layout: A header (e.g. the Huffman tree), followed by
+// the blocks (each one prefixed by its packed size if there is more than one
+// block), where each block may be made up of several substreams (prefixed by
+// the packed sizes of all but the last one). The helpers for the shared parts
+// of the layout are in entropy_common.h.
+class EntropyDec {
+ public:
+  // An output layout for UncompressBlock() that writes 16-bit values rather
+  // than bytes. The uncompressed stream is split into num_rows rows of
+  // row_length symbols each, and symbol x of row r is stored as luts[r][x]
+  // in rows[r]. Zero runs are written as zeros, so luts[r][0] must be zero.
+  //
+  // If last_nonzero is set, then each time a literal (i.e. not part of a zero
+  // run) is stored in column c of row r, last_nonzero[r][c] is set to r % 64.
+  // When each group of 64 rows holds the coefficients of a set of blocks (one
+  // block per column), this gives the position of the last nonzero
+  // coefficient of each block (or slightly more, since a literal may be zero).
+  // The caller must initialize the entries (normally to zero).
+  //
+  // For a block with N substreams, num_rows must be a multiple of N, and
+  // substream k holds rows k, k + N, k + 2N, ... (the rows are given in their
+  // natural order).
+  struct RowOutput {
+    int row_length;
+    int num_rows;
+    int16_t *const *rows;
+    const int16_t *const *luts;
+    uint8_t *const *last_nonzero;
+  };
+
+  // Create a decoder for the given coder. If use_blocks is true, the stream is
+  // divided into several blocks that can be uncompressed independently (see
+  // UncompressBlock()). If num_substreams is greater than one, each block is
+  // made up of that many substreams (see EntropyEnc::Compress()).
+  static std::unique_ptr<EntropyDec> Create(EntropyCoder coder,
+                                            const uint8_t *in,
+                                            int in_size,
+                                            bool use_blocks,
+                                            int num_substreams = 1);
+
+  virtual ~EntropyDec() {}
+
+  // Use an index of the block positions (the offset of the packed size of
+  // each block, relative to the start of the stream) instead of scanning the
+  // stream for the blocks. The packed size of a block is then read when the
+  // block is uncompressed, so any block can be found without touching the
+  // data of the blocks before it. This must be called before Init() or
+  // InitPartial(). An empty index (or a stream without blocks) means that the
+  // stream is scanned for the blocks.
+  void SetBlockIndex(const std::vector<int> &block_offsets) {
+    m_block_index = block_offsets;
+  }
+
+  // Decode the stream header (e.g. the Huffman tree) and find the blocks.
+  virtual bool Init() = 0;
+
+  // Decode as much as possible of the stream header and the block sizes,
+  // given that only the first available_size bytes of the stream have been
+  // received so far. This can be called repeatedly as more data arrives.
+  // Returns false if the data is invalid.
+  virtual bool InitPartial(int available_size) = 0;
+
+  // Get the number of blocks that have been completely received (only valid
+  // after Init() or InitPartial()). A stream without blocks counts as a single
+  // block.
+  int NumAvailableBlocks() const {
+    return static_cast<int>(m_blocks.size());
+  }
+
+  // Get the byte offset of a block, relative to the start of the stream.
+  int BlockOffset(int block_no) const;
+
+  // Uncompress the stream (requires that Init() has been called first).
+  virtual bool Uncompress(uint8_t *out, int out_size) const = 0;
+
+  // Uncompress a single block of the stream (requires that Init() has been
+  // called first). A stream without blocks is treated as a single block.
+  // The substreams of a block are written one after the other.
+  virtual bool UncompressBlock(uint8_t *out,
+                               int out_size,
+                               int block_no) const = 0;
+
+  // Uncompress a single block into rows of 16-bit values (see RowOutput). The
+  // default implementation uncompresses the block to bytes, and translates
+  // them to rows.
+  virtual bool UncompressBlock(const RowOutput &out, int block_no) const;
+
+ protected:
+  // A block of the stream (the data that follows its packed size).
+  struct Block {
+    const uint8_t *data;
+    int size;
+  };
+
+  EntropyDec(const uint8_t *in,
+             int in_size,
+             bool use_blocks,
+             int num_substreams)
+      : m_in(in),
+        m_in_size(in_size),
+        m_available_size(0),
+        m_use_blocks(use_blocks),
+        m_num_substreams(num_substreams),
+        m_next_block_ptr(nullptr) {}
+
+  // Find the blocks that have been received so far (see InitPartial()). The
+  // subclass must have decoded the stream header, and set m_next_block_ptr to
+  // the first byte after it. Returns false if the data is invalid.
+  bool FindBlocks();
+
+  // Check that all the blocks have been found (after the whole stream has been
+  // received).
+  bool FoundAllBlocks() const {
+    return !m_use_blocks || m_next_block_ptr == m_in + m_in_size;
+  }
+
+  // Get an available block. Returns false if the block is not available, or
+  // if its packed size does not match the block index.
+  bool GetBlock(int block_no, Block *block) const;
+
+  const uint8_t *m_in;
+  int m_in_size;
+  int m_available_size;
+  bool m_use_blocks;
+
+  // The number of substreams per block.
+  const int m_num_substreams;
+
+  // The first byte after the blocks that have been found (nullptr until the
+  // stream header has been decoded).
+  const uint8_t *m_next_block_ptr;
+
+ private:
+  // With a block index, the blocks include their packed sizes.
+  std::vector<Block> m_blocks;
+  std::vector<int> m_block_index;
+};
+
+}  // namespace himg
+
+#endif  // ENTROPY_DEC_H_
@@ -0,0 +1,56 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "entropy_enc.h"
+
+#include "ans_enc.h"
+#include "huffman_enc.h"
+
+namespace himg {
+
+int EntropyEnc::MaxCompressedSize(EntropyCoder coder,
+                                  int uncompressed_size,
+                                  int num_streams) {
+  switch (coder) {
+    case kEntropyAns:
+      return AnsEnc::MaxCompressedSize(uncompressed_size, num_streams);
+    default:
+      // Each stream has a size of up to four bytes.
+      return HuffmanEnc::MaxCompressedSize(uncompressed_size) + 4 * num_streams;
+  }
+}
+
+int EntropyEnc::Compress(EntropyCoder coder,
+                         uint8_t *out,
+                         const uint8_t *in,
+                         int in_size,
+                         const int *block_sizes,
+                         int num_blocks,
+                         int num_substreams,
+                         int *block_offsets) {
+  switch (coder) {
+    case kEntropyAns:
+      return AnsEnc::Compress(out,
+                              in,
+                              in_size,
+                              block_sizes,
+                              num_blocks,
+                              num_substreams,
+                              block_offsets);
+    default:
+      return HuffmanEnc::Compress(out,
+                                  in,
+                                  in_size,
+                                  block_sizes,
+                                  num_blocks,
+                                  num_substreams,
+                                  block_offsets);
+  }
+}
+
+}  // namespace himg
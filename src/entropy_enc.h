@@ -0,0 +1,44 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef ENTROPY_ENC_H_
+#define ENTROPY_ENC_H_
+
+#include <cstdint>
+
+#include "common.h"
+
+namespace himg {
+
+// Entropy coding with any of the coders (see EntropyDec for the stream
+// layout).
+class EntropyEnc {
+ public:
+  // Get the maximum compressed size of the input data, when it is coded as
+  // num_streams streams in total (blocks times substreams).
+  static int MaxCompressedSize(EntropyCoder coder,
+                               int uncompressed_size,
+                               int num_streams);
+
+  // Compress the input data as num_blocks blocks of different sizes (the
+  // sizes must add up to in_size), with num_substreams substreams per block
+  // (see HuffmanEnc::Compress()). If block_offsets is not null, it receives
+  // the byte offset of each block.
+  static int Compress(EntropyCoder coder,
+                      uint8_t *out,
+                      const uint8_t *in,
+                      int in_size,
+                      const int *block_sizes,
+                      int num_blocks,
+                      int num_substreams = 1,
+                      int *block_offsets = nullptr);
+};
+
+}  // namespace himg
+
+#endif  // ENTROPY_ENC_H_
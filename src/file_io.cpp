@@ -0,0 +1,221 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "file_io.h"
+
+#include <cerrno>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HIMG_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Output files are only mapped where the blocks can be reserved up front with
+// posix_fallocate() (a write to a mapped page that can not be backed by disk
+// raises SIGBUS rather than returning an error).
+#if defined(__unix__)
+#define HIMG_USE_OUTPUT_MMAP
+#endif
+
+namespace himg {
+
+namespace {
+
+#if defined(HIMG_USE_MMAP)
+bool WriteAll(int fd, const uint8_t *data, int64_t size) {
+  while (size > 0) {
+    ssize_t count = write(fd, data, static_cast<size_t>(size));
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += count;
+    size -= static_cast<int64_t>(count);
+  }
+  return true;
+}
+#endif
+
+}  // namespace
+
+InputFile::InputFile() : m_data(nullptr), m_size(0), m_mapped(false) {
+}
+
+InputFile::~InputFile() {
+  Close();
+}
+
+bool InputFile::Open(const char *file_name) {
+  Close();
+
+#if defined(HIMG_USE_MMAP)
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return false;
+  }
+  m_size = static_cast<int64_t>(file_stat.st_size);
+
+  // Map the file (an empty file can not be mapped, but has no data anyway).
+  // The mapping stays valid after the file descriptor is closed.
+  if (m_size > 0) {
+    void *addr = mmap(
+        nullptr, static_cast<size_t>(m_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      // The decoders mostly read the data front to back, and all of it is
+      // needed, so ask for aggressive read-ahead.
+      posix_madvise(addr, static_cast<size_t>(m_size), POSIX_MADV_SEQUENTIAL);
+      posix_madvise(addr, static_cast<size_t>(m_size), POSIX_MADV_WILLNEED);
+      m_data = static_cast<const uint8_t *>(addr);
+      m_mapped = true;
+      close(fd);
+      return true;
+    }
+  }
+  close(fd);
+#endif
+
+  // Fall back to reading the file into memory.
+  std::ifstream f(file_name, std::ifstream::in | std::ifstream::binary);
+  if (!f.good())
+    return false;
+  f.seekg(0, std::ifstream::end);
+  m_size = static_cast<int64_t>(f.tellg());
+  f.seekg(0, std::ifstream::beg);
+  m_buffer.resize(static_cast<size_t>(m_size));
+  f.read(reinterpret_cast<char *>(m_buffer.data()), m_size);
+  if (!f.good()) {
+    Close();
+    return false;
+  }
+  m_data = m_buffer.data();
+  return true;
+}
+
+void InputFile::Close() {
+#if defined(HIMG_USE_MMAP)
+  if (m_mapped) {
+    munmap(const_cast<uint8_t *>(m_data), static_cast<size_t>(m_size));
+  }
+#endif
+  m_buffer.clear();
+  m_buffer.shrink_to_fit();
+  m_data = nullptr;
+  m_size = 0;
+  m_mapped = false;
+}
+
+OutputFile::OutputFile()
+    : m_data(nullptr), m_size(0), m_mapped(false), m_fd(-1) {
+}
+
+OutputFile::~OutputFile() {
+  Close();
+}
+
+bool OutputFile::Create(const char *file_name, int64_t size) {
+  Close();
+  m_size = size;
+
+#if defined(HIMG_USE_OUTPUT_MMAP)
+  // Allocate the file, and map it (an empty file can not be mapped).
+  m_fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0)
+    return false;
+  if (size > 0) {
+    // Reserve the disk blocks, so that running out of space is reported here
+    // instead of as a SIGBUS when the mapping is written. If the file system
+    // can not reserve blocks, write the file from a memory buffer instead.
+    int error = posix_fallocate(m_fd, 0, static_cast<off_t>(size));
+    if (error != 0 && error != EINVAL && error != EOPNOTSUPP) {
+      close(m_fd);
+      m_fd = -1;
+      m_size = 0;
+      return false;
+    }
+    void *addr = MAP_FAILED;
+    if (error == 0) {
+      addr = mmap(nullptr,
+                  static_cast<size_t>(size),
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED,
+                  m_fd,
+                  0);
+    }
+    if (addr != MAP_FAILED) {
+      m_data = static_cast<uint8_t *>(addr);
+      m_mapped = true;
+      return true;
+    }
+  }
+  close(m_fd);
+  m_fd = -1;
+#endif
+
+  // Fall back to a memory buffer that is written to the file by Close().
+  m_file_name = file_name;
+  m_buffer.resize(static_cast<size_t>(size));
+  m_data = m_buffer.data();
+  return true;
+}
+
+bool OutputFile::Close() {
+  bool success = true;
+#if defined(HIMG_USE_OUTPUT_MMAP)
+  // munmap() does not report write errors, so flush the data explicitly.
+  if (m_mapped) {
+    success = msync(m_data, static_cast<size_t>(m_size), MS_SYNC) == 0;
+    success = (munmap(m_data, static_cast<size_t>(m_size)) == 0) && success;
+  }
+  if (m_fd >= 0)
+    success = (close(m_fd) == 0) && success;
+  m_fd = -1;
+#endif
+  if (!m_file_name.empty()) {
+    std::ofstream f(m_file_name.c_str(),
+                    std::ofstream::out | std::ofstream::binary);
+    f.write(reinterpret_cast<const char *>(m_buffer.data()), m_size);
+    f.close();
+    success = !f.fail();
+    m_file_name.clear();
+  }
+  m_buffer.clear();
+  m_buffer.shrink_to_fit();
+  m_data = nullptr;
+  m_size = 0;
+  m_mapped = false;
+  return success;
+}
+
+bool OutputFile::Write(const char *file_name,
+                       const uint8_t *data,
+                       int64_t size) {
+#if defined(HIMG_USE_MMAP)
+  // The data is already in memory, so write it as is.
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  bool success = WriteAll(fd, data, size);
+  return (close(fd) == 0) && success;
+#else
+  std::ofstream f(file_name, std::ofstream::out | std::ofstream::binary);
+  f.write(reinterpret_cast<const char *>(data), size);
+  f.close();
+  return !f.fail();
+#endif
+}
+
+}  // namespace himg
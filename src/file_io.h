@@ -0,0 +1,85 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef FILE_IO_H_
+#define FILE_IO_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace himg {
+
+// A read-only view of the contents of a file. Where supported, the file is
+// memory mapped (so the data is read straight from the page cache, without an
+// extra copy), and otherwise it is read into memory.
+class InputFile {
+ public:
+  InputFile();
+  ~InputFile();
+
+  // Open a file. Any previously opened file is closed first.
+  bool Open(const char *file_name);
+  void Close();
+
+  const uint8_t *data() const { return m_data; }
+  int64_t size() const { return m_size; }
+
+  // Is the file memory mapped (rather than read into memory)?
+  bool is_mapped() const { return m_mapped; }
+
+ private:
+  InputFile(const InputFile &) = delete;
+  InputFile &operator=(const InputFile &) = delete;
+
+  const uint8_t *m_data;
+  int64_t m_size;
+  bool m_mapped;
+  std::vector<uint8_t> m_buffer;
+};
+
+// A file of a known size that is written in place. Create() allocates the
+// file, data() is then filled in by the caller, and Close() completes it.
+// Where supported, the file is memory mapped (so the data is written straight
+// to the page cache), and otherwise it is written from a memory buffer.
+class OutputFile {
+ public:
+  OutputFile();
+  ~OutputFile();
+
+  // Create (or truncate) a file with room for size bytes. Fails if the disk
+  // space can not be reserved.
+  bool Create(const char *file_name, int64_t size);
+
+  // Write the data to the file (a mapped file is flushed to disk), and close
+  // it. The file is also closed by the destructor, but without reporting
+  // errors.
+  bool Close();
+
+  uint8_t *data() { return m_data; }
+  int64_t size() const { return m_size; }
+
+  // Convenience function for writing an entire buffer to a file (the data is
+  // written directly, without a mapping).
+  static bool Write(const char *file_name, const uint8_t *data, int64_t size);
+
+ private:
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  uint8_t *m_data;
+  int64_t m_size;
+  bool m_mapped;
+  int m_fd;
+  std::vector<uint8_t> m_buffer;
+  std::string m_file_name;
+};
+
+}  // namespace himg
+
+#endif  // FILE_IO_H_
@@ -8,12 +8,35 @@
 
 #include "hadamard.h"
 
+#include <algorithm>
+
 #include "common.h"
+#include "cpu.h"
+
+#if CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
 
 namespace himg {
 
 namespace {
 
+// Range analysis of the inverse transform: The coefficients are dequantized
+// as UnmapFrom8Bit(x) << shift (see Quantize::Unpack()), where the magnitude
+// of UnmapFrom8Bit(x) is at most 8039 (the largest kFullResMappingTable
+// entry) and the shift is up to 15. Thus the coefficients may use the full
+// 16-bit range, and a butterfly sum of eight of them needs 19 bits, which is
+// why Inverse8() uses 32-bit precision.
+//
+// However, if all the coefficients of a block lie within [-kMax16BitCoeff,
+// kMax16BitCoeff], all the sums of the row pass fit in 16 bits (8 * 4095 =
+// 32760), and after the shift by three the results are within the same range
+// as the coefficients, so the same holds for the column pass. For such blocks
+// a transform in 16-bit precision is bit-exact, and the 32-bit transform is
+// only needed for the remaining blocks (at normal quality levels these are
+// rare, since the residual pixel values are small).
+const int kMax16BitCoeff = Hadamard::kMax16BitCoeff;
+
 // Fast forward Hadamard transform, optionally in place.
 template <int STRIDE>
 void Forward8(int16_t *out, const int16_t *in) {
@@ -46,7 +69,6 @@ void Forward8(int16_t *out, const int16_t *in) {
 // Fast inverse Hadamard transform, optionally in place.
 template <int STRIDE, int SHIFT>
 void Inverse8(int16_t *out, const int16_t *in) {
-  // TODO(m): Investigate if we can to do this with 16-bit precision instead.
   int32_t a0 = in[0 * STRIDE] + in[4 * STRIDE];
   int32_t a1 = in[1 * STRIDE] + in[5 * STRIDE];
   int32_t a2 = in[2 * STRIDE] + in[6 * STRIDE];
@@ -73,9 +95,10 @@ void Inverse8(int16_t *out, const int16_t *in) {
   out[7 * STRIDE] = static_cast<int16_t>((b0 - b1) >> SHIFT);
 }
 
-}  // namespace
-
-void Hadamard::Forward(int16_t *out, const int16_t *in) {
+// The scalar versions of Hadamard::Forward() and Hadamard::Inverse(). These
+// are the reference for the SIMD versions below, which must give bit-exact
+// results.
+void ForwardDefault(int16_t *out, const int16_t *in) {
   // Rows.
   for (int i = 0; i < 8; ++i) {
     Forward8<1>(&out[i * 8], &in[i * 8]);
@@ -87,7 +110,7 @@ void Hadamard::Forward(int16_t *out, const int16_t *in) {
   }
 }
 
-void Hadamard::Inverse(int16_t *out, const int16_t *in) {
+void InverseDefault(int16_t *out, const int16_t *in) {
   int16_t *_out = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(out));
   const int16_t *_in = reinterpret_cast<int16_t*>(ASSUME_ALIGNED16(in));
 
@@ -102,4 +125,643 @@ void Hadamard::Inverse(int16_t *out, const int16_t *in) {
   }
 }
 
+#if CPU_DISPATCH_X86
+// Vectors of 16-bit and 32-bit values (GCC vector extensions). The forward
+// transform uses unsigned 16-bit arithmetic, which wraps around just like the
+// int16_t arithmetic of Forward8().
+typedef uint16_t V8HU __attribute__((vector_size(16)));
+typedef int32_t V4SI __attribute__((vector_size(16)));
+typedef int32_t V8SI __attribute__((vector_size(32)));
+
+// The butterflies of Forward8() and Inverse8() (without the shift), for one
+// transform per lane: x[k] holds the k:th input, and is replaced by the k:th
+// output.
+template <typename V>
+FORCE_INLINE void Butterflies8(V *x) {
+  V a0 = x[0] + x[4];
+  V a1 = x[1] + x[5];
+  V a2 = x[2] + x[6];
+  V a3 = x[3] + x[7];
+  V a4 = x[0] - x[4];
+  V a5 = x[1] - x[5];
+  V a6 = x[2] - x[6];
+  V a7 = x[3] - x[7];
+  V b0 = a0 + a2;
+  V b1 = a1 + a3;
+  V b2 = a0 - a2;
+  V b3 = a1 - a3;
+  V b4 = a4 + a6;
+  V b5 = a5 + a7;
+  V b6 = a4 - a6;
+  V b7 = a5 - a7;
+  x[0] = b0 + b1;
+  x[1] = b4 + b5;
+  x[2] = b6 + b7;
+  x[3] = b2 + b3;
+  x[4] = b2 - b3;
+  x[5] = b6 - b7;
+  x[6] = b4 - b5;
+  x[7] = b0 - b1;
+}
+
+// SSE2: One row of 16-bit values per register. The inverse transform widens
+// each register to two registers of 32-bit values for the butterflies, unless
+// the block fits in 16 bits (see kMax16BitCoeff).
+
+// Transpose an 8x8 block of 16-bit values (one row per register).
+TARGET_SSE2 FORCE_INLINE void Transpose8x8SSE2(__m128i *r) {
+  __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+  __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+  __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+  __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+  __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+  __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+  __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+  __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+  __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+  __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+  __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+  __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+  __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+  __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+  __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+  __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+  r[0] = _mm_unpacklo_epi64(b0, b4);
+  r[1] = _mm_unpackhi_epi64(b0, b4);
+  r[2] = _mm_unpacklo_epi64(b1, b5);
+  r[3] = _mm_unpackhi_epi64(b1, b5);
+  r[4] = _mm_unpacklo_epi64(b2, b6);
+  r[5] = _mm_unpackhi_epi64(b2, b6);
+  r[6] = _mm_unpacklo_epi64(b3, b7);
+  r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// The same as Forward8(), for the columns of r.
+TARGET_SSE2 FORCE_INLINE void ForwardButterfliesSSE2(__m128i *r) {
+  V8HU x[8];
+  for (int k = 0; k < 8; ++k)
+    x[k] = (V8HU)r[k];
+  Butterflies8(x);
+  for (int k = 0; k < 8; ++k)
+    r[k] = (__m128i)x[k];
+}
+
+// Shift right by three, and wrap to 16 bits like the static_cast<int16_t>() of
+// Inverse8() (so that the pack does not saturate).
+TARGET_SSE2 FORCE_INLINE __m128i ShiftAndPackSSE2(V4SI lo, V4SI hi) {
+  __m128i lo16 = _mm_srai_epi32(_mm_slli_epi32((__m128i)lo, 13), 16);
+  __m128i hi16 = _mm_srai_epi32(_mm_slli_epi32((__m128i)hi, 13), 16);
+  return _mm_packs_epi32(lo16, hi16);
+}
+
+// The same as Inverse8<STRIDE, 3>(), for the columns of r.
+TARGET_SSE2 FORCE_INLINE void InverseButterfliesSSE2(__m128i *r) {
+  V4SI lo[8], hi[8];
+  for (int k = 0; k < 8; ++k) {
+    lo[k] = (V4SI)_mm_srai_epi32(_mm_unpacklo_epi16(r[k], r[k]), 16);
+    hi[k] = (V4SI)_mm_srai_epi32(_mm_unpackhi_epi16(r[k], r[k]), 16);
+  }
+  Butterflies8(lo);
+  Butterflies8(hi);
+  for (int k = 0; k < 8; ++k)
+    r[k] = ShiftAndPackSSE2(lo[k], hi[k]);
+}
+
+// The same as InverseButterfliesSSE2(), for blocks that fit in 16 bits.
+TARGET_SSE2 FORCE_INLINE void Inverse16ButterfliesSSE2(__m128i *r) {
+  ForwardButterfliesSSE2(r);
+  for (int k = 0; k < 8; ++k)
+    r[k] = _mm_srai_epi16(r[k], 3);
+}
+
+// Check if all the values of r lie within [-kMax16BitCoeff, kMax16BitCoeff].
+TARGET_SSE2 FORCE_INLINE bool FitsIn16BitsSSE2(const __m128i *r) {
+  __m128i max_x = r[0];
+  __m128i min_x = r[0];
+  for (int k = 1; k < 8; ++k) {
+    max_x = _mm_max_epi16(max_x, r[k]);
+    min_x = _mm_min_epi16(min_x, r[k]);
+  }
+  __m128i outside =
+      _mm_or_si128(_mm_cmpgt_epi16(max_x, _mm_set1_epi16(kMax16BitCoeff)),
+                   _mm_cmplt_epi16(min_x, _mm_set1_epi16(-kMax16BitCoeff)));
+  return _mm_movemask_epi8(outside) == 0;
+}
+
+TARGET_SSE2 FORCE_INLINE void LoadSSE2(__m128i *r, const int16_t *in) {
+  for (int k = 0; k < 8; ++k)
+    r[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[k * 8]));
+}
+
+TARGET_SSE2 FORCE_INLINE void StoreSSE2(int16_t *out, const __m128i *r) {
+  for (int k = 0; k < 8; ++k)
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[k * 8]), r[k]);
+}
+
+// The rows (transposed, so that each register holds the same input of all the
+// rows), and then the columns. kMode is 0 for the forward transform, and 1 or
+// 2 for the inverse transform in 16-bit or 32-bit precision, respectively.
+template <int kMode>
+TARGET_SSE2 FORCE_INLINE void TransformSSE2(__m128i *r) {
+  for (int pass = 0; pass < 2; ++pass) {
+    Transpose8x8SSE2(r);
+    if (kMode == 0)
+      ForwardButterfliesSSE2(r);
+    else if (kMode == 1)
+      Inverse16ButterfliesSSE2(r);
+    else
+      InverseButterfliesSSE2(r);
+  }
+}
+
+TARGET_SSE2 FORCE_INLINE void ForwardImplSSE2(int16_t *out,
+                                              const int16_t *in) {
+  __m128i r[8];
+  LoadSSE2(r, in);
+  TransformSSE2<0>(r);
+  StoreSSE2(out, r);
+}
+
+// The inverse transform in 16-bit precision, if the block (the rows r)
+// allows it. Returns false (without writing anything) otherwise.
+TARGET_SSE2 FORCE_INLINE bool Inverse16ImplSSE2(int16_t *out, __m128i *r) {
+  if (!FitsIn16BitsSSE2(r))
+    return false;
+  TransformSSE2<1>(r);
+  StoreSSE2(out, r);
+  return true;
+}
+
+TARGET_SSE2 void ForwardSSE2(int16_t *out, const int16_t *in) {
+  ForwardImplSSE2(out, in);
+}
+
+TARGET_SSE2 void InverseSSE2(int16_t *out, const int16_t *in) {
+  __m128i r[8];
+  LoadSSE2(r, in);
+  if (Inverse16ImplSSE2(out, r))
+    return;
+  TransformSSE2<2>(r);
+  StoreSSE2(out, r);
+}
+
+// AVX2: One row of 32-bit values per register.
+
+// Transpose an 8x8 block of 32-bit values (one row per register).
+TARGET_AVX2 FORCE_INLINE void Transpose8x8AVX2(V8SI *x) {
+  __m256i a0 = _mm256_unpacklo_epi32((__m256i)x[0], (__m256i)x[1]);
+  __m256i a1 = _mm256_unpackhi_epi32((__m256i)x[0], (__m256i)x[1]);
+  __m256i a2 = _mm256_unpacklo_epi32((__m256i)x[2], (__m256i)x[3]);
+  __m256i a3 = _mm256_unpackhi_epi32((__m256i)x[2], (__m256i)x[3]);
+  __m256i a4 = _mm256_unpacklo_epi32((__m256i)x[4], (__m256i)x[5]);
+  __m256i a5 = _mm256_unpackhi_epi32((__m256i)x[4], (__m256i)x[5]);
+  __m256i a6 = _mm256_unpacklo_epi32((__m256i)x[6], (__m256i)x[7]);
+  __m256i a7 = _mm256_unpackhi_epi32((__m256i)x[6], (__m256i)x[7]);
+  __m256i b0 = _mm256_unpacklo_epi64(a0, a2);
+  __m256i b1 = _mm256_unpackhi_epi64(a0, a2);
+  __m256i b2 = _mm256_unpacklo_epi64(a1, a3);
+  __m256i b3 = _mm256_unpackhi_epi64(a1, a3);
+  __m256i b4 = _mm256_unpacklo_epi64(a4, a6);
+  __m256i b5 = _mm256_unpackhi_epi64(a4, a6);
+  __m256i b6 = _mm256_unpacklo_epi64(a5, a7);
+  __m256i b7 = _mm256_unpackhi_epi64(a5, a7);
+  x[0] = (V8SI)_mm256_permute2x128_si256(b0, b4, 0x20);
+  x[1] = (V8SI)_mm256_permute2x128_si256(b1, b5, 0x20);
+  x[2] = (V8SI)_mm256_permute2x128_si256(b2, b6, 0x20);
+  x[3] = (V8SI)_mm256_permute2x128_si256(b3, b7, 0x20);
+  x[4] = (V8SI)_mm256_permute2x128_si256(b0, b4, 0x31);
+  x[5] = (V8SI)_mm256_permute2x128_si256(b1, b5, 0x31);
+  x[6] = (V8SI)_mm256_permute2x128_si256(b2, b6, 0x31);
+  x[7] = (V8SI)_mm256_permute2x128_si256(b3, b7, 0x31);
+}
+
+// Shift right by SHIFT, and wrap to 16 bits (sign extended to 32 bits).
+template <int SHIFT>
+TARGET_AVX2 FORCE_INLINE __m256i ShiftAndWrapAVX2(V8SI x) {
+  return _mm256_srai_epi32(_mm256_slli_epi32((__m256i)x, 16 - SHIFT), 16);
+}
+
+// The 16-bit SSE2 version (with VEX encoding) is faster than widening to
+// 32 bits for the forward transform.
+TARGET_AVX2 void ForwardAVX2(int16_t *out, const int16_t *in) {
+  ForwardImplSSE2(out, in);
+}
+
+TARGET_AVX2 void InverseAVX2(int16_t *out, const int16_t *in) {
+  __m128i r[8];
+  LoadSSE2(r, in);
+  if (Inverse16ImplSSE2(out, r))
+    return;
+
+  V8SI x[8];
+  for (int k = 0; k < 8; ++k)
+    x[k] = (V8SI)_mm256_cvtepi16_epi32(r[k]);
+
+  // Rows (transposed, so that each register holds the same input of all the
+  // rows).
+  Transpose8x8AVX2(x);
+  Butterflies8(x);
+  for (int k = 0; k < 8; ++k)
+    x[k] = (V8SI)ShiftAndWrapAVX2<3>(x[k]);
+
+  // Columns.
+  Transpose8x8AVX2(x);
+  Butterflies8(x);
+
+  for (int k = 0; k < 8; k += 2) {
+    __m256i packed = _mm256_packs_epi32(ShiftAndWrapAVX2<3>(x[k]),
+                                        ShiftAndWrapAVX2<3>(x[k + 1]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[k * 8]),
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+}
+
+// AVX-512 (only for the inverse transform, since the 16-bit forward transform
+// is as fast, and without a 16-bit path, since it gives no gain here): Two
+// rows of 32-bit values per register. Instead of transposing, the row
+// butterflies pair up the elements j and j ^ 4, j ^ 2 and j ^ 1 of each row
+// with in-register shuffles (the higher element gets the difference), and the
+// column butterflies pair up rows.
+
+// GCC 12 gives false -Wuninitialized warnings for most AVX-512 intrinsics
+// (GCC bug 105593).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+// Butterflies between lane j and lane j ^ d (d = 4, 2 or 1), given x with its
+// lanes permuted so (p), and a mask of the lanes that have bit d set.
+TARGET_AVX512 FORCE_INLINE __m512i ButterflyAVX512(__m512i x,
+                                                   __m512i p,
+                                                   __mmask16 high) {
+  return _mm512_mask_sub_epi32(_mm512_add_epi32(x, p), high, p, x);
+}
+
+// The same as Inverse8() (without the shift), for the two rows of x.
+TARGET_AVX512 FORCE_INLINE __m512i RowButterfliesAVX512(__m512i x) {
+  // The outputs end up in the order 0, 7, 3, 4, 1, 6, 2, 5.
+  const __m512i kOrder = _mm512_setr_epi32(
+      0, 4, 6, 2, 3, 7, 5, 1, 8, 12, 14, 10, 11, 15, 13, 9);
+  x = ButterflyAVX512(
+      x, _mm512_shuffle_i32x4(x, x, _MM_SHUFFLE(2, 3, 0, 1)), 0xf0f0);
+  x = ButterflyAVX512(x, _mm512_shuffle_epi32(x, _MM_PERM_BADC), 0xcccc);
+  x = ButterflyAVX512(x, _mm512_shuffle_epi32(x, _MM_PERM_CDAB), 0xaaaa);
+  return _mm512_permutexvar_epi32(kOrder, x);
+}
+
+// Butterflies between the two rows of x.
+TARGET_AVX512 FORCE_INLINE __m512i HalfButterflyAVX512(__m512i x) {
+  return ButterflyAVX512(
+      x, _mm512_shuffle_i64x2(x, x, _MM_SHUFFLE(1, 0, 3, 2)), 0xff00);
+}
+
+// Shift right by SHIFT, and wrap to 16 bits (sign extended to 32 bits).
+template <int SHIFT>
+TARGET_AVX512 FORCE_INLINE __m512i ShiftAndWrapAVX512(__m512i x) {
+  return _mm512_srai_epi32(_mm512_slli_epi32(x, 16 - SHIFT), 16);
+}
+
+TARGET_AVX512 void InverseAVX512(int16_t *out, const int16_t *in) {
+  // r[k] holds the rows 2k and 2k + 1.
+  __m512i r[4];
+  for (int k = 0; k < 4; ++k) {
+    r[k] = _mm512_cvtepi16_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&in[k * 16])));
+  }
+
+  // Rows.
+  for (int k = 0; k < 4; ++k) {
+    r[k] = ShiftAndWrapAVX512<3>(RowButterfliesAVX512(r[k]));
+  }
+
+  // Columns: rows i and i + 4, i and i + 2, and then i and i + 1 (within a
+  // register).
+  __m512i a01 = _mm512_add_epi32(r[0], r[2]);
+  __m512i a23 = _mm512_add_epi32(r[1], r[3]);
+  __m512i a45 = _mm512_sub_epi32(r[0], r[2]);
+  __m512i a67 = _mm512_sub_epi32(r[1], r[3]);
+  __m512i c01 = HalfButterflyAVX512(_mm512_add_epi32(a01, a23));
+  __m512i c23 = HalfButterflyAVX512(_mm512_sub_epi32(a01, a23));
+  __m512i c45 = HalfButterflyAVX512(_mm512_add_epi32(a45, a67));
+  __m512i c67 = HalfButterflyAVX512(_mm512_sub_epi32(a45, a67));
+
+  // The output rows are c0, c4, c6, c2, c3, c7, c5 and c1.
+  const int kLow = _MM_SHUFFLE(1, 0, 1, 0);
+  const int kHigh = _MM_SHUFFLE(3, 2, 3, 2);
+  r[0] = _mm512_shuffle_i64x2(c01, c45, kLow);
+  r[1] = _mm512_shuffle_i64x2(c67, c23, kLow);
+  r[2] = _mm512_shuffle_i64x2(c23, c67, kHigh);
+  r[3] = _mm512_shuffle_i64x2(c45, c01, kHigh);
+
+  // Shift, and narrow to 16 bits (the conversion wraps).
+  for (int k = 0; k < 4; ++k) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(&out[k * 16]),
+                        _mm512_cvtepi32_epi16(_mm512_srai_epi32(r[k], 3)));
+  }
+}
+
+#pragma GCC diagnostic pop
+#endif  // CPU_DISPATCH_X86
+
+typedef void (*TransformFun)(int16_t *out, const int16_t *in);
+
+// Hadamard::Forward() and Hadamard::Inverse(), for the best supported
+// instruction set.
+struct TransformKernels {
+  TransformKernels() {
+#if CPU_DISPATCH_X86
+    if (CPU::HasAVX512()) {
+      forward = ForwardAVX2;
+      inverse = InverseAVX512;
+      return;
+    }
+    if (CPU::HasAVX2()) {
+      forward = ForwardAVX2;
+      inverse = InverseAVX2;
+      return;
+    }
+    if (CPU::HasSSE2()) {
+      forward = ForwardSSE2;
+      inverse = InverseSSE2;
+      return;
+    }
+#endif
+    forward = ForwardDefault;
+    inverse = InverseDefault;
+  }
+
+  TransformFun forward;
+  TransformFun inverse;
+};
+
+const TransformKernels &GetTransformKernels() {
+  static const TransformKernels kernels;
+  return kernels;
+}
+
+// Inverse transform of eight coefficient planes, for count blocks. This is
+// the same operation as Inverse8<STRIDE, 3>, but for one block per lane. Only
+// the first K inputs are read (the rest are known to be zero). T is the
+// precision of the butterflies: int32_t, or int16_t for blocks that fit in 16
+// bits (see kMax16BitCoeff), which doubles the number of lanes per vector.
+template <int K, typename T>
+FORCE_INLINE void InverseLanes8(int16_t *RESTRICT p0,
+                                int16_t *RESTRICT p1,
+                                int16_t *RESTRICT p2,
+                                int16_t *RESTRICT p3,
+                                int16_t *RESTRICT p4,
+                                int16_t *RESTRICT p5,
+                                int16_t *RESTRICT p6,
+                                int16_t *RESTRICT p7,
+                                int count) {
+  for (int u = 0; u < count; ++u) {
+    T i0 = p0[u];
+    T i1 = K > 1 ? p1[u] : 0;
+    T i2 = K > 2 ? p2[u] : 0;
+    T i3 = K > 2 ? p3[u] : 0;
+    T i4 = K > 4 ? p4[u] : 0;
+    T i5 = K > 4 ? p5[u] : 0;
+    T i6 = K > 4 ? p6[u] : 0;
+    T i7 = K > 4 ? p7[u] : 0;
+    T a0 = i0 + i4;
+    T a1 = i1 + i5;
+    T a2 = i2 + i6;
+    T a3 = i3 + i7;
+    T a4 = i0 - i4;
+    T a5 = i1 - i5;
+    T a6 = i2 - i6;
+    T a7 = i3 - i7;
+    T b0 = a0 + a2;
+    T b1 = a1 + a3;
+    T b2 = a0 - a2;
+    T b3 = a1 - a3;
+    T b4 = a4 + a6;
+    T b5 = a5 + a7;
+    T b6 = a4 - a6;
+    T b7 = a5 - a7;
+    p0[u] = static_cast<int16_t>(static_cast<T>(b0 + b1) >> 3);
+    p1[u] = static_cast<int16_t>(static_cast<T>(b4 + b5) >> 3);
+    p2[u] = static_cast<int16_t>(static_cast<T>(b6 + b7) >> 3);
+    p3[u] = static_cast<int16_t>(static_cast<T>(b2 + b3) >> 3);
+    p4[u] = static_cast<int16_t>(static_cast<T>(b2 - b3) >> 3);
+    p5[u] = static_cast<int16_t>(static_cast<T>(b6 - b7) >> 3);
+    p6[u] = static_cast<int16_t>(static_cast<T>(b4 - b5) >> 3);
+    p7[u] = static_cast<int16_t>(static_cast<T>(b0 - b1) >> 3);
+  }
+}
+
+template <int K, typename T, int PLANE_STEP>
+FORCE_INLINE void InverseLanes8(int16_t *planes, int plane_stride, int count) {
+  const int step = PLANE_STEP * plane_stride;
+  InverseLanes8<K, T>(&planes[0 * step],
+                      &planes[1 * step],
+                      &planes[2 * step],
+                      &planes[3 * step],
+                      &planes[4 * step],
+                      &planes[5 * step],
+                      &planes[6 * step],
+                      &planes[7 * step],
+                      count);
+}
+
+// Inverse transform of blocks whose nonzero coefficients all lie within the
+// top-left KxK corner (K = 1, 2, 4 or 8). The rows below the corner are zero
+// both before and after the row transforms, so they are left as is.
+template <int K, typename T>
+FORCE_INLINE void InverseLanesPasses(int16_t *planes,
+                                     int plane_stride,
+                                     int count) {
+  // Rows.
+  for (int i = 0; i < K; ++i) {
+    InverseLanes8<K, T, 1>(&planes[i * 8 * plane_stride], plane_stride, count);
+  }
+
+  // Columns.
+  for (int i = 0; i < 8; ++i) {
+    InverseLanes8<K, T, 8>(&planes[i * plane_stride], plane_stride, count);
+  }
+}
+
+// The blocks are transformed in chunks of kLaneChunk, using 16-bit precision
+// for the chunks that allow it (so that a single large coefficient only
+// affects the blocks of its own chunk).
+const int kLaneChunk = 64;
+
+// Check if the coefficients in the top-left KxK corner of count blocks (at
+// most kLaneChunk) all lie within [-kMax16BitCoeff, kMax16BitCoeff]. The
+// coefficients are offset so that the valid range maps to [0, 2 *
+// kMax16BitCoeff] as unsigned values, and the maximum is tracked per lane
+// (only one horizontal reduction is needed).
+template <int K>
+FORCE_INLINE bool LanesFitIn16Bits(const int16_t *planes,
+                                   int plane_stride,
+                                   int count) {
+  uint16_t lane_max[kLaneChunk] = {0};
+  for (int i = 0; i < K; ++i) {
+    for (int j = 0; j < K; ++j) {
+      const int16_t *p = &planes[(i * 8 + j) * plane_stride];
+      for (int u = 0; u < count; ++u) {
+        uint16_t x = static_cast<uint16_t>(p[u] + kMax16BitCoeff);
+        lane_max[u] = x > lane_max[u] ? x : lane_max[u];
+      }
+    }
+  }
+  uint16_t max_x = 0;
+  for (int u = 0; u < count; ++u)
+    max_x = lane_max[u] > max_x ? lane_max[u] : max_x;
+  return max_x <= 2 * kMax16BitCoeff;
+}
+
+template <int K>
+FORCE_INLINE void InverseLanesImpl(int16_t *planes,
+                                   int plane_stride,
+                                   int count) {
+  for (int u = 0; u < count; u += kLaneChunk) {
+    const int n = std::min(kLaneChunk, count - u);
+    if (LanesFitIn16Bits<K>(&planes[u], plane_stride, n))
+      InverseLanesPasses<K, int16_t>(&planes[u], plane_stride, n);
+    else
+      InverseLanesPasses<K, int32_t>(&planes[u], plane_stride, n);
+  }
+}
+
+typedef void (*InverseLanesFun)(int16_t *planes, int plane_stride, int count);
+
+// The same code, compiled for different instruction sets (the lane loops are
+// vectorized by the compiler).
+template <int K>
+void InverseLanesDefault(int16_t *planes, int plane_stride, int count) {
+  InverseLanesImpl<K>(planes, plane_stride, count);
+}
+
+#if CPU_DISPATCH_X86
+template <int K>
+TARGET_AVX2 void InverseLanesAVX2(int16_t *planes,
+                                  int plane_stride,
+                                  int count) {
+  InverseLanesImpl<K>(planes, plane_stride, count);
+}
+#endif
+
+// The kernels for K = 1, 2, 4 and 8, for the best supported instruction set.
+struct InverseLanesKernels {
+  InverseLanesKernels() {
+#if CPU_DISPATCH_X86
+    if (CPU::HasAVX2()) {
+      fun[0] = InverseLanesAVX2<1>;
+      fun[1] = InverseLanesAVX2<2>;
+      fun[2] = InverseLanesAVX2<4>;
+      fun[3] = InverseLanesAVX2<8>;
+      return;
+    }
+#endif
+    fun[0] = InverseLanesDefault<1>;
+    fun[1] = InverseLanesDefault<2>;
+    fun[2] = InverseLanesDefault<4>;
+    fun[3] = InverseLanesDefault<8>;
+  }
+
+  InverseLanesFun fun[4];
+};
+
+const InverseLanesKernels &GetInverseLanesKernels() {
+  static const InverseLanesKernels kernels;
+  return kernels;
+}
+
+// Map the position of the last nonzero coefficient (in kIndexLUT order) to a
+// kernel: the first 1, 4 and 16 coefficients fill the top-left 1x1, 2x2 and
+// 4x4 corners, respectively.
+int KernelForLastNonzero(int last_nonzero) {
+  if (last_nonzero == 0)
+    return 0;
+  if (last_nonzero < 4)
+    return 1;
+  if (last_nonzero < 16)
+    return 2;
+  return 3;
+}
+
+}  // namespace
+
+void Hadamard::Forward(int16_t *out, const int16_t *in) {
+  GetTransformKernels().forward(out, in);
+}
+
+void Hadamard::Inverse(int16_t *out, const int16_t *in) {
+  GetTransformKernels().inverse(out, in);
+}
+
+std::vector<Hadamard::KernelSet> Hadamard::SupportedKernelSets() {
+  std::vector<KernelSet> sets;
+  KernelSet set;
+  set.name = "scalar";
+  set.forward = ForwardDefault;
+  set.inverse = InverseDefault;
+  set.inverse_lanes[0] = InverseLanesDefault<1>;
+  set.inverse_lanes[1] = InverseLanesDefault<2>;
+  set.inverse_lanes[2] = InverseLanesDefault<4>;
+  set.inverse_lanes[3] = InverseLanesDefault<8>;
+  sets.push_back(set);
+
+#if CPU_DISPATCH_X86
+  if (CPU::HasSSE2()) {
+    set.name = "SSE2";
+    set.forward = ForwardSSE2;
+    set.inverse = InverseSSE2;
+    sets.push_back(set);
+  }
+  if (CPU::HasAVX2()) {
+    set.name = "AVX2";
+    set.forward = ForwardAVX2;
+    set.inverse = InverseAVX2;
+    set.inverse_lanes[0] = InverseLanesAVX2<1>;
+    set.inverse_lanes[1] = InverseLanesAVX2<2>;
+    set.inverse_lanes[2] = InverseLanesAVX2<4>;
+    set.inverse_lanes[3] = InverseLanesAVX2<8>;
+    sets.push_back(set);
+  }
+  if (CPU::HasAVX512()) {
+    set.name = "AVX-512";
+    set.inverse = InverseAVX512;
+    sets.push_back(set);
+  }
+#endif
+
+  return sets;
+}
+
+void Hadamard::InverseLanesSparse(int16_t *planes,
+                                  int plane_stride,
+                                  int count,
+                                  const uint8_t *last_nonzero) {
+  const InverseLanesKernels &kernels = GetInverseLanesKernels();
+
+  // All the blocks in a lane group use the same kernel (the one required by
+  // the densest block), and consecutive groups that use the same kernel are
+  // transformed together. Smaller groups would catch more sparse blocks, but
+  // 16 lanes is what the vectorized lane loops handle per iteration.
+  static const int kLaneGroup = 16;
+  int run_start = 0;
+  int run_kernel = -1;
+  for (int u = 0; u < count; u += kLaneGroup) {
+    int group_end = std::min(u + kLaneGroup, count);
+    int max_last = 0;
+    for (int k = u; k < group_end; ++k)
+      max_last = std::max(max_last, static_cast<int>(last_nonzero[k]));
+    int kernel = KernelForLastNonzero(max_last);
+    if (kernel != run_kernel) {
+      if (run_kernel >= 0) {
+        kernels.fun[run_kernel](
+            &planes[run_start], plane_stride, u - run_start);
+      }
+      run_start = u;
+      run_kernel = kernel;
+    }
+  }
+  if (run_kernel >= 0) {
+    kernels.fun[run_kernel](
+        &planes[run_start], plane_stride, count - run_start);
+  }
+}
+
 }  // namespace himg
@@ -10,16 +10,54 @@
 #define HADAMARD_H_
 
 #include <cstdint>
+#include <vector>
 
 namespace himg {
 
 class Hadamard {
  public:
-  // Forward Hadamard transform (no scaling).
+  // Blocks with all their coefficients within [-kMax16BitCoeff,
+  // kMax16BitCoeff] are inverse transformed in 16-bit precision (see
+  // hadamard.cpp).
+  static const int kMax16BitCoeff = 4095;
+
+  // Forward Hadamard transform (no scaling). Forward() and Inverse() use SIMD
+  // kernels for the best supported instruction set, with results that are
+  // identical to those of the scalar code.
   static void Forward(int16_t *out, const int16_t *in);
 
   // Inverse Hadamard transform, including divide by 64.
   static void Inverse(int16_t *out, const int16_t *in);
+
+  // Inverse Hadamard transform of count blocks at once, in place. The data is
+  // stored as 64 coefficient planes (plane_stride elements apart), where each
+  // plane holds the same coefficient for all the blocks. The result is
+  // identical to that of Inverse().
+  //
+  // last_nonzero[u] is the position of the last nonzero coefficient of block
+  // u, in kIndexLUT order (an upper bound is also fine). Blocks with all their
+  // nonzero coefficients in the top-left 1x1, 2x2 or 4x4 corner are
+  // transformed with cheaper kernels.
+  static void InverseLanesSparse(int16_t *planes,
+                                 int plane_stride,
+                                 int count,
+                                 const uint8_t *last_nonzero);
+
+  // The kernels for one instruction set.
+  struct KernelSet {
+    const char *name;
+    void (*forward)(int16_t *out, const int16_t *in);
+    void (*inverse)(int16_t *out, const int16_t *in);
+
+    // InverseLanesSparse() for blocks with all their nonzero coefficients in
+    // the top-left 1x1, 2x2, 4x4 and 8x8 corner, respectively.
+    void (*inverse_lanes[4])(int16_t *planes, int plane_stride, int count);
+  };
+
+  // Get the kernels of all the instruction sets that the CPU supports,
+  // starting with the scalar reference code (for testing that the SIMD
+  // kernels give identical results).
+  static std::vector<KernelSet> SupportedKernelSets();
 };
 
 }  // namespace himg
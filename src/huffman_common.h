@@ -30,6 +30,65 @@ const Symbol kSymUpTo16662Zeros = 260;  // 279 - 16662  (14 bits)
 // The maximum number of nodes in the Huffman tree (branch nodes + leaf nodes).
 const int kMaxTreeNodes = (kNumSymbols * 2) - 1;
 
+// The maximum size of the tree representation (there are two additional bits
+// per leaf node, representing the branches in the tree).
+const int kMaxTreeDataSize = ((2 + kSymbolSize) * kNumSymbols + 7) / 8;
+
+// Get the RLE token for a run of 2 to 16662 zeros, and the extra bits that
+// follow it (the zero count relative to the smallest count of the token).
+inline Symbol GetZeroRunToken(int zeros,
+                              int *extra_bits,
+                              uint32_t *extra_value) {
+  if (zeros == 2) {
+    *extra_bits = 0;
+    *extra_value = 0;
+    return kSymTwoZeros;
+  } else if (zeros <= 6) {
+    *extra_bits = 2;
+    *extra_value = static_cast<uint32_t>(zeros - 3);
+    return kSymUpTo6Zeros;
+  } else if (zeros <= 22) {
+    *extra_bits = 4;
+    *extra_value = static_cast<uint32_t>(zeros - 7);
+    return kSymUpTo22Zeros;
+  } else if (zeros <= 278) {
+    *extra_bits = 8;
+    *extra_value = static_cast<uint32_t>(zeros - 23);
+    return kSymUpTo278Zeros;
+  }
+  *extra_bits = 14;
+  *extra_value = static_cast<uint32_t>(zeros - 279);
+  return kSymUpTo16662Zeros;
+}
+
+// Get the number of extra bits and the smallest zero count of an RLE token.
+inline bool GetRleToken(int symbol, int *extra_bits, int *min_zeros) {
+  switch (symbol) {
+    case kSymTwoZeros:
+      *extra_bits = 0;
+      *min_zeros = 2;
+      return true;
+    case kSymUpTo6Zeros:
+      *extra_bits = 2;
+      *min_zeros = 3;
+      return true;
+    case kSymUpTo22Zeros:
+      *extra_bits = 4;
+      *min_zeros = 7;
+      return true;
+    case kSymUpTo278Zeros:
+      *extra_bits = 8;
+      *min_zeros = 23;
+      return true;
+    case kSymUpTo16662Zeros:
+      *extra_bits = 14;
+      *min_zeros = 279;
+      return true;
+    default:
+      return false;
+  }
+}
+
 }  // namespace
 
 }  // namespace himg
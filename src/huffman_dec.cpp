@@ -9,154 +9,192 @@
 #include "huffman_dec.h"
 
 #include <algorithm>
+#include <cstring>
 
 #include "common.h"
+#include "cpu.h"
 #include "huffman_common.h"
 
 namespace himg {
 
-HuffmanDec::BitStream::BitStream(const uint8_t *buf, int size)
-    : m_byte_ptr(buf),
-      m_bit_pos(0),
-      m_end_ptr(buf + size),
-      m_read_failed(false) {
+namespace {
+
+// The decode table has one 32-bit entry per kDecodeTableBits bit sequence
+// (the next bits of the stream):
+//   Bits 0-3:  The number of bits to consume.
+//   Bits 4-5:  The number of literals (1-3), or zero for a special entry.
+//   Bits 6-7:  The kind of special entry.
+//   Bits 8-31: The literals (8 bits each, first one in the lowest bits), or
+//              the payload of a special entry.
+const int kMaxLiteralsPerEntry = 3;
+const uint32_t kEntryZeroRun = 0;    // Payload: The number of zeros.
+const uint32_t kEntryRleToken = 1;   // Payload: The RLE symbol (extra bits
+                                     // follow).
+const uint32_t kEntryTreeNode = 2;   // Payload: The index of a branch node of
+                                     // the tree (the code is longer).
+
+inline uint32_t MakeLiteralsEntry(int bits, int count, uint32_t literals) {
+  return static_cast<uint32_t>(bits) | (static_cast<uint32_t>(count) << 4) |
+         (literals << 8);
 }
 
-HuffmanDec::BitStream::BitStream(const BitStream &other)
-    : m_byte_ptr(other.m_byte_ptr),
-      m_bit_pos(other.m_bit_pos),
-      m_end_ptr(other.m_end_ptr),
-      m_read_failed(other.m_read_failed) {
+inline uint32_t MakeSpecialEntry(int bits, uint32_t kind, uint32_t payload) {
+  return static_cast<uint32_t>(bits) | (kind << 6) | (payload << 8);
 }
 
-int HuffmanDec::BitStream::ReadBit() {
-  // Get current stream state.
-  const uint8_t *buf = m_byte_ptr;
-  int bit = m_bit_pos;
-
-  // Extract bit.
-  int x = (*buf >> bit) & 1;
-  bit = (bit + 1) & 7;
-  if (!bit) {
-    ++buf;
-  }
-
-  // Store new stream state.
-  m_bit_pos = bit;
-  m_byte_ptr = buf;
-
-  return x;
+inline int EntryBits(uint32_t entry) {
+  return static_cast<int>(entry & 15);
 }
 
-int HuffmanDec::BitStream::ReadBitChecked() {
-  // Check that we don't read past the end.
-  if (UNLIKELY(m_byte_ptr >= m_end_ptr)) {
-    m_read_failed = true;
-    return 0;
-  }
-
-  // Ok, read...
-  return ReadBit();
+inline int EntryLiterals(uint32_t entry) {
+  return static_cast<int>((entry >> 4) & 3);
 }
 
-uint32_t HuffmanDec::BitStream::ReadBits(int bits) {
-  uint32_t x = 0;
+// Output sinks for HuffmanDec::UncompressStreams().
 
-  // Get current stream state.
-  const uint8_t *buf = m_byte_ptr;
-  int bit = m_bit_pos;
+// Writes the symbols to a byte buffer.
+class ByteSink {
+ public:
+  ByteSink() : m_buf(nullptr), m_buf_end(nullptr) {}
+  ByteSink(uint8_t *out, int out_size)
+      : m_buf(out), m_buf_end(out + out_size) {}
 
-  // Extract bits.
-  // TODO(m): Optimize this!
-  int shift = 0;
-  while (bits) {
-    int bits_to_extract = std::min(bits, 8 - bit);
-    bits -= bits_to_extract;
+  int remaining() const { return static_cast<int>(m_buf_end - m_buf); }
 
-    uint8_t mask = 0xff >> (8 - bits_to_extract);
-    x = x | (static_cast<uint32_t>((*buf >> bit) & mask) << shift);
-    shift += bits_to_extract;
+  void Put(int symbol) { *m_buf++ = static_cast<uint8_t>(symbol); }
 
-    bit += bits_to_extract;
-    if (bit >= 8) {
-      bit -= 8;
-      ++buf;
-    }
+  // Write one to three literals, packed in the low 24 bits (there must be
+  // room for three symbols). All three are written, so that there is no
+  // branch on the count.
+  void PutLiterals(uint32_t literals, int count) {
+    m_buf[0] = static_cast<uint8_t>(literals);
+    m_buf[1] = static_cast<uint8_t>(literals >> 8);
+    m_buf[2] = static_cast<uint8_t>(literals >> 16);
+    m_buf += count;
   }
 
-  // Store new stream state.
-  m_bit_pos = bit;
-  m_byte_ptr = buf;
-
-  return x;
-}
-
-uint32_t HuffmanDec::BitStream::ReadBitsChecked(int bits) {
-  // Check that we don't read past the end.
-  int new_bit_pos = m_bit_pos + bits;
-  const uint8_t *new_byte_ptr = m_byte_ptr + (new_bit_pos >> 3);
-  if (UNLIKELY(new_byte_ptr > m_end_ptr ||
-               (new_byte_ptr == m_end_ptr && ((new_bit_pos & 7) > 0)))) {
-    m_read_failed = true;
-    return 0;
+  bool PutZeros(int count) {
+    if (UNLIKELY(count > remaining()))
+      return false;
+    std::fill(m_buf, m_buf + count, 0);
+    m_buf += count;
+    return true;
   }
 
-  // Ok, read...
-  return ReadBits(bits);
-}
+ private:
+  uint8_t *m_buf;
+  uint8_t *m_buf_end;
+};
+
+// Translates the symbols to 16-bit values, and writes them row by row (see
+// HuffmanDec::RowOutput). If kTrackNonzero is true, the last nonzero row of
+// each column is recorded too.
+template <bool kTrackNonzero>
+class RowSink {
+ public:
+  RowSink() : m_out(nullptr), m_last(nullptr), m_remaining(0) {}
+  explicit RowSink(const HuffmanDec::RowOutput &out)
+      : m_out(&out),
+        m_last(nullptr),
+        m_row_tag(0),
+        m_row(0),
+        m_remaining(out.row_length * out.num_rows) {
+    StartRow();
+  }
 
-uint8_t HuffmanDec::BitStream::Peek8Bits() const {
-  uint8_t lo = m_byte_ptr[0], hi = m_byte_ptr[1];
-  return ((hi << 8) | lo) >> m_bit_pos;
-}
+  int remaining() const { return m_remaining; }
 
-uint32_t HuffmanDec::BitStream::Read16BitsAligned() {
-  // TODO(m): Check that we don't read past the end.
+  void Put(int symbol) {
+    int16_t value = m_lut[symbol];
+    *m_dst++ = value;
+    if (kTrackNonzero)
+      *m_last++ = m_row_tag;
+    --m_remaining;
+    if (UNLIKELY(--m_row_left == 0))
+      NextRow();
+  }
 
-  AlignToByte();
-  uint32_t lo = m_byte_ptr[0], hi = m_byte_ptr[1];
-  m_byte_ptr += 2;
-  return (hi << 8) | lo;
-}
+  // Write one to three literals, packed in the low 24 bits (there must be
+  // room for three symbols). Unless we are close to the end of the row, all
+  // three are written, so that there is no branch on the count.
+  void PutLiterals(uint32_t literals, int count) {
+    if (UNLIKELY(m_row_left < 3)) {
+      for (int k = 0; k < count; ++k)
+        Put(static_cast<int>((literals >> (8 * k)) & 255));
+      return;
+    }
+    m_dst[0] = m_lut[literals & 255];
+    m_dst[1] = m_lut[(literals >> 8) & 255];
+    m_dst[2] = m_lut[literals >> 16];
+    m_dst += count;
+    if (kTrackNonzero) {
+      m_last[0] = m_row_tag;
+      m_last[1] = count > 1 ? m_row_tag : m_last[1];
+      m_last[2] = count > 2 ? m_row_tag : m_last[2];
+      m_last += count;
+    }
+    m_remaining -= count;
+    m_row_left -= count;
+    if (UNLIKELY(m_row_left == 0))
+      NextRow();
+  }
 
-void HuffmanDec::BitStream::AlignToByte() {
-  if (LIKELY(m_bit_pos)) {
-    m_bit_pos = 0;
-    ++m_byte_ptr;
+  bool PutZeros(int count) {
+    if (UNLIKELY(count > m_remaining))
+      return false;
+    m_remaining -= count;
+    while (count >= m_row_left) {
+      std::fill(m_dst, m_dst + m_row_left, 0);
+      count -= m_row_left;
+      NextRow();
+    }
+    std::fill(m_dst, m_dst + count, 0);
+    m_dst += count;
+    if (kTrackNonzero)
+      m_last += count;
+    m_row_left -= count;
+    return true;
   }
-}
-void HuffmanDec::BitStream::Advance(int N) {
-  int new_bit_pos = m_bit_pos + N;
-  m_bit_pos = new_bit_pos & 7;
-  m_byte_ptr += new_bit_pos >> 3;
-}
 
-void HuffmanDec::BitStream::AdvanceBytes(int N) {
-  // TODO(m): Check that we don't read past the end.
+ private:
+  void StartRow() {
+    if (m_row < m_out->num_rows) {
+      m_dst = m_out->rows[m_row];
+      m_lut = m_out->luts[m_row];
+      if (kTrackNonzero) {
+        m_last = m_out->last_nonzero[m_row];
+        m_row_tag = static_cast<uint8_t>(m_row & 63);
+      }
+    }
+    m_row_left = m_out->row_length;
+  }
 
-  m_byte_ptr += N;
-}
+  void NextRow() {
+    ++m_row;
+    StartRow();
+  }
 
-bool HuffmanDec::BitStream::AtTheEnd() const {
-  // This is a rought estimate that we have reached the end of the input
-  // buffer (not too short, and not too far).
-  return (m_byte_ptr == m_end_ptr && m_bit_pos == 0) ||
-         (m_byte_ptr == (m_end_ptr - 1) && m_bit_pos > 0);
-}
+  const HuffmanDec::RowOutput *m_out;
+  int16_t *m_dst;
+  const int16_t *m_lut;
+  uint8_t *m_last;
+  uint8_t m_row_tag;
+  int m_row;
+  int m_row_left;
+  int m_remaining;
+};
 
-bool HuffmanDec::BitStream::read_failed() const {
-  return m_read_failed;
-}
+}  // namespace
 
 // Recover a Huffman tree from a bitstream.
 HuffmanDec::DecodeNode *HuffmanDec::RecoverTree(int *nodenum,
                                                 uint32_t code,
                                                 int bits) {
   // Pick a node from the node array.
+  if (UNLIKELY(*nodenum >= kMaxTreeNodes))
+    return nullptr;
   DecodeNode *this_node = &m_nodes[*nodenum];
   *nodenum = *nodenum + 1;
-  if (UNLIKELY(*nodenum) >= kMaxTreeNodes)
-    return nullptr;
 
   // Clear the node.
   this_node->symbol = -1;
@@ -164,39 +202,38 @@ HuffmanDec::DecodeNode *HuffmanDec::RecoverTree(int *nodenum,
   this_node->child_b = nullptr;
 
   // Is this a leaf node?
-  bool is_leaf = m_stream.ReadBitChecked() != 0;
+  bool is_leaf = m_stream.ReadBit() != 0;
   if (UNLIKELY(m_stream.read_failed()))
     return nullptr;
   if (is_leaf) {
     // Get symbol from tree description and store in lead node.
-    int symbol = static_cast<int>(m_stream.ReadBitsChecked(kSymbolSize));
+    int symbol = static_cast<int>(m_stream.ReadBits(kSymbolSize));
     if (UNLIKELY(m_stream.read_failed()))
       return nullptr;
 
     this_node->symbol = symbol;
 
-    if (bits <= 8) {
-      // Fill out the LUT for this symbol, including all permutations of the
-      // upper bits.
-      uint32_t dups = 256 >> bits;
-      for (uint32_t i = 0; i < dups; ++i) {
-        DecodeLutEntry *lut_entry = &m_decode_lut[(i << bits) | code];
-        lut_entry->node = nullptr;
-        lut_entry->bits = bits;
-        lut_entry->symbol = symbol;
-      }
+    if (bits <= kDecodeTableBits) {
+      // Fill out the decode table for this symbol, including all permutations
+      // of the upper bits (BuildDecodeTable() adds more symbols later).
+      uint32_t entry = symbol <= 255
+                           ? MakeLiteralsEntry(bits, 1, symbol)
+                           : MakeSpecialEntry(bits, kEntryRleToken, symbol);
+      uint32_t dups = (1 << kDecodeTableBits) >> bits;
+      for (uint32_t i = 0; i < dups; ++i)
+        m_decode_table[(i << bits) | code] = entry;
     }
 
     return this_node;
   }
 
-  if (bits == 8) {
-    // Add a non-terminated entry in the LUT (i.e. one that points into the tree
-    // rather than giving a symbol).
-    DecodeLutEntry *lut_entry = &m_decode_lut[code];
-    lut_entry->node = this_node;
-    lut_entry->bits = 8;
-    lut_entry->symbol = 0;
+  if (bits == kDecodeTableBits) {
+    // Add a non-terminated entry in the decode table (i.e. one that points
+    // into the tree rather than giving a symbol).
+    m_decode_table[code] =
+        MakeSpecialEntry(bits,
+                         kEntryTreeNode,
+                         static_cast<uint32_t>(this_node - &m_nodes[0]));
   }
 
   // Get branch A.
@@ -204,18 +241,59 @@ HuffmanDec::DecodeNode *HuffmanDec::RecoverTree(int *nodenum,
   if (UNLIKELY(!this_node->child_a))
     return nullptr;
 
-  // Get branch B.
-  this_node->child_b = RecoverTree(nodenum, code + (1 << bits), bits + 1);
+  // Get branch B (the code is only needed for the decode table, and corrupt
+  // trees may be deeper than 32 levels).
+  uint32_t code_b = bits < kDecodeTableBits ? code + (1 << bits) : code;
+  this_node->child_b = RecoverTree(nodenum, code_b, bits + 1);
   if (UNLIKELY(!this_node->child_b))
     return nullptr;
 
   return this_node;
 }
 
-HuffmanDec::HuffmanDec(const uint8_t *in, int in_size, int block_size)
-    : m_stream(in, in_size), m_root(nullptr) {
-  m_block_size = block_size > 0 ? block_size : in_size;
-  m_use_blocks = m_block_size < in_size;
+void HuffmanDec::BuildDecodeTable() {
+  // RecoverTree() has given each entry the first symbol of its bit sequence.
+  // Now we add more literals while they fit in the bit sequence, and resolve
+  // RLE tokens whose extra bits fit too. The code that follows the first code
+  // of entry i has its single symbol entry at index i >> bits (a lower index),
+  // so the entries are extended in place, from the top.
+  const int kTableSize = 1 << kDecodeTableBits;
+  for (int i = kTableSize - 1; i >= 0; --i) {
+    uint32_t entry = m_decode_table[i];
+    int bits = EntryBits(entry);
+    if (EntryLiterals(entry) == 1) {
+      uint32_t literals = entry >> 8;
+      int count = 1;
+      while (count < kMaxLiteralsPerEntry) {
+        uint32_t next = m_decode_table[i >> bits];
+        int next_bits = EntryBits(next);
+        if (EntryLiterals(next) != 1 || bits + next_bits > kDecodeTableBits)
+          break;
+        literals |= (next >> 8) << (8 * count);
+        bits += next_bits;
+        ++count;
+      }
+      entry = MakeLiteralsEntry(bits, count, literals);
+    } else if (((entry >> 6) & 3) == kEntryRleToken) {
+      int extra_bits, min_zeros;
+      if (GetRleToken(static_cast<int>(entry >> 8), &extra_bits, &min_zeros) &&
+          bits + extra_bits <= kDecodeTableBits) {
+        uint32_t zeros = static_cast<uint32_t>(min_zeros) +
+                         ((i >> bits) & ((1 << extra_bits) - 1));
+        entry = MakeSpecialEntry(bits + extra_bits, kEntryZeroRun, zeros);
+      }
+    }
+    m_decode_table[i] = entry;
+  }
+}
+
+HuffmanDec::HuffmanDec(const uint8_t *in,
+                       int in_size,
+                       bool use_blocks,
+                       int num_substreams)
+    : EntropyDec(in, in_size, use_blocks, num_substreams),
+      m_stream(in, in_size),
+      m_root(nullptr) {
 }
 
 bool HuffmanDec::Init() {
@@ -223,31 +301,52 @@ bool HuffmanDec::Init() {
   if (m_root)
     return false;
 
-  // Recover Huffman tree.
-  int node_count = 0;
-  m_root = RecoverTree(&node_count, 0, 0);
-  if (m_root == nullptr)
+  if (!InitPartial(m_in_size))
     return false;
-  m_stream.AlignToByte();
-
-  // Recover the individual blocks.
-  if (m_use_blocks) {
-    BitStream tmp_stream(m_stream);
-    while (!tmp_stream.AtTheEnd()) {
-      // Read the packed size (two or four bytes).
-      uint32_t packed_block_size = tmp_stream.Read16BitsAligned();
-      if (packed_block_size & 0x8000) {
-        packed_block_size = (packed_block_size & 0x7fff) |
-                            (tmp_stream.Read16BitsAligned() << 15);
-      }
 
-      // TODO(m): Check size of block stream.
-      m_blocks.push_back(BitStream(tmp_stream.byte_ptr(), packed_block_size));
-      tmp_stream.AdvanceBytes(packed_block_size);
+  // All the blocks must be accounted for.
+  return FoundAllBlocks();
+}
+
+bool HuffmanDec::InitPartial(int available_size) {
+  m_available_size = std::min(available_size, m_in_size);
+
+  if (!m_root) {
+    // Wait until the entire tree is guaranteed to have been received.
+    if (m_available_size < std::min(m_in_size, kMaxTreeDataSize))
+      return true;
+
+    // Recover Huffman tree. The 64-bit refills read ahead of the tree, so the
+    // stream must end where the received data ends.
+    m_stream = BitStream(m_in, m_available_size);
+    int node_count = 0;
+    m_root = RecoverTree(&node_count, 0, 0);
+    if (m_root == nullptr)
+      return false;
+
+    // Special case: If there is only a single symbol, the encoder uses a one
+    // bit code for it, so we turn the root into a branch node with two leaves.
+    if (m_root->symbol >= 0) {
+      DecodeNode *leaf = &m_nodes[node_count];
+      *leaf = *m_root;
+      m_root->symbol = -1;
+      m_root->child_a = leaf;
+      m_root->child_b = leaf;
+      for (int i = 0; i < (1 << kDecodeTableBits); ++i)
+        m_decode_table[i] = (m_decode_table[i] & ~15u) | 1;
     }
+    BuildDecodeTable();
+
+    // Restart the stream at the first byte after the tree (the bit buffer may
+    // hold bytes that had not been received yet).
+    m_stream.AlignToByte();
+    m_next_block_ptr = m_stream.byte_ptr();
+    m_stream = BitStream(m_next_block_ptr,
+                         static_cast<int>(m_in + m_in_size - m_next_block_ptr));
   }
 
-  return true;
+  // Find the blocks that have been received.
+  return FindBlocks();
 }
 
 bool HuffmanDec::Uncompress(uint8_t *out, int out_size) const {
@@ -255,166 +354,247 @@ bool HuffmanDec::Uncompress(uint8_t *out, int out_size) const {
   if (!m_root || m_use_blocks)
     return false;
 
-  return UncompressStream(out, out_size, m_stream);
+  return UncompressBlock(out, out_size, 0);
 }
 
 bool HuffmanDec::UncompressBlock(uint8_t *out,
                                  int out_size,
                                  int block_no) const {
   // Has Init() been run successfully?
-  if (!m_root || !m_use_blocks)
+  Block block;
+  if (!GetBlock(block_no, &block))
     return false;
 
-  if (block_no < 0 || block_no > static_cast<int>(m_blocks.size()))
+  // The substreams are stored one after the other.
+  const int n = m_num_substreams;
+  BitStream streams[kMaxSubstreams];
+  ByteSink sinks[kMaxSubstreams];
+  if (out_size % n != 0 || !ReadSubstreams(block.data, block.size, n, streams))
     return false;
+  for (int k = 0; k < n; ++k)
+    sinks[k] = ByteSink(out + k * (out_size / n), out_size / n);
+  switch (n) {
+    case 1:
+      return UncompressStreams<1>(sinks, streams);
+    case 2:
+      return UncompressStreams<2>(sinks, streams);
+    case 4:
+      return UncompressStreams<4>(sinks, streams);
+    default:
+      return false;
+  }
+}
 
-  return UncompressStream(out, out_size, m_blocks[block_no]);
+bool HuffmanDec::UncompressBlock(const RowOutput &out, int block_no) const {
+  // Has Init() been run successfully?
+  Block block;
+  if (!GetBlock(block_no, &block))
+    return false;
+
+  if (m_num_substreams == 1) {
+    BitStream stream(block.data, block.size);
+    if (out.last_nonzero) {
+      RowSink<true> sink(out);
+      return UncompressStreams<1>(&sink, &stream);
+    }
+    RowSink<false> sink(out);
+    return UncompressStreams<1>(&sink, &stream);
+  }
+
+  // With substreams, the block is first uncompressed to bytes (the decoding
+  // of interleaved substreams is fastest with as little sink state as
+  // possible), and then translated to rows.
+  return EntropyDec::UncompressBlock(out, block_no);
+}
+
+template <int kNumStreams, class Sink>
+bool HuffmanDec::UncompressStreams(Sink *sinks, BitStream *streams) const {
+#if CPU_DISPATCH_X86
+  static const bool kUseBMI2 = CPU::HasBMI2();
+  if (kUseBMI2)
+    return UncompressStreamsBMI2<kNumStreams>(sinks, streams);
+#endif
+  return UncompressStreamsDefault<kNumStreams>(sinks, streams);
 }
 
-bool HuffmanDec::UncompressStream(
-    uint8_t *out, int out_size, BitStream stream) const {
+// The same code, compiled for different instruction sets (with BMI2, the
+// variable shifts and masks of the bit reader become SHRX and BZHI).
+template <int kNumStreams, class Sink>
+bool HuffmanDec::UncompressStreamsDefault(Sink *sinks,
+                                          BitStream *streams) const {
+  return UncompressStreamsImpl<kNumStreams>(sinks, streams);
+}
+
+#if CPU_DISPATCH_X86
+template <int kNumStreams, class Sink>
+TARGET_BMI2 bool HuffmanDec::UncompressStreamsBMI2(Sink *sinks,
+                                                   BitStream *streams) const {
+  return UncompressStreamsImpl<kNumStreams>(sinks, streams);
+}
+#endif
+
+template <int kNumStreams, class Sink>
+FORCE_INLINE bool HuffmanDec::UncompressStreamsImpl(Sink *sinks,
+                                                    BitStream *streams) const {
   // Do we have anything to decompress?
-  if (m_stream.AtTheEnd())
-    return out_size == 0;
-
-  // Decode input stream.
-  uint8_t *buf = out;
-  const uint8_t *buf_end = out + out_size;
-
-  // Performance hack: I really don't like this, but by putting the decode LUT
-  // in the local stack frame, we're noticeably faster than when using the
-  // in-object LUT (g++ 4.9).
-  // TODO(m): Find a better solution.
-  DecodeLutEntry decode_lut[256];
-  std::copy(&m_decode_lut[0], &m_decode_lut[0] + 256, &decode_lut[0]);
-
-  // We do the majority of the decoding in a fast, unchecked loop.
-  // Note: The longest supported code + RLE encoding is 32 + 14 bits ~= 6 bytes.
-  const uint8_t *buf_fast_end = buf_end - 6;
-  while (buf < buf_fast_end) {
-    int symbol;
-
-    // Peek 8 bits from the stream and use it to look up a potential symbol in
-    // the LUT (codes that are eight bits or shorter are very common, so we have
-    // a high hit rate in the LUT).
-    const auto &lut_entry = decode_lut[stream.Peek8Bits()];
-    stream.Advance(lut_entry.bits);
-    if (LIKELY(lut_entry.node == nullptr)) {
-      // Fast case: We found the symbol in the LUT.
-      symbol = lut_entry.symbol;
-    } else {
-      // Slow case: Traverse the tree from 8 bits code length until we find a
-      // leaf node.
-      DecodeNode *node = lut_entry.node;
-      while (node->symbol < 0) {
-        // Get next node.
-        if (stream.ReadBit())
-          node = node->child_b;
-        else
-          node = node->child_a;
-      }
-      symbol = node->symbol;
+  if (m_stream.AtTheEnd()) {
+    for (int k = 0; k < kNumStreams; ++k) {
+      if (sinks[k].remaining() != 0)
+        return false;
     }
+    return true;
+  }
 
-    // Decode as RLE or plain copy.
-    if (LIKELY(symbol <= 255)) {
-      // Plain copy.
-      *buf++ = static_cast<uint8_t>(symbol);
-    } else {
-      // Symbols >= 256 are RLE tokens.
-      int zero_count;
-      switch (symbol) {
-        case kSymTwoZeros: {
-          zero_count = 2;
-          break;
-        }
-        case kSymUpTo6Zeros: {
-          zero_count = static_cast<int>(stream.ReadBits(2)) + 3;
-          break;
-        }
-        case kSymUpTo22Zeros: {
-          zero_count = static_cast<int>(stream.ReadBits(4)) + 7;
-          break;
-        }
-        case kSymUpTo278Zeros: {
-          zero_count = static_cast<int>(stream.ReadBits(8)) + 23;
-          break;
-        }
-        case kSymUpTo16662Zeros: {
-          zero_count = static_cast<int>(stream.ReadBits(14)) + 279;
-          break;
-        }
-        default: {
-          // Note: This should never happen -> abort!
+  // With several substreams, we decode one symbol (or a few) from each of
+  // them in turn. The substreams are independent, so the CPU can overlap the
+  // table lookups and bit reader updates of different substreams, instead of
+  // waiting for each symbol before it can start on the next one. The bit
+  // readers and sinks are kept in local copies, so that they can live in
+  // registers (the output writes could alias them otherwise).
+  if (kNumStreams > 1) {
+    BitStream local_streams[kNumStreams];
+    Sink local_sinks[kNumStreams];
+    for (int k = 0; k < kNumStreams; ++k) {
+      local_streams[k] = streams[k];
+      local_sinks[k] = sinks[k];
+    }
+    while (true) {
+      bool can_run = true;
+      for (int k = 0; k < kNumStreams; ++k) {
+        can_run &= local_sinks[k].remaining() >= kMaxLiteralsPerEntry;
+        can_run &= local_streams[k].HasSlack();
+      }
+      if (!can_run)
+        break;
+      for (int k = 0; k < kNumStreams; ++k) {
+        if (UNLIKELY(!DecodeFast(&local_sinks[k], &local_streams[k])))
           return false;
-        }
       }
-
-      if (UNLIKELY(buf + zero_count > buf_end))
-        return false;
-      std::fill(buf, buf + zero_count, 0);
-      buf += zero_count;
+    }
+    for (int k = 0; k < kNumStreams; ++k) {
+      streams[k] = local_streams[k];
+      sinks[k] = local_sinks[k];
     }
   }
 
+  // Finish the substreams one by one.
+  for (int k = 0; k < kNumStreams; ++k) {
+    if (!UncompressStreamTail(sinks[k], streams[k]))
+      return false;
+  }
+  return true;
+}
+
+template <class Sink>
+FORCE_INLINE bool HuffmanDec::UncompressStreamTail(Sink sink,
+                                                   BitStream stream) const {
+  // We do the majority of the decoding in a fast loop, that runs as long as
+  // there are at least eight bytes left in the input buffer, so that each
+  // refill is a single 64-bit load that makes at least 56 bits available. That
+  // is enough for a table lookup plus any RLE extra bits (14 bits), so the
+  // refill checks in ReadBit() and ReadBits() only kick in for long codes.
+  while (sink.remaining() >= kMaxLiteralsPerEntry && stream.HasSlack()) {
+    if (UNLIKELY(!DecodeFast(&sink, &stream)))
+      return false;
+  }
+
   // ...and we do the tail of the decoding in a slower, checked loop.
-  while (buf < buf_end) {
-    // Traverse the tree until we find a leaf node.
-    DecodeNode *node = m_root;
-    while (node->symbol < 0) {
-      // Get next node.
-      if (stream.ReadBitChecked())
-        node = node->child_b;
-      else
-        node = node->child_a;
-
-      if (UNLIKELY(stream.read_failed()))
-        return false;
+  const uint32_t root_entry = MakeSpecialEntry(
+      0, kEntryTreeNode, static_cast<uint32_t>(m_root - &m_nodes[0]));
+  while (sink.remaining() > 0) {
+    // Use the decode table if the codes fit in the remaining bits (past the
+    // end of the stream the bits read as zeros, so the entry may be bogus if
+    // not), and the literals fit in the output. Otherwise decode a single
+    // symbol by traversing the tree from the root.
+    stream.Refill();
+    uint32_t entry = m_decode_table[stream.PeekBits(kDecodeTableBits)];
+    int count = EntryLiterals(entry);
+    if (EntryBits(entry) > stream.bits_available() ||
+        count > sink.remaining()) {
+      entry = root_entry;
+      count = 0;
     }
-    int symbol = node->symbol;
-
-    // Decode as RLE or plain copy.
-    if (LIKELY(symbol <= 255)) {
-      // Plain copy.
-      *buf++ = static_cast<uint8_t>(symbol);
-    } else {
-      // Symbols >= 256 are RLE tokens.
-      int zero_count;
-      switch (symbol) {
-        case kSymTwoZeros: {
-          zero_count = 2;
-          break;
-        }
-        case kSymUpTo6Zeros: {
-          zero_count = static_cast<int>(stream.ReadBitsChecked(2)) + 3;
-          break;
-        }
-        case kSymUpTo22Zeros: {
-          zero_count = static_cast<int>(stream.ReadBitsChecked(4)) + 7;
-          break;
-        }
-        case kSymUpTo278Zeros: {
-          zero_count = static_cast<int>(stream.ReadBitsChecked(8)) + 23;
-          break;
-        }
-        case kSymUpTo16662Zeros: {
-          zero_count = static_cast<int>(stream.ReadBitsChecked(14)) + 279;
-          break;
-        }
-        default: {
-          // Note: This should never happen -> abort!
-          return false;
-        }
-      }
+    stream.Advance(EntryBits(entry));
+    if (count != 0) {
+      for (int k = 0; k < count; ++k)
+        sink.Put(static_cast<int>((entry >> (8 * (k + 1))) & 255));
+    } else if (UNLIKELY(!PutSpecial(entry, &stream, &sink))) {
+      return false;
+    }
+  }
+
+  return !stream.read_failed() && stream.AtTheEnd();
+}
 
-      if (UNLIKELY(stream.read_failed() || buf + zero_count > buf_end))
+// Decode the next few symbols (one table lookup). The caller must make sure
+// that the stream has slack, and that the sink has room for the literals.
+template <class Sink>
+FORCE_INLINE bool HuffmanDec::DecodeFast(Sink *sink, BitStream *stream) const {
+  // Look up the next few symbols in the decode table (codes that are short
+  // enough to fit in the table are very common, so we have a high hit rate).
+  stream->Refill();
+  uint32_t entry = m_decode_table[stream->PeekBits(kDecodeTableBits)];
+  stream->Advance(EntryBits(entry));
+  int count = EntryLiterals(entry);
+  if (LIKELY(count != 0)) {
+    // Fast case: One to three literals.
+    sink->PutLiterals(entry >> 8, count);
+    return true;
+  }
+  if (LIKELY(((entry >> 6) & 3) == kEntryZeroRun)) {
+    // Almost as fast: A zero run.
+    return sink->PutZeros(static_cast<int>(entry >> 8));
+  }
+  return PutSpecial(entry, stream, sink);
+}
+
+// Decode a special entry of the decode table (a zero run, an RLE token that
+// needs its extra bits, or a code that continues in the tree), and write the
+// result to the sink.
+template <class Sink>
+FORCE_INLINE bool HuffmanDec::PutSpecial(uint32_t entry,
+                                         BitStream *stream,
+                                         Sink *sink) const {
+  uint32_t payload = entry >> 8;
+  int symbol;
+  switch ((entry >> 6) & 3) {
+    case kEntryZeroRun: {
+      return sink->PutZeros(static_cast<int>(payload));
+    }
+    case kEntryRleToken: {
+      symbol = static_cast<int>(payload);
+      break;
+    }
+    default: {
+      // Slow case: Traverse the tree from the table code length until we find
+      // a leaf node.
+      const DecodeNode *node = &m_nodes[payload];
+      while (node->symbol < 0) {
+        // Get next node.
+        if (stream->ReadBit())
+          node = node->child_b;
+        else
+          node = node->child_a;
+      }
+      if (UNLIKELY(stream->read_failed()))
         return false;
-      std::fill(buf, buf + zero_count, 0);
-      buf += zero_count;
+      symbol = node->symbol;
+      if (symbol <= 255) {
+        sink->Put(symbol);
+        return true;
+      }
+      break;
     }
   }
 
-  return stream.AtTheEnd();
+  // Symbols >= 256 are RLE tokens.
+  int extra_bits, min_zeros;
+  if (UNLIKELY(!GetRleToken(symbol, &extra_bits, &min_zeros))) {
+    // Note: This should never happen -> abort!
+    return false;
+  }
+  int zero_count = min_zeros + static_cast<int>(stream->ReadBits(extra_bits));
+  return !stream->read_failed() && sink->PutZeros(zero_count);
 }
 
 }  // namespace himg
@@ -12,103 +12,82 @@
 #include <cstdint>
 #include <vector>
 
+#include "entropy_common.h"
+#include "entropy_dec.h"
+
 namespace himg {
 
-class HuffmanDec {
+class HuffmanDec : public EntropyDec {
  public:
-  HuffmanDec(const uint8_t *in, int in_size, int block_size);
+  // If use_blocks is true, the stream is divided into several blocks that
+  // can be uncompressed independently (see UncompressBlock()). If
+  // num_substreams is greater than one, each block is made up of that many
+  // substreams, that are uncompressed in lockstep (see HuffmanEnc::Compress()).
+  HuffmanDec(const uint8_t *in,
+             int in_size,
+             bool use_blocks,
+             int num_substreams = 1);
 
   // Decode the Huffman data preamble (the tree).
-  bool Init();
+  bool Init() override;
+
+  // Decode as much as possible of the Huffman data preamble (the tree and the
+  // block sizes), given that only the first available_size bytes of the
+  // stream have been received so far. This can be called repeatedly as more
+  // data arrives. Returns false if the data is invalid.
+  bool InitPartial(int available_size) override;
 
   // Uncompress the Huffman stream (requires that Init() has been called first).
-  bool Uncompress(uint8_t *out, int out_size) const;
+  bool Uncompress(uint8_t *out, int out_size) const override;
 
   // Uncompress a single block in the Huffman stream (requires that Init() has
-  // been called first).
-  bool UncompressBlock(uint8_t *out, int out_size, int block_no) const;
+  // been called first). A stream without blocks is treated as a single block.
+  // The substreams of a block are written one after the other.
+  bool UncompressBlock(uint8_t *out,
+                       int out_size,
+                       int block_no) const override;
+
+  // Uncompress a single block into rows of 16-bit values (see RowOutput).
+  bool UncompressBlock(const RowOutput &out, int block_no) const override;
 
  private:
   // The maximum number of tree nodes.
   static const int kMaxTreeNodes = (261 * 2) - 1;
 
-  // A class to help decoding binary data.
-  class BitStream {
-   public:
-    // Initialize a bitstream.
-    BitStream(const uint8_t *buf, int size);
-
-    // Copy constructor.
-    BitStream(const BitStream &other);
-
-    // Read one bit from a bitstream.
-    int ReadBit();
-
-    // Read one bit from a bitstream, with checking.
-    int ReadBitChecked();
-
-    // Read bits from a bitstream.
-    uint32_t ReadBits(int bits);
-
-    // Read bits from a bitstream, with checking.
-    uint32_t ReadBitsChecked(int bits);
-
-    // Peek eight bits from a bitstream (read without advancing the pointer).
-    uint8_t Peek8Bits() const;
-
-    // Read 16 bits from a bitstream, byte aligned.
-    uint32_t Read16BitsAligned();
-
-    // Align the stream to a byte boundary (do nothing if already aligned).
-    void AlignToByte();
-
-    // Advance the pointer by N bits.
-    void Advance(int N);
-
-    // Advance N bytes.
-    void AdvanceBytes(int N);
-
-    // Check if we have reached the end of the buffer.
-    bool AtTheEnd() const;
-
-    const uint8_t *byte_ptr() const {
-      return m_byte_ptr;
-    }
-
-    // Check if any of the Read*Checked() methods failed.
-    bool read_failed() const;
-
-   private:
-    const uint8_t *m_byte_ptr;
-    int m_bit_pos;
-    const uint8_t *m_end_ptr;
-    bool m_read_failed;
-  };
+  // The number of bits that are decoded with a single table lookup.
+  static const int kDecodeTableBits = 11;
 
   struct DecodeNode {
     DecodeNode *child_a, *child_b;
     int symbol;
   };
 
-  struct DecodeLutEntry {
-    DecodeNode *node;
-    int symbol;
-    int bits;
-  };
-
   DecodeNode *RecoverTree(int *nodenum, uint32_t code, int bits);
-
-  bool UncompressStream(uint8_t *out, int out_size, BitStream stream) const;
+  void BuildDecodeTable();
+
+
+  template <int kNumStreams, class Sink>
+  bool UncompressStreams(Sink *sinks, BitStream *streams) const;
+  template <int kNumStreams, class Sink>
+  bool UncompressStreamsDefault(Sink *sinks, BitStream *streams) const;
+  template <int kNumStreams, class Sink>
+  bool UncompressStreamsBMI2(Sink *sinks, BitStream *streams) const;
+  template <int kNumStreams, class Sink>
+  bool UncompressStreamsImpl(Sink *sinks, BitStream *streams) const;
+  template <class Sink>
+  bool UncompressStreamTail(Sink sink, BitStream stream) const;
+  template <class Sink>
+  bool DecodeFast(Sink *sink, BitStream *stream) const;
+  template <class Sink>
+  bool PutSpecial(uint32_t entry, BitStream *stream, Sink *sink) const;
 
   DecodeNode m_nodes[kMaxTreeNodes];
-  DecodeLutEntry m_decode_lut[256];
+  // Each entry of the decode table gives the symbols of the codes that start
+  // with a kDecodeTableBits bit sequence (see huffman_dec.cpp).
+  uint32_t m_decode_table[1 << kDecodeTableBits];
 
   BitStream m_stream;
   DecodeNode *m_root;
-
-  std::vector<BitStream> m_blocks;
-  int m_block_size;
-  bool m_use_blocks;
 };
 
 }  // namespace himg
@@ -11,75 +11,13 @@
 #include <algorithm>
 #include <vector>
 
+#include "entropy_common.h"
 #include "huffman_common.h"
 
 namespace himg {
 
 namespace {
 
-// The maximum size of the tree representation (there are two additional bits
-// per leaf node, representing the branches in the tree).
-const int kMaxTreeDataSize = ((2 + kSymbolSize) * kNumSymbols + 7) / 8;
-
-class OutBitstream {
- public:
-  // Initialize a bitstream.
-  explicit OutBitstream(uint8_t *buf)
-      : m_base_ptr(buf), m_byte_ptr(buf), m_bit_pos(0) {}
-
-  // Write bits to a bitstream.
-  void WriteBits(uint32_t x, int bits) {
-    // Get current stream state.
-    uint8_t *buf = m_byte_ptr;
-    int bit = m_bit_pos;
-
-    // Append bits.
-    // TODO(m): Optimize this!
-    while (bits--) {
-      *buf = (*buf & (0xff ^ (1 << bit))) | ((x & 1) << bit);
-      x >>= 1;
-      bit = (bit + 1) & 7;
-      if (!bit) {
-        ++buf;
-      }
-    }
-
-    // Store new stream state.
-    m_byte_ptr = buf;
-    m_bit_pos = bit;
-  }
-
-  // Align the stream to a byte boundary (do nothing if already aligned).
-  void AlignToByte() {
-    if (m_bit_pos) {
-      m_bit_pos = 0;
-      ++m_byte_ptr;
-    }
-  }
-
-  // Advance N bytes.
-  void AdvanceBytes(int N) {
-    m_byte_ptr += N;
-  }
-
-  int Size() const {
-    int total_bytes = static_cast<int>(m_byte_ptr - m_base_ptr);
-    if (m_bit_pos > 0) {
-      ++total_bytes;
-    }
-    return total_bytes;
-  }
-
-  uint8_t *byte_ptr() {
-    return m_byte_ptr;
-  }
-
- private:
-  uint8_t *m_base_ptr;
-  uint8_t *m_byte_ptr;
-  int m_bit_pos;
-};
-
 // Used by the encoder for building the optimal Huffman tree.
 struct SymbolInfo {
   Symbol symbol;
@@ -94,11 +32,11 @@ struct EncodeNode {
   int symbol;
 };
 
-// Calculate (sorted) histogram for a block of data.
+// Calculate (sorted) histogram for a sequence of blocks of data.
 void Histogram(const uint8_t *in,
                SymbolInfo *symbols,
-               int size,
-               int block_size) {
+               const int *block_sizes,
+               int num_blocks) {
   // Clear/init histogram.
   for (int k = 0; k < kNumSymbols; ++k) {
     symbols[k].symbol = static_cast<Symbol>(k);
@@ -108,8 +46,10 @@ void Histogram(const uint8_t *in,
   }
 
   // Build the histogram for all blocks.
-  const uint8_t *in_end = in + size;
-  for (const uint8_t *block = in; block < in_end; block += block_size) {
+  const uint8_t *block = in;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    const int block_size = block_sizes[block_no];
+
     // Build the histogram for this block.
     for (int k = 0; k < block_size;) {
       Symbol symbol = static_cast<Symbol>(block[k]);
@@ -140,6 +80,8 @@ void Histogram(const uint8_t *in,
         k++;
       }
     }
+
+    block += block_size;
   }
 }
 
@@ -237,6 +179,59 @@ void MakeTree(SymbolInfo *sym, OutBitstream *stream) {
   }
 }
 
+// Encode a block of data (the symbols must be sorted by symbol value). Returns
+// the size of the encoded data, in bytes.
+int EncodeBlock(uint8_t *out,
+                const uint8_t *block,
+                int block_size,
+                const SymbolInfo *symbols) {
+  OutBitstream block_stream(out);
+  for (int k = 0; k < block_size;) {
+    uint8_t symbol = block[k];
+
+    // Possible RLE?
+    if (symbol == 0) {
+      int zeros;
+      for (zeros = 1; zeros < 16662 && (k + zeros) < block_size; ++zeros) {
+        if (block[k + zeros] != 0)
+          break;
+      }
+      if (zeros == 1) {
+        block_stream.WriteBits(symbols[0].code, symbols[0].bits);
+      } else if (zeros == 2) {
+        block_stream.WriteBits(symbols[kSymTwoZeros].code,
+                               symbols[kSymTwoZeros].bits);
+      } else if (zeros <= 6) {
+        uint32_t count = static_cast<uint32_t>(zeros - 3);
+        block_stream.WriteBits(symbols[kSymUpTo6Zeros].code,
+                               symbols[kSymUpTo6Zeros].bits);
+        block_stream.WriteBits(count, 2);
+      } else if (zeros <= 22) {
+        uint32_t count = static_cast<uint32_t>(zeros - 7);
+        block_stream.WriteBits(symbols[kSymUpTo22Zeros].code,
+                               symbols[kSymUpTo22Zeros].bits);
+        block_stream.WriteBits(count, 4);
+      } else if (zeros <= 278) {
+        uint32_t count = static_cast<uint32_t>(zeros - 23);
+        block_stream.WriteBits(symbols[kSymUpTo278Zeros].code,
+                               symbols[kSymUpTo278Zeros].bits);
+        block_stream.WriteBits(count, 8);
+      } else {
+        uint32_t count = static_cast<uint32_t>(zeros - 279);
+        block_stream.WriteBits(symbols[kSymUpTo16662Zeros].code,
+                               symbols[kSymUpTo16662Zeros].bits);
+        block_stream.WriteBits(count, 14);
+      }
+      k += zeros;
+    } else {
+      block_stream.WriteBits(symbols[symbol].code, symbols[symbol].bits);
+      k++;
+    }
+  }
+  block_stream.AlignToByte();
+  return block_stream.Size();
+}
+
 }  // namespace
 
 int HuffmanEnc::MaxCompressedSize(int uncompressed_size) {
@@ -253,18 +248,61 @@ int HuffmanEnc::Compress(uint8_t *out,
 
   if (block_size < 1)
     block_size = in_size;
-  const bool use_blocks = block_size < in_size;
 
   // Sanity check: Do the blocks add up the the entire input buffer?
   if (in_size % block_size != 0)
     return 0;
 
+  std::vector<int> block_sizes(in_size / block_size, block_size);
+  return Compress(out,
+                  in,
+                  in_size,
+                  block_sizes.data(),
+                  static_cast<int>(block_sizes.size()));
+}
+
+int HuffmanEnc::Compress(uint8_t *out,
+                         const uint8_t *in,
+                         int in_size,
+                         const int *block_sizes,
+                         int num_blocks,
+                         int num_substreams,
+                         int *block_offsets) {
+  // Do we have anything to compress?
+  if (in_size < 1 || num_blocks < 1 || num_substreams < 1)
+    return 0;
+  const bool use_blocks = num_blocks > 1;
+
+  // Sanity check: Do the blocks add up the the entire input buffer, and can
+  // they be split into substreams?
+  int max_block_size = 0;
+  int total_size = 0;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    if (block_sizes[block_no] < 1 || block_sizes[block_no] % num_substreams)
+      return 0;
+    max_block_size = std::max(max_block_size, block_sizes[block_no]);
+    total_size += block_sizes[block_no];
+  }
+  if (total_size != in_size)
+    return 0;
+
+  // Each substream is coded separately (e.g. RLE runs end at the substream
+  // boundaries), so the histogram is calculated per substream.
+  std::vector<int> part_sizes;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    for (int k = 0; k < num_substreams; ++k)
+      part_sizes.push_back(block_sizes[block_no] / num_substreams);
+  }
+
   // Initialize bitstream.
   OutBitstream stream(out);
 
   // Calculate and sort histogram for input data.
   SymbolInfo symbols[kNumSymbols];
-  Histogram(in, symbols, in_size, block_size);
+  Histogram(in,
+            symbols,
+            part_sizes.data(),
+            static_cast<int>(part_sizes.size()));
 
   // Build Huffman tree.
   MakeTree(symbols, &stream);
@@ -285,77 +323,36 @@ int HuffmanEnc::Compress(uint8_t *out,
     }
   } while (swaps);
 
-  std::vector<uint8_t> block_buffer(block_size);
+  const int max_part_size = max_block_size / num_substreams;
+  std::vector<uint8_t> part_buffer(MaxCompressedSize(max_part_size) *
+                                   num_substreams);
+  std::vector<int> packed_part_sizes(num_substreams);
 
   // Encode input stream.
-  const uint8_t *in_end = in + in_size;
-  for (const uint8_t *block = in; block < in_end; block += block_size) {
-    // Create a temporary output stream for this block.
-    OutBitstream block_stream(block_buffer.data());
-
-    // Encode this block.
-    for (int k = 0; k < block_size;) {
-      uint8_t symbol = block[k];
-
-      // Possible RLE?
-      if (symbol == 0) {
-        int zeros;
-        for (zeros = 1; zeros < 16662 && (k + zeros) < block_size; ++zeros) {
-          if (block[k + zeros] != 0)
-            break;
-        }
-        if (zeros == 1) {
-          block_stream.WriteBits(symbols[0].code, symbols[0].bits);
-        } else if (zeros == 2) {
-          block_stream.WriteBits(symbols[kSymTwoZeros].code,
-                                 symbols[kSymTwoZeros].bits);
-        } else if (zeros <= 6) {
-          uint32_t count = static_cast<uint32_t>(zeros - 3);
-          block_stream.WriteBits(symbols[kSymUpTo6Zeros].code,
-                                 symbols[kSymUpTo6Zeros].bits);
-          block_stream.WriteBits(count, 2);
-        } else if (zeros <= 22) {
-          uint32_t count = static_cast<uint32_t>(zeros - 7);
-          block_stream.WriteBits(symbols[kSymUpTo22Zeros].code,
-                                 symbols[kSymUpTo22Zeros].bits);
-          block_stream.WriteBits(count, 4);
-        } else if (zeros <= 278) {
-          uint32_t count = static_cast<uint32_t>(zeros - 23);
-          block_stream.WriteBits(symbols[kSymUpTo278Zeros].code,
-                                 symbols[kSymUpTo278Zeros].bits);
-          block_stream.WriteBits(count, 8);
-        } else {
-          uint32_t count = static_cast<uint32_t>(zeros - 279);
-          block_stream.WriteBits(symbols[kSymUpTo16662Zeros].code,
-                                 symbols[kSymUpTo16662Zeros].bits);
-          block_stream.WriteBits(count, 14);
-        }
-        k += zeros;
-      } else {
-        block_stream.WriteBits(symbols[symbol].code, symbols[symbol].bits);
-        k++;
-      }
-    }
-
-    const int packed_size = block_stream.Size();
-
-    if (use_blocks) {
-      // Write the packed size (in bytes) as two or four bytes (depending on the
-      // size).
-      stream.AlignToByte();
-      if (packed_size <= 0x7fff) {
-        stream.WriteBits(packed_size, 16);
-      } else {
-        stream.WriteBits((packed_size & 0x7fff) | 0x8000, 16);
-        stream.WriteBits(packed_size >> 15, 16);
-      }
+  const uint8_t *block = in;
+  for (int block_no = 0; block_no < num_blocks; ++block_no) {
+    const int block_size = block_sizes[block_no];
+
+    // Encode the substreams of this block into temporary buffers, and append
+    // them to the output stream.
+    const int part_size = block_size / num_substreams;
+    for (int k = 0; k < num_substreams; ++k) {
+      packed_part_sizes[k] =
+          EncodeBlock(&part_buffer[MaxCompressedSize(max_part_size) * k],
+                      block + part_size * k,
+                      part_size,
+                      symbols);
     }
-
-    // Append the block stream to the output stream.
-    std::copy(block_buffer.data(),
-              block_buffer.data() + packed_size,
-              stream.byte_ptr());
-    stream.AdvanceBytes(packed_size);
+    if (block_offsets)
+      block_offsets[block_no] = stream.Size();
+    WriteBlock(&stream,
+               use_blocks,
+               part_buffer.data(),
+               MaxCompressedSize(max_part_size),
+               packed_part_sizes.data(),
+               num_substreams);
+
+    block += block_size;
   }
 
   // Calculate size of output data.
@@ -17,10 +17,33 @@ class HuffmanEnc {
  public:
   static int MaxCompressedSize(int uncompressed_size);
 
+  // Compress the input data. If block_size is non-zero, the data is divided
+  // into blocks of block_size bytes that can be uncompressed independently
+  // (see HuffmanDec::UncompressBlock()).
   static int Compress(uint8_t *out,
                       const uint8_t *in,
                       int in_size,
                       int block_size);
+
+  // Compress the input data as num_blocks blocks of different sizes (the
+  // sizes must add up to in_size). A single block gives a stream without
+  // blocks.
+  //
+  // If num_substreams > 1, each block is split into that many equally sized
+  // parts that are coded as separate substreams (sharing the same tree), so
+  // that the decoder can decode them in an interleaved fashion. The block
+  // sizes must be multiples of num_substreams, and each block needs
+  // 4 * (num_substreams - 1) bytes of extra output space.
+  //
+  // If block_offsets is not null, it receives the byte offset of each block
+  // (of its packed size), relative to the start of the output.
+  static int Compress(uint8_t *out,
+                      const uint8_t *in,
+                      int in_size,
+                      const int *block_sizes,
+                      int num_blocks,
+                      int num_substreams = 1,
+                      int *block_offsets = nullptr);
 };
 
 }  // namespace himg
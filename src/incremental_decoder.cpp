@@ -0,0 +1,225 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "incremental_decoder.h"
+
+#include <algorithm>
+#include <climits>
+#include <iostream>
+
+#include "common.h"
+#include "entropy_enc.h"
+
+namespace himg {
+
+namespace {
+
+// The chunks that precede the FRES chunk, in the order that they are decoded
+// (this is the same order that Decoder::Decode() uses).
+struct ChunkDecoder {
+  const char *name;
+  bool (IncrementalDecoder::*decode)();
+  const char *error_message;
+};
+
+}  // namespace
+
+IncrementalDecoder::IncrementalDecoder(int max_threads) : Decoder(max_threads) {
+  Reset();
+}
+
+void IncrementalDecoder::Reset() {
+  m_state = kRIFFStart;
+  m_buffer.clear();
+  m_total_size = -1;
+  m_next_chunk = 0;
+  m_full_res_dec.reset();
+  m_full_res_start = 0;
+  m_decoded_rows = 0;
+
+  m_unpacked_data.clear();
+  m_downsampled.clear();
+  m_packed_data = nullptr;
+  m_packed_size = 0;
+  m_packed_idx = 0;
+}
+
+void IncrementalDecoder::Feed(const uint8_t *data, int size) {
+  while (size > 0 && m_state != kError) {
+    if (m_total_size < 0) {
+      // Collect the RIFF header (which tells us the total size).
+      int count = std::min(size, 8 - static_cast<int>(m_buffer.size()));
+      m_buffer.insert(m_buffer.end(), data, data + count);
+      data += count;
+      size -= count;
+
+      if (m_buffer.size() == 8) {
+        uint32_t file_size = Read32(&m_buffer[4]);
+        if (Read32(&m_buffer[0]) != ToFourcc("RIFF") ||
+            file_size > static_cast<uint32_t>(INT_MAX - 8)) {
+          Fail("Not a RIFF HIMG file.");
+          return;
+        }
+
+        // Note: The buffer grows as the data arrives, until the FRES chunk is
+        // found (see PollChunks()).
+        m_total_size = static_cast<int>(file_size) + 8;
+      }
+    } else {
+      int count =
+          std::min(size, m_total_size - static_cast<int>(m_buffer.size()));
+      m_buffer.insert(m_buffer.end(), data, data + count);
+      break;
+    }
+  }
+}
+
+bool IncrementalDecoder::Poll() {
+  m_packed_data = m_buffer.data();
+  m_packed_size = static_cast<int>(m_buffer.size());
+
+  if (m_state == kRIFFStart && !PollRIFFStart())
+    return false;
+  if (m_state == kChunks && !PollChunks())
+    return false;
+  if (m_state == kFullRes && !PollFullRes())
+    return false;
+
+  return m_state != kError;
+}
+
+bool IncrementalDecoder::Fail(const char *message) {
+  std::cout << message << "\n";
+  m_state = kError;
+  return false;
+}
+
+bool IncrementalDecoder::PollRIFFStart() {
+  if (m_packed_size < 12)
+    return true;
+
+  if (m_total_size < 12 || Read32(&m_packed_data[8]) != ToFourcc("HIMG"))
+    return Fail("Not a RIFF HIMG file.");
+
+  m_packed_idx = 12;
+  m_state = kChunks;
+  return true;
+}
+
+bool IncrementalDecoder::PollChunks() {
+  static const ChunkDecoder kChunkDecoders[] = {
+    { "FRMT", &IncrementalDecoder::DecodeHeader,
+      "Error decoding header." },
+    { "LMAP", &IncrementalDecoder::DecodeLowResMappingFunction,
+      "Error decoding low-res mapping function." },
+    { "LRES", &IncrementalDecoder::DecodeLowRes,
+      "Error decoding low-res data." },
+    { "QCFG", &IncrementalDecoder::DecodeQuantizationConfig,
+      "Error decoding quantization configuration." },
+    { "FMAP", &IncrementalDecoder::DecodeFullResMappingFunction,
+      "Error decoding full-res mapping function." }
+  };
+  const int kNumChunkDecoders =
+      sizeof(kChunkDecoders) / sizeof(kChunkDecoders[0]);
+
+  while (true) {
+    // Wait for the next chunk header.
+    if (m_packed_idx + 8 > m_packed_size)
+      return true;
+    uint32_t fourcc = Read32(&m_packed_data[m_packed_idx]);
+    uint32_t chunk_size = Read32(&m_packed_data[m_packed_idx + 4]);
+    if (chunk_size > static_cast<uint32_t>(m_total_size - m_packed_idx - 8))
+      return Fail("Invalid RIFF chunk size.");
+    int chunk_end = m_packed_idx + 8 + static_cast<int>(chunk_size);
+
+    if (m_next_chunk == kNumChunkDecoders) {
+      if (fourcc == ToFourcc("FRES")) {
+        // The full-res entropy decoder refers to the buffer, so the data must
+        // never move from here on. Allocate the rest of the buffer (the data
+        // after the FRES chunk is not needed), but no more than the encoder
+        // can produce for an image of this size, since the chunk size has
+        // not been verified yet.
+        if (chunk_size > MaxFullResChunkSize())
+          return Fail("Invalid RIFF chunk size.");
+        m_total_size = chunk_end;
+        if (static_cast<int>(m_buffer.size()) > m_total_size)
+          m_buffer.resize(m_total_size);
+        m_buffer.reserve(m_total_size);
+        m_packed_data = m_buffer.data();
+        m_packed_size = static_cast<int>(m_buffer.size());
+
+        // The full-res data is decoded block row by block row as it arrives.
+        m_packed_idx += 8;
+        m_full_res_start = m_packed_idx;
+        m_full_res_dec = CreateEntropyDec(m_packed_data + m_packed_idx,
+                                          static_cast<int>(chunk_size),
+                                          UseFullResBlocks(),
+                                          NumFullResSubstreams());
+        BeginFullRes();
+        m_state = kFullRes;
+        return true;
+      }
+    } else if (fourcc == ToFourcc(kChunkDecoders[m_next_chunk].name)) {
+      // Wait for the entire chunk, and decode it.
+      if (chunk_end > m_packed_size)
+        return true;
+      if (!(this->*kChunkDecoders[m_next_chunk].decode)())
+        return Fail(kChunkDecoders[m_next_chunk].error_message);
+      ++m_next_chunk;
+      continue;
+    }
+
+    // Unrecognized chunk. Skip to the next one.
+    if (chunk_end >= m_total_size)
+      return Fail("Missing RIFF chunk.");
+    m_packed_idx = chunk_end;
+  }
+}
+
+uint32_t IncrementalDecoder::MaxFullResChunkSize() const {
+  // The full-res data has 64 bytes per channel and block before entropy
+  // coding (see Encoder::EncodeFullRes()).
+  const EntropyCoder coder =
+      (m_format_flags & kFormatAnsCoding) ? kEntropyAns : kEntropyHuffman;
+  const int64_t num_blocks = static_cast<int64_t>((m_width + 7) >> 3) *
+                             static_cast<int64_t>((m_height + 7) >> 3);
+  const int64_t unpacked_size = num_blocks * 64 * m_num_channels;
+  const int64_t num_streams = static_cast<int64_t>(NumFullResBlocksPerRow()) *
+                              ((m_height + 7) >> 3) * NumFullResSubstreams();
+  if (unpacked_size > INT_MAX / 2 || num_streams > INT_MAX / 16)
+    return static_cast<uint32_t>(INT_MAX);
+
+  return static_cast<uint32_t>(
+      EntropyEnc::MaxCompressedSize(coder,
+                                    static_cast<int>(unpacked_size),
+                                    static_cast<int>(num_streams)));
+}
+
+bool IncrementalDecoder::PollFullRes() {
+  // Find the entropy coded blocks that have been received.
+  if (!m_full_res_dec->InitPartial(m_packed_size - m_full_res_start))
+    return Fail("Error decoding full-res data.");
+
+  // Decode the new block rows (once all their blocks have arrived).
+  int available_block_rows =
+      m_full_res_dec->NumAvailableBlocks() / NumFullResBlocksPerRow();
+  int available_rows = std::min(available_block_rows * 8, m_height);
+  if (available_rows > m_decoded_rows) {
+    if (!DecodeFullResBlockRows(
+            *m_full_res_dec, m_decoded_rows, available_rows)) {
+      return Fail("Error decoding full-res data.");
+    }
+    m_decoded_rows = available_rows;
+  }
+
+  if (m_decoded_rows >= m_height)
+    m_state = kDone;
+  return true;
+}
+
+}  // namespace himg
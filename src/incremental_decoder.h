@@ -0,0 +1,89 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef INCREMENTAL_DECODER_H_
+#define INCREMENTAL_DECODER_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "decoder.h"
+#include "entropy_dec.h"
+
+namespace himg {
+
+// A decoder that decodes an image as the packed data arrives (e.g. from a
+// pipe or a network connection). The header chunks and the low-res data are
+// decoded as soon as they are complete, and each block row of the full-res
+// data is decoded as soon as its Huffman block has been received.
+//
+// Typical usage:
+//   while (!decoder.done()) {
+//     size = Read(buf);
+//     decoder.Feed(buf, size);
+//     if (!decoder.Poll())
+//       Error();
+//   }
+//
+// Use SetObserver() to get notified about decoded rows, or check
+// decoded_rows() after each Poll() (the decoded rows are always the top rows
+// of the image).
+class IncrementalDecoder : public Decoder {
+ public:
+  IncrementalDecoder(int max_threads = 0);
+
+  // Forget all data and prepare for decoding a new image.
+  void Reset();
+
+  // Append received data. Data beyond the end of the RIFF file is ignored.
+  void Feed(const uint8_t *data, int size);
+
+  // Decode as much as possible of the data that has been received so far.
+  // Returns false if the data is invalid.
+  bool Poll();
+
+  // The image dimensions (width() etc) are valid once the header is decoded.
+  bool header_decoded() const { return m_next_chunk > 0; }
+
+  // The number of rows (from the top) that have been completely decoded.
+  int decoded_rows() const { return m_decoded_rows; }
+
+  // True when the entire image has been decoded.
+  bool done() const { return m_state == kDone; }
+
+ private:
+  enum State {
+    kRIFFStart,
+    kChunks,
+    kFullRes,
+    kDone,
+    kError
+  };
+
+  bool Fail(const char *message);
+
+  bool PollRIFFStart();
+  bool PollChunks();
+  bool PollFullRes();
+
+  // An upper bound for the size of the FRES chunk, given the image format.
+  uint32_t MaxFullResChunkSize() const;
+
+  State m_state;
+  std::vector<uint8_t> m_buffer;
+  int m_total_size;
+  int m_next_chunk;
+  std::unique_ptr<EntropyDec> m_full_res_dec;
+  int m_full_res_start;
+  int m_decoded_rows;
+};
+
+}  // namespace himg
+
+#endif  // INCREMENTAL_DECODER_H_
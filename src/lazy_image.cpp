@@ -0,0 +1,153 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "lazy_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace himg {
+
+LazyImage::LazyImage(int max_cached_bands, int max_threads)
+    : Decoder(max_threads),
+      m_max_cached_bands(std::max(0, max_cached_bands)),
+      m_cache_hits(0),
+      m_cache_misses(0) {
+}
+
+bool LazyImage::Open(const uint8_t *packed_data, int packed_size) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bands.clear();
+    m_lru.clear();
+    m_cache_hits = 0;
+    m_cache_misses = 0;
+  }
+  m_full_res_dec.reset();
+
+  // Use our own thread pool unless we have been given one.
+  if (!m_thread_pool) {
+    if (!m_own_pool)
+      m_own_pool.reset(new ThreadPool(m_max_threads));
+    SetThreadPool(m_own_pool.get());
+  }
+
+  // Decode everything except the full-res data.
+  if (!DecodeUpToFullRes(packed_data, packed_size))
+    return false;
+
+  // Prepare the full-res Huffman decoder (this recovers the Huffman tree and
+  // locates all the Huffman blocks).
+  m_full_res_dec = InitFullResDecoder();
+  return m_full_res_dec != nullptr;
+}
+
+bool LazyImage::ReadPixels(int x,
+                           int y,
+                           int w,
+                           int h,
+                           uint8_t *out,
+                           int out_stride) {
+  if (!m_full_res_dec)
+    return false;
+  if (x < 0 || y < 0 || w <= 0 || h <= 0 || x > m_width - w ||
+      y > m_height - h) {
+    return false;
+  }
+
+  const int first_band = y >> 3;
+  const int end_band = ((y + h - 1) >> 3) + 1;
+  const int num_bands = end_band - first_band;
+  const int row_size = m_width * m_num_channels;
+  const int copy_size = w * m_num_channels;
+
+  // Copy the requested part of each band (decoding the band if needed), one
+  // task per band.
+  std::atomic_bool success(true);
+  RunParallel(m_thread_pool, num_bands, m_max_threads, [&](int i) {
+    if (!success)
+      return;
+    int v = first_band + i;
+    std::shared_ptr<const Band> band = GetBand(v);
+    if (!band) {
+      success = false;
+      return;
+    }
+
+    int band_y = v * 8;
+    int row_start = std::max(y, band_y);
+    int row_end = std::min(y + h, band_y + 8);
+    const uint8_t *src = &band->data[x * m_num_channels];
+    for (int row = row_start; row < row_end; ++row) {
+      std::memcpy(&out[(row - y) * out_stride],
+                  &src[(row - band_y) * row_size],
+                  copy_size);
+    }
+  });
+
+  return success;
+}
+
+int LazyImage::cache_hits() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_cache_hits;
+}
+
+int LazyImage::cache_misses() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_cache_misses;
+}
+
+std::shared_ptr<const LazyImage::Band> LazyImage::GetBand(int v) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  // Is the band already in the cache (or being decoded by another thread)?
+  auto it = m_bands.find(v);
+  if (it != m_bands.end()) {
+    ++m_cache_hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru_pos);
+    std::shared_ptr<Band> band = it->second.band;
+    m_band_decoded.wait(lock,
+                        [&band]() { return band->state != Band::kDecoding; });
+    return band->state == Band::kReady ? band : nullptr;
+  }
+
+  // Insert a new band in the cache, so that other threads that need the same
+  // band will wait for us instead of decoding it too. Note that evicted bands
+  // stay alive for as long as someone holds a reference to them.
+  ++m_cache_misses;
+  std::shared_ptr<Band> band(new Band);
+  band->state = Band::kDecoding;
+  m_lru.push_front(v);
+  CacheEntry &entry = m_bands[v];
+  entry.band = band;
+  entry.lru_pos = m_lru.begin();
+  EvictBands();
+
+  // Decode the band (without holding the lock).
+  lock.unlock();
+  band->data.resize(m_width * 8 * m_num_channels);
+  bool decoded =
+      DecodeFullResBlockRow(*m_full_res_dec, v * 8, band->data.data());
+  lock.lock();
+
+  band->state = decoded ? Band::kReady : Band::kFailed;
+  m_band_decoded.notify_all();
+
+  return decoded ? band : nullptr;
+}
+
+void LazyImage::EvictBands() {
+  while (static_cast<int>(m_lru.size()) > m_max_cached_bands) {
+    m_bands.erase(m_lru.back());
+    m_lru.pop_back();
+  }
+}
+
+}  // namespace himg
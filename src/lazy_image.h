@@ -0,0 +1,94 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef LAZY_IMAGE_H_
+#define LAZY_IMAGE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "decoder.h"
+#include "entropy_dec.h"
+#include "thread_pool.h"
+
+namespace himg {
+
+// A view of a packed image that only decodes the parts of the image that are
+// actually accessed. The header chunks, the low-res data and the full-res
+// Huffman tree are decoded once by Open(), and the full-res data is then
+// decoded in bands of eight rows (one block row) on demand. The most recently
+// used bands are kept in a cache.
+//
+// Once Open() has returned, ReadPixels() may be called from several threads
+// concurrently. The packed data must remain valid while the image is in use.
+//
+// Bands are decoded as tasks in a thread pool, so that reads do not start new
+// threads. Unless a pool is given with SetThreadPool(), Open() starts one (of
+// max_threads threads) that is kept until the image is destroyed.
+class LazyImage : public Decoder {
+ public:
+  static const int kDefaultCacheSize = 64;
+
+  // max_cached_bands is the maximum number of decoded bands (of
+  // width() * 8 * num_channels() bytes each) that are kept in memory.
+  LazyImage(int max_cached_bands = kDefaultCacheSize, int max_threads = 0);
+
+  // Prepare for decoding the given packed image. Any cached bands from a
+  // previously opened image are dropped.
+  bool Open(const uint8_t *packed_data, int packed_size);
+
+  // Get the pixels in the rectangle (x, y) - (x + w - 1, y + h - 1), which
+  // must be inside the image. Each output row holds w * num_channels() bytes,
+  // and consecutive rows are out_stride bytes apart.
+  bool ReadPixels(int x, int y, int w, int h, uint8_t *out, int out_stride);
+
+  // Cache statistics (the number of band lookups that were satisfied by the
+  // cache, and the number of bands that had to be decoded).
+  int cache_hits() const;
+  int cache_misses() const;
+
+ private:
+  struct Band {
+    enum State { kDecoding, kReady, kFailed };
+    State state;
+    std::vector<uint8_t> data;
+  };
+
+  struct CacheEntry {
+    std::shared_ptr<Band> band;
+    std::list<int>::iterator lru_pos;
+  };
+
+  // Get the decoded band for block row v (decoding it if necessary), or
+  // nullptr if the band could not be decoded.
+  std::shared_ptr<const Band> GetBand(int v);
+
+  // Drop the least recently used bands until the cache is small enough.
+  // The mutex must be held.
+  void EvictBands();
+
+  int m_max_cached_bands;
+  std::unique_ptr<EntropyDec> m_full_res_dec;
+  std::unique_ptr<ThreadPool> m_own_pool;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_band_decoded;
+  std::unordered_map<int, CacheEntry> m_bands;
+  std::list<int> m_lru;  // Block rows, most recently used first.
+  int m_cache_hits;
+  int m_cache_misses;
+};
+
+}  // namespace himg
+
+#endif  // LAZY_IMAGE_H_
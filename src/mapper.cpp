@@ -153,17 +153,18 @@ bool Mapper::SetMappingFunction(const uint8_t *in, int map_fun_size) {
   // in case of bad input data.
   m_mapping_table[-128] = m_mapping_table[-127];
 
+  InitMapLut();
+
   return true;
 }
 
-uint8_t Mapper::MapTo8Bit(int16_t x) const {
+uint8_t Mapper::MapTo8BitSearch(int16_t x) const {
   if (!x)
     return 0;
 
   int16_t abs_x = std::abs(x);
 
   // Find the best matching table index.
-  // TODO(m): Use binary search instead of O(n) search.
   uint8_t mapped;
   for (mapped = 1; mapped < 127 - 1; ++mapped) {
     if (abs_x < m_mapping_table[mapped + 1]) {
@@ -181,6 +182,27 @@ uint8_t Mapper::MapTo8Bit(int16_t x) const {
   return x >= 0 ? mapped : static_cast<uint8_t>(-static_cast<int8_t>(mapped));
 }
 
+void Mapper::InitMapLut() {
+  // MapTo8BitSearch() picks the first table index m (1 <= m < 126) for which
+  // |x| < m_mapping_table[m + 1] (or m = 126 if there is none), and then
+  // either m or m + 1, whichever entry is closest. The index m can only grow
+  // with |x|, so the table is filled in a single pass.
+  m_map_lut[0] = 0;
+  int m = 1;
+  for (int abs_x = 1; abs_x < kMapLutSize; ++abs_x) {
+    while (m < 126 && abs_x >= m_mapping_table[m + 1])
+      ++m;
+    int mapped;
+    if (m == 126)
+      mapped = 127;
+    else if ((abs_x - m_mapping_table[m]) < (m_mapping_table[m + 1] - abs_x))
+      mapped = m;
+    else
+      mapped = m + 1;
+    m_map_lut[abs_x] = static_cast<uint8_t>(mapped);
+  }
+}
+
 int Mapper::NumberOfSingleByteMappingItems() const {
   int first_two_byte_idx;
   for (first_two_byte_idx = 1; first_two_byte_idx < 128; ++first_two_byte_idx) {
@@ -208,6 +230,8 @@ void LowResMapper::InitForQuality(int quality) {
   // Fill out the negative part.
   for (int k = 1; k <= 127; ++k)
     m_mapping_table[-k] = -m_mapping_table[k];
+
+  InitMapLut();
 }
 
 void FullResMapper::InitForQuality(int /* quality */) {
@@ -220,6 +244,8 @@ void FullResMapper::InitForQuality(int /* quality */) {
   // Fill out the negative part.
   for (int k = 1; k <= 127; ++k)
     m_mapping_table[-k] = -m_mapping_table[k];
+
+  InitMapLut();
 }
 
 }  // namespace himg
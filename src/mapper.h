@@ -26,8 +26,16 @@ class Mapper {
   // Set the mapping function.
   bool SetMappingFunction(const uint8_t *in, int map_fun_size);
 
-  // Map a 16-bit value to an 8-bit value.
-  uint8_t MapTo8Bit(int16_t x) const;
+  // Map a 16-bit value to an 8-bit value (the closest mapping table entry).
+  // Small values are mapped with a lookup table.
+  uint8_t MapTo8Bit(int16_t x) const {
+    const int abs_x = x < 0 ? -x : x;
+    if (abs_x < kMapLutSize) {
+      const uint8_t mapped = m_map_lut[abs_x];
+      return x >= 0 ? mapped : static_cast<uint8_t>(-mapped);
+    }
+    return MapTo8BitSearch(x);
+  }
 
   // Unmap an 8-bit value to a 16-bit.
   int16_t UnmapFrom8Bit(uint8_t x) const {
@@ -35,10 +43,24 @@ class Mapper {
   }
 
  protected:
+  // The size of the MapTo8Bit() lookup table (it covers all the entries of the
+  // built in mapping tables).
+  static const int kMapLutSize = 8192;
+
   int NumberOfSingleByteMappingItems() const;
 
+  // Map a 16-bit value by searching the mapping table.
+  uint8_t MapTo8BitSearch(int16_t x) const;
+
+  // Prepare the MapTo8Bit() lookup table. This must be called whenever the
+  // mapping table changes.
+  void InitMapLut();
+
   int16_t *m_mapping_table;
   int16_t m_mapping_table_full[256];
+
+  // The mapped values of |x| for x in [0, kMapLutSize) (positive x).
+  uint8_t m_map_lut[kMapLutSize];
 };
 
 class LowResMapper : public Mapper {
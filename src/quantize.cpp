@@ -11,6 +11,13 @@
 #include <algorithm>
 #include <iostream>
 
+#include "common.h"
+#include "cpu.h"
+
+#if CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
 namespace himg {
 
 namespace {
@@ -101,6 +108,59 @@ uint8_t NearestLog2(uint16_t x) {
   return y + rounding;
 }
 
+void MakeShiftConstants(uint16_t *round,
+                        uint16_t *mul,
+                        uint16_t *keep,
+                        uint16_t *scale,
+                        const uint8_t *shift_table) {
+  for (int i = 0; i < 64; ++i) {
+    const int shift = shift_table[i];
+    round[i] = static_cast<uint16_t>(shift != 0 ? 1 << (shift - 1) : 0);
+    mul[i] = static_cast<uint16_t>(shift != 0 ? 1 << (16 - shift) : 0);
+    keep[i] = static_cast<uint16_t>(shift != 0 ? 0 : 0xffff);
+    scale[i] = static_cast<uint16_t>(1 << shift);
+  }
+}
+
+#if CPU_DISPATCH_X86
+// The sign-magnitude rounding shift of Quantize::Pack(), for 64 coefficients.
+// The magnitude plus the rounding term fits in 16 unsigned bits, and the
+// shift is done as an unsigned multiplication by 2^(16 - shift) that keeps
+// the high half of the product (which does not work for shift = 0, where the
+// magnitude is kept as is instead).
+TARGET_SSE2 void PackShiftSSE2(int16_t *out,
+                               const int16_t *in,
+                               const uint16_t *round,
+                               const uint16_t *mul,
+                               const uint16_t *keep) {
+  for (int i = 0; i < 64; i += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[i]));
+    __m128i sign = _mm_srai_epi16(x, 15);
+    __m128i abs_x = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+    __m128i y = _mm_add_epi16(
+        abs_x, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&round[i])));
+    __m128i y_high = _mm_mulhi_epu16(
+        y, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&mul[i])));
+    __m128i y_kept = _mm_and_si128(
+        y, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&keep[i])));
+    y = _mm_add_epi16(y_high, y_kept);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[i]),
+                     _mm_sub_epi16(_mm_xor_si128(y, sign), sign));
+  }
+}
+
+// The shift of Quantize::Unpack(), for 64 coefficients (in place), as a
+// multiplication by 2^shift.
+TARGET_SSE2 void UnpackShiftSSE2(int16_t *x, const uint16_t *scale) {
+  for (int i = 0; i < 64; i += 8) {
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&x[i]));
+    y = _mm_mullo_epi16(
+        y, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&scale[i])));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&x[i]), y);
+  }
+}
+#endif
+
 void MakeShiftTable(uint8_t *shift_table,
                     const uint8_t *base,
                     uint8_t quality) {
@@ -122,12 +182,43 @@ void Quantize::InitForQuality(uint8_t quality, bool has_chroma) {
   MakeShiftTable(m_shift_table, kShiftTableBase, quality);
   if (m_has_chroma)
     MakeShiftTable(m_chroma_shift_table, kChromaShiftTableBase, quality);
+
+  InitShiftConstants();
+}
+
+void Quantize::InitShiftConstants() {
+  MakeShiftConstants(m_shift_constants.round,
+                     m_shift_constants.mul,
+                     m_shift_constants.keep,
+                     m_shift_constants.scale,
+                     m_shift_table);
+  if (m_has_chroma) {
+    MakeShiftConstants(m_chroma_shift_constants.round,
+                       m_chroma_shift_constants.mul,
+                       m_chroma_shift_constants.keep,
+                       m_chroma_shift_constants.scale,
+                       m_chroma_shift_table);
+  }
 }
 
 void Quantize::Pack(uint8_t *out,
                     const int16_t *in,
                     bool chroma_channel,
                     const Mapper &mapper) {
+#if CPU_DISPATCH_X86
+  static const bool kUseSSE2 = CPU::HasSSE2();
+  if (kUseSSE2) {
+    const ShiftConstants &constants =
+        chroma_channel ? m_chroma_shift_constants : m_shift_constants;
+    int16_t shifted[64];
+    PackShiftSSE2(
+        shifted, in, constants.round, constants.mul, constants.keep);
+    for (int i = 0; i < 64; ++i)
+      out[i] = mapper.MapTo8Bit(shifted[i]);
+    return;
+  }
+#endif
+
   // Select which shift table to use.
   const uint8_t *shift_table =
       chroma_channel ? m_chroma_shift_table : m_shift_table;
@@ -154,13 +245,36 @@ void Quantize::Unpack(int16_t *out,
                       const uint8_t *in,
                       bool chroma_channel,
                       const Mapper &mapper) const {
+#if CPU_DISPATCH_X86
+  static const bool kUseSSE2 = CPU::HasSSE2();
+  if (kUseSSE2) {
+    const ShiftConstants &constants =
+        chroma_channel ? m_chroma_shift_constants : m_shift_constants;
+    for (int i = 0; i < 64; ++i)
+      out[i] = mapper.UnmapFrom8Bit(in[i]);
+    UnpackShiftSSE2(out, constants.scale);
+    return;
+  }
+#endif
+
   // Select which shift table to use.
   const uint8_t *shift_table =
       chroma_channel ? m_chroma_shift_table : m_shift_table;
 
+  // NOTE: The shift is done as a multiplication, since left shifting negative
+  // numbers is undefined.
   for (int i = 0; i < 64; ++i) {
     uint8_t shift = shift_table[i];
-    *out++ = mapper.UnmapFrom8Bit(*in++) << shift;
+    *out++ = static_cast<int16_t>(mapper.UnmapFrom8Bit(*in++) * (1 << shift));
+  }
+}
+
+void Quantize::InitUnpackLuts(const Mapper &mapper) {
+  for (int shift = 0; shift < 16; ++shift) {
+    for (int x = 0; x < 256; ++x) {
+      m_unpack_luts[shift][x] = static_cast<int16_t>(
+          mapper.UnmapFrom8Bit(static_cast<uint8_t>(x)) * (1 << shift));
+    }
   }
 }
 
@@ -209,6 +323,8 @@ bool Quantize::SetConfiguration(
     }
   }
 
+  InitShiftConstants();
+
   return true;
 }
 
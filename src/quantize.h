@@ -11,6 +11,7 @@
 
 #include <cstdint>
 
+#include "common.h"
 #include "mapper.h"
 
 namespace himg {
@@ -32,6 +33,20 @@ class Quantize {
               bool chroma_channel,
               const Mapper &mapper) const;
 
+  // Prepare the lookup tables for UnpackLut(). This must be called again if
+  // the configuration or the mapping function changes.
+  void InitUnpackLuts(const Mapper &mapper);
+
+  // Get the unpack lookup table for packed coefficient i, in full-res order
+  // (i.e. coefficient kIndexLUT[i]). Entry x of the table is the unpacked
+  // 16-bit value of the packed value x, so that the entropy decoder can
+  // dequantize while decoding (see HuffmanDec::RowOutput).
+  const int16_t *UnpackLut(int i, bool chroma_channel) const {
+    const uint8_t *shift_table =
+        chroma_channel ? m_chroma_shift_table : m_shift_table;
+    return m_unpack_luts[shift_table[kIndexLUT[i]]];
+  }
+
   // Get the required size for the quantization configuration (in bytes).
   int ConfigurationSize() const;
 
@@ -42,9 +57,29 @@ class Quantize {
   bool SetConfiguration(const uint8_t *in, int config_size, bool has_chroma);
 
  private:
+  // Per coefficient constants for the SIMD versions of Pack() and Unpack(),
+  // derived from a shift table.
+  struct ShiftConstants {
+    uint16_t round[64];  // The rounding term of Pack().
+    uint16_t mul[64];    // 2^(16 - shift) (zero for shift = 0).
+    uint16_t keep[64];   // 0xffff for shift = 0 (zero otherwise).
+    uint16_t scale[64];  // 2^shift (for Unpack()).
+  };
+
+  // Update the shift constants. This must be called whenever the shift tables
+  // change.
+  void InitShiftConstants();
+
   bool m_has_chroma;
   uint8_t m_shift_table[64];
   uint8_t m_chroma_shift_table[64];
+
+  // The shift constants of m_shift_table and m_chroma_shift_table.
+  ShiftConstants m_shift_constants;
+  ShiftConstants m_chroma_shift_constants;
+
+  // One unpack lookup table per shift (shifts are stored as four bits).
+  int16_t m_unpack_luts[16][256];
 };
 
 }  // namespace himg
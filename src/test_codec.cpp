@@ -0,0 +1,341 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+// Round-trip tests that encode small images with all the combinations of the
+// optional format features, and check that all the ways of decoding an image
+// give the same result, and that broken files are rejected. Run with
+// "make test".
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "common.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "incremental_decoder.h"
+#include "lazy_image.h"
+
+namespace himg {
+
+namespace {
+
+// The test images. The sizes are not multiples of the block size, and some
+// images span several low-res macro rows or full-res segments.
+struct TestImage {
+  int width;
+  int height;
+  int num_channels;
+  bool use_ycbcr;
+  int quality;
+};
+
+const TestImage kTestImages[] = {{1, 1, 1, false, 50},
+                                 {13, 7, 1, false, 90},
+                                 {30, 17, 2, false, 25},
+                                 {67, 73, 3, true, 50},
+                                 {45, 29, 3, false, 75},
+                                 {521, 19, 4, true, 50}};
+
+// All the combinations of the optional format features.
+const int kNumFormatFlagCombinations = kFormatSupportedFlags + 1;
+
+// The number of bytes per IncrementalDecoder::Feed() call.
+const int kFeedSizes[] = {1, 97};
+
+// A fast pseudo random number generator (xorshift).
+uint32_t g_random_state = 12345;
+
+// A random integer in [min, max] (the slight bias of the modulo does not
+// matter here).
+int RandomInt(int min, int max) {
+  g_random_state ^= g_random_state << 13;
+  g_random_state ^= g_random_state >> 17;
+  g_random_state ^= g_random_state << 5;
+  return min + static_cast<int>(g_random_state %
+                                static_cast<uint32_t>(max - min + 1));
+}
+
+// Silence the diagnostic output of the codec (e.g. the encoder statistics and
+// the decoder errors for the broken files) while in scope.
+class QuietOutput {
+ public:
+  QuietOutput() { std::cout.setstate(std::ios::failbit); }
+  ~QuietOutput() { std::cout.clear(); }
+};
+
+// A sink for Decoder::DecodeStreaming() that collects the rows, and checks
+// that they arrive in order.
+class CollectRows : public RowSink {
+ public:
+  CollectRows() : m_next_row(0) {}
+
+  bool ConsumeRows(const Decoder &decoder,
+                   const uint8_t *rows,
+                   int first_row,
+                   int num_rows) override {
+    if (first_row != m_next_row || num_rows < 1)
+      return false;
+    const int row_size = decoder.width() * decoder.num_channels();
+    m_data.insert(m_data.end(), rows, rows + num_rows * row_size);
+    m_next_row += num_rows;
+    return true;
+  }
+
+  const std::vector<uint8_t> &data() const { return m_data; }
+
+ private:
+  std::vector<uint8_t> m_data;
+  int m_next_row;
+};
+
+// Create an image with smooth gradients, noise and a few sharp edges, so that
+// it exercises both small and large coefficients.
+std::vector<uint8_t> MakeImage(const TestImage &image) {
+  std::vector<uint8_t> data(image.width * image.height * image.num_channels);
+  int k = 0;
+  for (int y = 0; y < image.height; ++y) {
+    for (int x = 0; x < image.width; ++x) {
+      const bool edge = ((x / 11) + (y / 5)) % 4 == 0;
+      for (int c = 0; c < image.num_channels; ++c) {
+        int value = x * (c + 1) + y * 3 + RandomInt(-8, 8) + (edge ? 90 : 0);
+        data[k++] = ClampTo8Bit(value);
+      }
+    }
+  }
+  return data;
+}
+
+bool Encode(const TestImage &image,
+            const std::vector<uint8_t> &data,
+            int format_flags,
+            bool block_index,
+            std::vector<uint8_t> *packed) {
+  QuietOutput quiet;
+  Encoder encoder;
+  encoder.SetFormatFlags(static_cast<uint8_t>(format_flags));
+  encoder.SetWriteBlockIndex(block_index);
+  if (!encoder.Encode(data.data(),
+                      image.width,
+                      image.height,
+                      image.num_channels,
+                      image.num_channels,
+                      image.quality,
+                      image.use_ycbcr)) {
+    return false;
+  }
+  packed->assign(encoder.packed_data(),
+                 encoder.packed_data() + encoder.packed_size());
+  return true;
+}
+
+bool Decode(const std::vector<uint8_t> &packed,
+            int packed_size,
+            std::vector<uint8_t> *out) {
+  QuietOutput quiet;
+  Decoder decoder;
+  if (!decoder.Decode(packed.data(), packed_size))
+    return false;
+  out->assign(decoder.unpacked_data(),
+              decoder.unpacked_data() + decoder.unpacked_size());
+  return true;
+}
+
+bool DecodeStreaming(const std::vector<uint8_t> &packed,
+                     std::vector<uint8_t> *out) {
+  QuietOutput quiet;
+  Decoder decoder;
+  CollectRows sink;
+  if (!decoder.DecodeStreaming(
+          packed.data(), static_cast<int>(packed.size()), &sink)) {
+    return false;
+  }
+  *out = sink.data();
+  return true;
+}
+
+bool DecodeIncremental(const std::vector<uint8_t> &packed,
+                       int feed_size,
+                       std::vector<uint8_t> *out) {
+  QuietOutput quiet;
+  IncrementalDecoder decoder;
+  const int packed_size = static_cast<int>(packed.size());
+  for (int pos = 0; pos < packed_size && !decoder.done(); pos += feed_size) {
+    decoder.Feed(&packed[pos], std::min(feed_size, packed_size - pos));
+    if (!decoder.Poll())
+      return false;
+  }
+  if (!decoder.done())
+    return false;
+  out->assign(decoder.unpacked_data(),
+              decoder.unpacked_data() + decoder.unpacked_size());
+  return true;
+}
+
+// Read the image from a LazyImage in tiles of odd sizes, out of order.
+bool DecodeLazy(const std::vector<uint8_t> &packed,
+                const TestImage &image,
+                std::vector<uint8_t> *out) {
+  QuietOutput quiet;
+  LazyImage lazy(2);
+  if (!lazy.Open(packed.data(), static_cast<int>(packed.size())))
+    return false;
+  const int tile_width = 13;
+  const int tile_height = 11;
+  const int stride = image.width * image.num_channels;
+  out->assign(stride * image.height, 0);
+  for (int x = 0; x < image.width; x += tile_width) {
+    for (int y = image.height - 1; y >= 0; y -= tile_height) {
+      const int y0 = std::max(0, y - tile_height + 1);
+      const int w = std::min(tile_width, image.width - x);
+      if (!lazy.ReadPixels(x,
+                           y0,
+                           w,
+                           y - y0 + 1,
+                           &(*out)[y0 * stride + x * image.num_channels],
+                           stride)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool Verify(const std::vector<uint8_t> &packed, int packed_size) {
+  QuietOutput quiet;
+  Decoder decoder;
+  VerifyError error;
+  return decoder.Verify(packed.data(), packed_size, &error);
+}
+
+bool Fail(const char *test,
+          const TestImage &image,
+          int format_flags,
+          bool block_index) {
+  std::cout << test << ": Failed for a " << image.width << "x" << image.height
+            << " image with " << image.num_channels
+            << " channels (format flags " << format_flags << ", "
+            << (block_index ? "with" : "without") << " block index).\n";
+  return false;
+}
+
+// Run a test for all the images and format feature combinations.
+bool ForAllFormats(bool (*test)(const TestImage &image,
+                                int format_flags,
+                                bool block_index)) {
+  for (const TestImage &image : kTestImages) {
+    for (int flags = 0; flags < kNumFormatFlagCombinations; ++flags) {
+      for (int block_index = 0; block_index < 2; ++block_index) {
+        if (!test(image, flags, block_index != 0))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+// All the decoders must give the same image, and Verify() must accept it.
+bool CheckDecodersAgree(const TestImage &image,
+                       int format_flags,
+                       bool block_index) {
+  const std::vector<uint8_t> data = MakeImage(image);
+  std::vector<uint8_t> packed;
+  if (!Encode(image, data, format_flags, block_index, &packed))
+    return Fail("Encode", image, format_flags, block_index);
+
+  std::vector<uint8_t> expected;
+  if (!Decode(packed, static_cast<int>(packed.size()), &expected) ||
+      expected.size() != data.size()) {
+    return Fail("Decode", image, format_flags, block_index);
+  }
+  if (!Verify(packed, static_cast<int>(packed.size())))
+    return Fail("Verify", image, format_flags, block_index);
+
+  std::vector<uint8_t> out;
+  if (!DecodeStreaming(packed, &out) || out != expected)
+    return Fail("DecodeStreaming", image, format_flags, block_index);
+  for (int feed_size : kFeedSizes) {
+    if (!DecodeIncremental(packed, feed_size, &out) || out != expected)
+      return Fail("IncrementalDecoder", image, format_flags, block_index);
+  }
+  if (!DecodeLazy(packed, image, &out) || out != expected)
+    return Fail("LazyImage", image, format_flags, block_index);
+  return true;
+}
+
+// Truncated files must be rejected, and a corrupted file must either be
+// rejected by both Decode() and Verify(), or accepted by both (a change in the
+// entropy coded data may still decode, to different pixels).
+bool CheckBrokenFiles(const TestImage &image,
+                      int format_flags,
+                      bool block_index) {
+  const std::vector<uint8_t> data = MakeImage(image);
+  std::vector<uint8_t> packed;
+  if (!Encode(image, data, format_flags, block_index, &packed))
+    return Fail("Encode", image, format_flags, block_index);
+  const int packed_size = static_cast<int>(packed.size());
+
+  std::vector<uint8_t> out;
+  const int step = std::max(1, packed_size / 64);
+  for (int size = packed_size - 1; size >= 0; size -= step) {
+    if (Decode(packed, size, &out) || Verify(packed, size))
+      return Fail("Truncated file", image, format_flags, block_index);
+  }
+
+  for (int n = 0; n < 64; ++n) {
+    std::vector<uint8_t> corrupted(packed);
+    corrupted[RandomInt(0, packed_size - 1)] ^=
+        static_cast<uint8_t>(1 << RandomInt(0, 7));
+    if (Decode(corrupted, packed_size, &out) != Verify(corrupted, packed_size))
+      return Fail("Corrupted file", image, format_flags, block_index);
+  }
+
+  // Corrupt the image header (the RIFF form type and the format version).
+  for (int idx : {8, 20}) {
+    std::vector<uint8_t> corrupted(packed);
+    corrupted[idx] ^= 0x80;
+    if (Decode(corrupted, packed_size, &out) ||
+        Verify(corrupted, packed_size)) {
+      return Fail("Corrupted header", image, format_flags, block_index);
+    }
+  }
+  return true;
+}
+
+bool TestRoundTrip() {
+  return ForAllFormats(CheckDecodersAgree);
+}
+
+bool TestBrokenFiles() {
+  return ForAllFormats(CheckBrokenFiles);
+}
+
+}  // namespace
+
+}  // namespace himg
+
+int main() {
+  struct Test {
+    const char *name;
+    bool (*run)();
+  };
+  static const Test kTests[] = {
+    { "Codec round trip", himg::TestRoundTrip },
+    { "Broken files", himg::TestBrokenFiles }
+  };
+
+  bool success = true;
+  for (const Test &test : kTests) {
+    std::cout << test.name << "... " << std::flush;
+    bool passed = test.run();
+    std::cout << (passed ? "OK" : "FAILED") << "\n";
+    success = success && passed;
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,357 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+// Randomized tests that check that all the SIMD kernels that are supported by
+// the CPU give exactly the same results as the scalar reference code. Run
+// with "make test".
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "common.h"
+#include "hadamard.h"
+#include "ycbcr.h"
+
+namespace himg {
+
+namespace {
+
+// The number of random blocks per test.
+const int kNumRandomBlocks = 1000000;
+
+const int kMax16BitCoeff = Hadamard::kMax16BitCoeff;
+
+// A fast pseudo random number generator (xorshift), since the tests need a
+// lot of random numbers.
+uint32_t g_random_state = 12345;
+
+// A random integer in [min, max] (the slight bias of the modulo does not
+// matter here).
+int RandomInt(int min, int max) {
+  g_random_state ^= g_random_state << 13;
+  g_random_state ^= g_random_state >> 17;
+  g_random_state ^= g_random_state << 5;
+  return min + static_cast<int>(g_random_state %
+                                static_cast<uint32_t>(max - min + 1));
+}
+
+// The kinds of random coefficients.
+enum CoeffKind {
+  kFullRange,    // Any 16-bit value.
+  kRange16Bit,   // Within [-kMax16BitCoeff, kMax16BitCoeff].
+  kSmall,        // Typical values.
+  kEdge,         // The limits of the above ranges.
+  kNumCoeffKinds
+};
+
+const int16_t kEdgeValues[] = {-32768,
+                               32767,
+                               -kMax16BitCoeff - 1,
+                               kMax16BitCoeff + 1,
+                               -kMax16BitCoeff,
+                               kMax16BitCoeff,
+                               -1,
+                               0,
+                               1};
+const int kNumEdgeValues = sizeof(kEdgeValues) / sizeof(kEdgeValues[0]);
+
+int16_t RandomCoeff(CoeffKind kind) {
+  switch (kind) {
+    case kFullRange:
+      return static_cast<int16_t>(RandomInt(-32768, 32767));
+    case kRange16Bit:
+      return static_cast<int16_t>(RandomInt(-kMax16BitCoeff, kMax16BitCoeff));
+    case kSmall:
+      return static_cast<int16_t>(RandomInt(-64, 64));
+    default:
+      return kEdgeValues[RandomInt(0, kNumEdgeValues - 1)];
+  }
+}
+
+// The parity of a three bit number.
+int Parity3(int x) {
+  x ^= x >> 1;
+  x ^= x >> 2;
+  return x & 1;
+}
+
+// Fill a block with random coefficients. Most blocks use a single kind of
+// coefficients, but some blocks mix kinds (e.g. a single large coefficient
+// among small ones), and some blocks are worst cases for the intermediate
+// sums of the transforms: an edge value times a Hadamard basis function, with
+// some coefficients changed by one.
+void RandomBlock(int16_t *block) {
+  if (RandomInt(0, 7) == 0) {
+    const int c = kEdgeValues[RandomInt(0, kNumEdgeValues - 1)];
+    const int a = RandomInt(0, 7);
+    const int b = RandomInt(0, 7);
+    for (int i = 0; i < 64; ++i) {
+      int x = Parity3((a & (i >> 3)) ^ (b & i & 7)) ? -c : c;
+      if (RandomInt(0, 7) == 0)
+        x += RandomInt(-1, 1);
+      block[i] = static_cast<int16_t>(std::min(std::max(x, -32768), 32767));
+    }
+    return;
+  }
+
+  const bool mixed = RandomInt(0, 4) == 0;
+  const CoeffKind kind =
+      static_cast<CoeffKind>(RandomInt(0, kNumCoeffKinds - 1));
+  for (int i = 0; i < 64; ++i) {
+    block[i] = RandomCoeff(
+        mixed ? static_cast<CoeffKind>(RandomInt(0, kNumCoeffKinds - 1))
+              : kind);
+  }
+}
+
+// Keep only the first num_coeffs coefficients of a block (in kIndexLUT order).
+void TruncateBlock(int16_t *block, int num_coeffs) {
+  for (int i = num_coeffs; i < 64; ++i)
+    block[kIndexLUT[i]] = 0;
+}
+
+bool Fail(const char *test, const char *kernel_set) {
+  std::cout << test << ": The " << kernel_set
+            << " kernels give the wrong results.\n";
+  return false;
+}
+
+bool TestHadamardBlocks() {
+  const std::vector<Hadamard::KernelSet> sets =
+      Hadamard::SupportedKernelSets();
+  const Hadamard::KernelSet &reference = sets[0];
+  for (int n = 0; n < kNumRandomBlocks; ++n) {
+    int16_t block[64];
+    RandomBlock(block);
+    if (RandomInt(0, 1) == 0)
+      TruncateBlock(block, RandomInt(1, 64));
+
+    int16_t forward[64], inverse[64];
+    reference.forward(forward, block);
+    reference.inverse(inverse, block);
+    for (size_t k = 1; k < sets.size(); ++k) {
+      int16_t out[64];
+      sets[k].forward(out, block);
+      if (std::memcmp(out, forward, sizeof(out)) != 0)
+        return Fail("Hadamard forward", sets[k].name);
+      sets[k].inverse(out, block);
+      if (std::memcmp(out, inverse, sizeof(out)) != 0)
+        return Fail("Hadamard inverse", sets[k].name);
+    }
+  }
+  return true;
+}
+
+// The number of coefficients (in kIndexLUT order) that fill the top-left 1x1,
+// 2x2, 4x4 and 8x8 corners of a block.
+const int kCornerCoeffs[4] = {1, 4, 16, 64};
+
+// Random blocks in coefficient plane order (see
+// Hadamard::InverseLanesSparse()), and the expected result (the per-block
+// scalar inverse transform). The nonzero coefficients of each block lie within
+// a random corner, up to kCornerCoeffs[max_corner]. If near_16_bits is true,
+// the coefficients are limited to the 16-bit range, or to one step beyond it
+// (so that the lane chunks use the 16-bit paths, or only just miss them).
+struct LaneBlocks {
+  LaneBlocks(int num_blocks, int max_corner, bool near_16_bits)
+      : count(num_blocks),
+        stride(num_blocks + RandomInt(0, 16)),
+        planes(64 * stride),
+        expected(64 * stride),
+        last_nonzero(num_blocks) {
+    const Hadamard::KernelSet reference =
+        Hadamard::SupportedKernelSets()[0];
+    const int limit = kMax16BitCoeff + RandomInt(0, 1);
+    for (int u = 0; u < count; ++u) {
+      int16_t block[64];
+      RandomBlock(block);
+      if (near_16_bits) {
+        for (int i = 0; i < 64; ++i) {
+          block[i] = static_cast<int16_t>(std::min(
+              std::max(static_cast<int>(block[i]), -limit), limit));
+        }
+      }
+      const int corner_coeffs = kCornerCoeffs[RandomInt(0, max_corner)];
+      TruncateBlock(block,
+                    RandomInt(0, 1) ? corner_coeffs
+                                    : RandomInt(1, corner_coeffs));
+      last_nonzero[u] = 0;
+      for (int i = 0; i < 64; ++i) {
+        if (block[kIndexLUT[i]] != 0)
+          last_nonzero[u] = static_cast<uint8_t>(i);
+      }
+
+      int16_t out[64];
+      reference.inverse(out, block);
+      for (int i = 0; i < 64; ++i) {
+        planes[i * stride + u] = block[i];
+        expected[i * stride + u] = out[i];
+      }
+    }
+  }
+
+  bool Check() const {
+    for (int i = 0; i < 64; ++i) {
+      if (!std::equal(&planes[i * stride],
+                      &planes[i * stride + count],
+                      &expected[i * stride])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const int count;
+  const int stride;
+  std::vector<int16_t> planes;
+  std::vector<int16_t> expected;
+  std::vector<uint8_t> last_nonzero;
+};
+
+bool TestHadamardLanes() {
+  const std::vector<Hadamard::KernelSet> sets =
+      Hadamard::SupportedKernelSets();
+  int num_blocks = 0;
+  while (num_blocks < kNumRandomBlocks) {
+    // Use counts around multiples of the lane chunk size, and chunks with
+    // and without blocks that require 32-bit precision.
+    const int count = RandomInt(0, 1) == 0 ? RandomInt(1, 200)
+                                           : 64 * RandomInt(1, 3) +
+                                                 RandomInt(-1, 1);
+    const bool near_16_bits = RandomInt(0, 1) == 0;
+    num_blocks += 5 * count;
+
+    // All the kernels of all the instruction sets.
+    for (int corner = 0; corner < 4; ++corner) {
+      const LaneBlocks blocks(count, corner, near_16_bits);
+      for (size_t k = 0; k < sets.size(); ++k) {
+        LaneBlocks result = blocks;
+        sets[k].inverse_lanes[corner](
+            result.planes.data(), result.stride, result.count);
+        if (!result.Check())
+          return Fail("Hadamard inverse lanes", sets[k].name);
+      }
+    }
+
+    // The public sparse version (with the dispatched kernels), for blocks of
+    // mixed sparsity.
+    LaneBlocks blocks(count, 3, near_16_bits);
+    Hadamard::InverseLanesSparse(
+        blocks.planes.data(), blocks.stride, count, blocks.last_nonzero.data());
+    if (!blocks.Check())
+      return Fail("Hadamard sparse inverse lanes", "dispatched");
+  }
+  return true;
+}
+
+// Fill a buffer with random bytes.
+void RandomBytes(std::vector<uint8_t> *buffer) {
+  for (uint8_t &x : *buffer)
+    x = static_cast<uint8_t>(RandomInt(0, 255));
+}
+
+bool TestColorConversion() {
+  const std::vector<YCbCr::KernelSet> sets = YCbCr::SupportedKernelSets();
+  const YCbCr::KernelSet &reference = sets[0];
+
+  // A few bytes after the pixels must be left untouched.
+  const int kGuardSize = 16;
+
+  for (int n = 0; n < 1000; ++n) {
+    // All the tail lengths (of up to 32 pixels per iteration), and some
+    // longer runs.
+    const int count = n < 300 ? n : RandomInt(300, 5000);
+    for (int c = 0; c < 2; ++c) {
+      const int size = count * (3 + c);
+      std::vector<uint8_t> in(size + kGuardSize);
+      RandomBytes(&in);
+
+      std::vector<uint8_t> expected_ycbcr(in.size(), 0);
+      reference.to_ycbcr[c](expected_ycbcr.data(), in.data(), count);
+      std::vector<uint8_t> expected_rgb(in);
+      reference.to_rgb[c](expected_rgb.data(), count);
+
+      for (size_t k = 1; k < sets.size(); ++k) {
+        std::vector<uint8_t> out(in.size(), 0);
+        sets[k].to_ycbcr[c](out.data(), in.data(), count);
+        if (out != expected_ycbcr)
+          return Fail("RGB to YCbCr", sets[k].name);
+
+        out = in;
+        sets[k].to_rgb[c](out.data(), count);
+        if (out != expected_rgb)
+          return Fail("YCbCr to RGB", sets[k].name);
+      }
+    }
+  }
+  return true;
+}
+
+// The 16-bit version of YCbCr::YCbCrToRGB() clamps its input to 8 bits, but
+// not its output, so it must give the same results as the 8-bit version
+// (before clamping).
+bool TestColorConversion16Bit() {
+  const YCbCr::KernelSet reference = YCbCr::SupportedKernelSets()[0];
+  for (int n = 0; n < kNumRandomBlocks; ++n) {
+    int16_t in[3];
+    uint8_t rgb[3];
+    for (int c = 0; c < 3; ++c) {
+      switch (RandomInt(0, 3)) {
+        case 0:
+          in[c] = static_cast<int16_t>(RandomInt(-32768, 32767));
+          break;
+        case 1:
+          in[c] = static_cast<int16_t>(RandomInt(-300, 600));
+          break;
+        default:
+          in[c] = static_cast<int16_t>(RandomInt(0, 255));
+      }
+      rgb[c] = ClampTo8Bit(in[c]);
+    }
+    reference.to_rgb[0](rgb, 1);
+
+    int16_t r = in[0], g = in[1], b = in[2];
+    YCbCr::YCbCrToRGB(&r, &g, &b, 1);
+    const int cb = 2 * ClampTo8Bit(in[1]) - 255;
+    const int cr = 2 * ClampTo8Bit(in[2]) - 255;
+    if (ClampTo8Bit(r) != rgb[0] || ClampTo8Bit(g) != rgb[1] ||
+        ClampTo8Bit(b) != rgb[2] || r - g != cr || b - g != cb) {
+      return Fail("16-bit YCbCr to RGB", reference.name);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+}  // namespace himg
+
+int main() {
+  struct Test {
+    const char *name;
+    bool (*run)();
+  };
+  static const Test kTests[] = {
+    { "Hadamard blocks", himg::TestHadamardBlocks },
+    { "Hadamard lanes", himg::TestHadamardLanes },
+    { "Color conversion", himg::TestColorConversion },
+    { "16-bit color conversion", himg::TestColorConversion16Bit }
+  };
+
+  bool success = true;
+  for (const Test &test : kTests) {
+    std::cout << test.name << "... " << std::flush;
+    bool passed = test.run();
+    std::cout << (passed ? "OK" : "FAILED") << "\n";
+    success = success && passed;
+  }
+  return success ? 0 : 1;
+}
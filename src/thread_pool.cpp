@@ -0,0 +1,148 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace himg {
+
+namespace {
+
+// Shared state for one ParallelFor() call. It is reference counted, since
+// helper tasks may start after the call has returned (they then find no work
+// left to do).
+struct ParallelForState {
+  ParallelForState(int count, const std::function<void(int)> &fn)
+      : fn(fn), count(count), next(0), done(0) {}
+
+  // Run calls until there are no more indices left.
+  void Run() {
+    int finished = 0;
+    while (true) {
+      int i = next.fetch_add(1);
+      if (i >= count)
+        break;
+      fn(i);
+      ++finished;
+    }
+    if (finished > 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      done += finished;
+      if (done == count)
+        all_done.notify_all();
+    }
+  }
+
+  const std::function<void(int)> &fn;
+  const int count;
+  std::atomic_int next;
+  int done;
+  std::mutex mutex;
+  std::condition_variable all_done;
+};
+
+}  // namespace
+
+ThreadPool::ThreadPool(int num_threads) : m_stop(false) {
+  if (num_threads <= 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 0; i < num_threads; ++i)
+    m_threads.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_task_available.notify_all();
+  for (auto &thread : m_threads)
+    thread.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks.push_back(std::move(task));
+  }
+  m_task_available.notify_one();
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)> &fn) {
+  if (count <= 0)
+    return;
+
+  // Start one helper task per worker thread (but no more than needed),
+  // counting the current thread as one of the helpers.
+  std::shared_ptr<ParallelForState> state(new ParallelForState(count, fn));
+  int helpers = std::min(count, num_threads());
+  for (int i = 0; i < helpers - 1; ++i)
+    Submit([state]() { state->Run(); });
+  state->Run();
+
+  // Wait for all the calls to finish (the helpers may still be running).
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->all_done.wait(lock,
+                       [&state, count]() { return state->done == count; });
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_task_available.wait(lock,
+                            [this]() { return m_stop || !m_tasks.empty(); });
+      if (m_tasks.empty())
+        return;
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+    task();
+  }
+}
+
+void RunParallel(ThreadPool *pool,
+                 int count,
+                 int max_threads,
+                 const std::function<void(int)> &fn) {
+  if (pool) {
+    pool->ParallelFor(count, fn);
+    return;
+  }
+
+  // One worker core lambda is run in each worker thread.
+  std::atomic_int next(0);
+  auto worker_core = [&next, &fn, count]() {
+    while (true) {
+      int i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count)
+        break;
+      fn(i);
+    }
+  };
+
+  // Start the worker threads (we start N - 1 new threads, and run one worker
+  // in the current thread).
+  int worker_threads = std::min(count, max_threads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < worker_threads - 1; ++i)
+    threads.push_back(std::thread(worker_core));
+
+  // One worker is always run in the current thread.
+  worker_core();
+
+  // Wait for all the worker threads to finish.
+  for (auto &thread : threads)
+    thread.join();
+}
+
+}  // namespace himg
@@ -0,0 +1,62 @@
+//-----------------------------------------------------------------------------
+// HIMG, by Marcus Geelnard, 2015
+//
+// This is free and unencumbered software released into the public domain.
+//
+// See LICENSE for details.
+//-----------------------------------------------------------------------------
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace himg {
+
+// A fixed set of worker threads that run queued tasks in FIFO order.
+class ThreadPool {
+ public:
+  // If num_threads is zero, one thread per hardware thread is started.
+  ThreadPool(int num_threads = 0);
+
+  // Runs all the queued tasks before stopping the worker threads.
+  ~ThreadPool();
+
+  // Queue a task for execution by one of the worker threads.
+  void Submit(std::function<void()> task);
+
+  // Call fn(i) for all i in [0, count), using the worker threads and the
+  // calling thread, and return when all calls have finished. It is safe to
+  // call this from a task that is running in the pool (the calling thread
+  // does all the work if no worker thread is available).
+  void ParallelFor(int count, const std::function<void(int)> &fn);
+
+  int num_threads() const { return static_cast<int>(m_threads.size()); }
+
+ private:
+  void WorkerLoop();
+
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_task_available;
+  std::deque<std::function<void()>> m_tasks;
+  bool m_stop;
+};
+
+// Call fn(i) for all i in [0, count), and return when all calls have
+// finished. If pool is not null, the calls are run with pool->ParallelFor().
+// Otherwise up to max_threads - 1 new threads are started for the duration of
+// the call, and the calling thread does its share of the work.
+void RunParallel(ThreadPool *pool,
+                 int count,
+                 int max_threads,
+                 const std::function<void(int)> &fn);
+
+}  // namespace himg
+
+#endif  // THREAD_POOL_H_
@@ -8,7 +8,14 @@
 
 #include "ycbcr.h"
 
+#include <algorithm>
+
 #include "common.h"
+#include "cpu.h"
+
+#if CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
 
 namespace himg {
 
@@ -21,7 +28,9 @@ namespace himg {
 //   B = G + Cb
 //   R = G + Cr
 
-void YCbCr::RGBToYCbCr(uint8_t *out,
+namespace {
+
+void RGBToYCbCrDefault(uint8_t *out,
                        const uint8_t *in,
                        int width,
                        int height,
@@ -51,10 +60,12 @@ void YCbCr::RGBToYCbCr(uint8_t *out,
   }
 }
 
-void YCbCr::YCbCrToRGB(uint8_t *buf,
-                       int width,
-                       int height,
-                       int num_channels) {
+// If kNumChannels is non-zero, it overrides num_channels (so that the pixel
+// stride is known at compile time).
+template <int kNumChannels>
+void YCbCrToRGBImpl(uint8_t *buf, int width, int height, int num_channels) {
+  if (kNumChannels > 0)
+    num_channels = kNumChannels;
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
       // Convert YCbCr -> RGB.
@@ -81,4 +92,416 @@ void YCbCr::YCbCrToRGB(uint8_t *buf,
   }
 }
 
+// The conversion of count pixels with kNumChannels channels (3 or 4, where
+// the fourth channel is kept as is), for the kernels below.
+typedef void (*ToYCbCrFun)(uint8_t *out, const uint8_t *in, int count);
+typedef void (*ToRGBFun)(uint8_t *buf, int count);
+
+template <int kNumChannels>
+void ToYCbCrDefault(uint8_t *out, const uint8_t *in, int count) {
+  RGBToYCbCrDefault(out, in, count, 1, kNumChannels, kNumChannels);
+}
+
+template <int kNumChannels>
+void ToRGBDefault(uint8_t *buf, int count) {
+  YCbCrToRGBImpl<kNumChannels>(buf, count, 1, kNumChannels);
+}
+
+#if CPU_DISPATCH_X86
+// Vectors of 16-bit values (GCC vector extensions). All the intermediate
+// values of the conversions fit in 16 bits, so the lanes give the same
+// results as the int16_t arithmetic of the scalar versions.
+typedef int16_t V8HI __attribute__((vector_size(16)));
+typedef int16_t V16HI __attribute__((vector_size(32)));
+
+// The same as RGBToYCbCrDefault(), for one pixel per lane: x[0], x[1] and
+// x[2] hold R, G and B, and are replaced by Y, Cb and Cr.
+template <typename V>
+FORCE_INLINE void RGBToYCbCrLanes(V *x) {
+  const V r = x[0];
+  const V g = x[1];
+  const V b = x[2];
+  x[0] = (r + 2 * g + b + 2) >> 2;
+  x[1] = (b - g + 256) >> 1;
+  x[2] = (r - g + 256) >> 1;
+}
+
+// The same as YCbCrToRGBImpl() (without the clamping), for one pixel per
+// lane: x[0], x[1] and x[2] hold Y, Cb and Cr, and are replaced by R, G and B.
+template <typename V>
+FORCE_INLINE void YCbCrToRGBLanes(V *x) {
+  const V y = x[0];
+  const V cb = (x[1] << 1) - 255;
+  const V cr = (x[2] << 1) - 255;
+  const V g = y - ((cb + cr + 2) >> 2);
+  x[0] = g + cr;
+  x[1] = g;
+  x[2] = g + cb;
+}
+
+// Shuffle masks for de-interleaving 16 pixels with three channels, stored in
+// three registers. Channel c is the bitwise or of the registers k shuffled
+// with kDeinterleave3[c][k].
+const int8_t kDeinterleave3[3][3][16] = {
+    {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+    {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+    {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}}};
+
+// The reverse of kDeinterleave3: Register k is the bitwise or of the channels
+// c shuffled with kInterleave3[k][c].
+const int8_t kInterleave3[3][3][16] = {
+    {{0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+     {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+     {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1}},
+    {{-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+     {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+     {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1}},
+    {{-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+     {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+     {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15}}};
+
+// Shuffle mask for grouping the bytes of four pixels with four channels by
+// channel (and back, since the shuffle is its own inverse).
+const int8_t kTranspose4[16] = {
+    0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15};
+
+// SSSE3: 16 pixels per iteration, in kNumChannels registers (one register per
+// channel after de-interleaving), and two registers of 16-bit values per
+// channel for the conversion.
+
+TARGET_SSSE3 FORCE_INLINE __m128i LoadMaskSSSE3(const int8_t *mask) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask));
+}
+
+// x[k] = the bitwise or of the registers y[c] shuffled with masks[c].
+TARGET_SSSE3 FORCE_INLINE __m128i Shuffle3SSSE3(const __m128i *y,
+                                                const int8_t (*masks)[16]) {
+  return _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(y[0], LoadMaskSSSE3(masks[0])),
+                   _mm_shuffle_epi8(y[1], LoadMaskSSSE3(masks[1]))),
+      _mm_shuffle_epi8(y[2], LoadMaskSSSE3(masks[2])));
+}
+
+// Transpose a 4x4 matrix of 32-bit values (one row per register).
+TARGET_SSSE3 FORCE_INLINE void Transpose4x4SSSE3(__m128i *x) {
+  const __m128i t0 = _mm_unpacklo_epi32(x[0], x[1]);
+  const __m128i t1 = _mm_unpacklo_epi32(x[2], x[3]);
+  const __m128i t2 = _mm_unpackhi_epi32(x[0], x[1]);
+  const __m128i t3 = _mm_unpackhi_epi32(x[2], x[3]);
+  x[0] = _mm_unpacklo_epi64(t0, t1);
+  x[1] = _mm_unpackhi_epi64(t0, t1);
+  x[2] = _mm_unpacklo_epi64(t2, t3);
+  x[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+// Convert the (de-interleaved) channels x[0], x[1] and x[2].
+template <bool kToYCbCr>
+TARGET_SSSE3 FORCE_INLINE void ConvertSSSE3(__m128i *x) {
+  const __m128i zero = _mm_setzero_si128();
+  V8HI lo[3];
+  V8HI hi[3];
+  for (int c = 0; c < 3; ++c) {
+    lo[c] = (V8HI)_mm_unpacklo_epi8(x[c], zero);
+    hi[c] = (V8HI)_mm_unpackhi_epi8(x[c], zero);
+  }
+  if (kToYCbCr) {
+    RGBToYCbCrLanes(lo);
+    RGBToYCbCrLanes(hi);
+  } else {
+    YCbCrToRGBLanes(lo);
+    YCbCrToRGBLanes(hi);
+  }
+
+  // Note: The saturating pack does the clamping of YCbCrToRGBImpl() (the
+  // RGBToYCbCr() values are always within [0, 255]).
+  for (int c = 0; c < 3; ++c) {
+    x[c] = _mm_packus_epi16((__m128i)lo[c], (__m128i)hi[c]);
+  }
+}
+
+template <int kNumChannels, bool kToYCbCr>
+TARGET_SSSE3 FORCE_INLINE void Convert16SSSE3(uint8_t *out,
+                                              const uint8_t *in) {
+  __m128i x[kNumChannels];
+  for (int k = 0; k < kNumChannels; ++k)
+    x[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[16 * k]));
+
+  if (kNumChannels == 3) {
+    __m128i y[3];
+    for (int c = 0; c < 3; ++c)
+      y[c] = Shuffle3SSSE3(x, kDeinterleave3[c]);
+    ConvertSSSE3<kToYCbCr>(y);
+    for (int k = 0; k < 3; ++k)
+      x[k] = Shuffle3SSSE3(y, kInterleave3[k]);
+  } else {
+    const __m128i mask = LoadMaskSSSE3(kTranspose4);
+    for (int k = 0; k < 4; ++k)
+      x[k] = _mm_shuffle_epi8(x[k], mask);
+    Transpose4x4SSSE3(x);
+    ConvertSSSE3<kToYCbCr>(x);
+    Transpose4x4SSSE3(x);
+    for (int k = 0; k < 4; ++k)
+      x[k] = _mm_shuffle_epi8(x[k], mask);
+  }
+
+  for (int k = 0; k < kNumChannels; ++k)
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[16 * k]), x[k]);
+}
+
+template <int kNumChannels>
+TARGET_SSSE3 void ToYCbCrSSSE3(uint8_t *out, const uint8_t *in, int count) {
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    Convert16SSSE3<kNumChannels, true>(&out[i * kNumChannels],
+                                       &in[i * kNumChannels]);
+  }
+  ToYCbCrDefault<kNumChannels>(
+      &out[i * kNumChannels], &in[i * kNumChannels], count - i);
+}
+
+template <int kNumChannels>
+TARGET_SSSE3 void ToRGBSSSE3(uint8_t *buf, int count) {
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    Convert16SSSE3<kNumChannels, false>(&buf[i * kNumChannels],
+                                        &buf[i * kNumChannels]);
+  }
+  ToRGBDefault<kNumChannels>(&buf[i * kNumChannels], count - i);
+}
+
+// AVX2: The same as SSSE3, for 32 pixels per iteration (since the shuffles
+// work within 128-bit lanes, the low and the high lanes hold 16 pixels each).
+
+TARGET_AVX2 FORCE_INLINE __m256i LoadMaskAVX2(const int8_t *mask) {
+  return _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask)));
+}
+
+TARGET_AVX2 FORCE_INLINE __m256i Shuffle3AVX2(const __m256i *y,
+                                              const int8_t (*masks)[16]) {
+  return _mm256_or_si256(
+      _mm256_or_si256(_mm256_shuffle_epi8(y[0], LoadMaskAVX2(masks[0])),
+                      _mm256_shuffle_epi8(y[1], LoadMaskAVX2(masks[1]))),
+      _mm256_shuffle_epi8(y[2], LoadMaskAVX2(masks[2])));
+}
+
+TARGET_AVX2 FORCE_INLINE void Transpose4x4AVX2(__m256i *x) {
+  const __m256i t0 = _mm256_unpacklo_epi32(x[0], x[1]);
+  const __m256i t1 = _mm256_unpacklo_epi32(x[2], x[3]);
+  const __m256i t2 = _mm256_unpackhi_epi32(x[0], x[1]);
+  const __m256i t3 = _mm256_unpackhi_epi32(x[2], x[3]);
+  x[0] = _mm256_unpacklo_epi64(t0, t1);
+  x[1] = _mm256_unpackhi_epi64(t0, t1);
+  x[2] = _mm256_unpacklo_epi64(t2, t3);
+  x[3] = _mm256_unpackhi_epi64(t2, t3);
+}
+
+template <bool kToYCbCr>
+TARGET_AVX2 FORCE_INLINE void ConvertAVX2(__m256i *x) {
+  const __m256i zero = _mm256_setzero_si256();
+  V16HI lo[3];
+  V16HI hi[3];
+  for (int c = 0; c < 3; ++c) {
+    lo[c] = (V16HI)_mm256_unpacklo_epi8(x[c], zero);
+    hi[c] = (V16HI)_mm256_unpackhi_epi8(x[c], zero);
+  }
+  if (kToYCbCr) {
+    RGBToYCbCrLanes(lo);
+    RGBToYCbCrLanes(hi);
+  } else {
+    YCbCrToRGBLanes(lo);
+    YCbCrToRGBLanes(hi);
+  }
+  for (int c = 0; c < 3; ++c) {
+    x[c] = _mm256_packus_epi16((__m256i)lo[c], (__m256i)hi[c]);
+  }
+}
+
+template <int kNumChannels, bool kToYCbCr>
+TARGET_AVX2 FORCE_INLINE void Convert32AVX2(uint8_t *out, const uint8_t *in) {
+  // The low lanes hold the first 16 pixels, and the high lanes the next 16.
+  const int kHighOffset = 16 * kNumChannels;
+  __m256i x[kNumChannels];
+  for (int k = 0; k < kNumChannels; ++k) {
+    const __m128i lo =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[16 * k]));
+    const __m128i hi = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(&in[kHighOffset + 16 * k]));
+    x[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+  }
+
+  if (kNumChannels == 3) {
+    __m256i y[3];
+    for (int c = 0; c < 3; ++c)
+      y[c] = Shuffle3AVX2(x, kDeinterleave3[c]);
+    ConvertAVX2<kToYCbCr>(y);
+    for (int k = 0; k < 3; ++k)
+      x[k] = Shuffle3AVX2(y, kInterleave3[k]);
+  } else {
+    const __m256i mask = LoadMaskAVX2(kTranspose4);
+    for (int k = 0; k < 4; ++k)
+      x[k] = _mm256_shuffle_epi8(x[k], mask);
+    Transpose4x4AVX2(x);
+    ConvertAVX2<kToYCbCr>(x);
+    Transpose4x4AVX2(x);
+    for (int k = 0; k < 4; ++k)
+      x[k] = _mm256_shuffle_epi8(x[k], mask);
+  }
+
+  for (int k = 0; k < kNumChannels; ++k) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[16 * k]),
+                     _mm256_castsi256_si128(x[k]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[kHighOffset + 16 * k]),
+                     _mm256_extracti128_si256(x[k], 1));
+  }
+}
+
+template <int kNumChannels>
+TARGET_AVX2 void ToYCbCrAVX2(uint8_t *out, const uint8_t *in, int count) {
+  int i = 0;
+  for (; i + 32 <= count; i += 32) {
+    Convert32AVX2<kNumChannels, true>(&out[i * kNumChannels],
+                                      &in[i * kNumChannels]);
+  }
+  ToYCbCrDefault<kNumChannels>(
+      &out[i * kNumChannels], &in[i * kNumChannels], count - i);
+}
+
+template <int kNumChannels>
+TARGET_AVX2 void ToRGBAVX2(uint8_t *buf, int count) {
+  int i = 0;
+  for (; i + 32 <= count; i += 32) {
+    Convert32AVX2<kNumChannels, false>(&buf[i * kNumChannels],
+                                       &buf[i * kNumChannels]);
+  }
+  ToRGBDefault<kNumChannels>(&buf[i * kNumChannels], count - i);
+}
+#endif  // CPU_DISPATCH_X86
+
+// The conversion kernels for three and four channels, selected at run time.
+struct ColorKernels {
+  ColorKernels() {
+#if CPU_DISPATCH_X86
+    if (CPU::HasAVX2()) {
+      to_ycbcr3 = ToYCbCrAVX2<3>;
+      to_ycbcr4 = ToYCbCrAVX2<4>;
+      to_rgb3 = ToRGBAVX2<3>;
+      to_rgb4 = ToRGBAVX2<4>;
+      return;
+    }
+    if (CPU::HasSSSE3()) {
+      to_ycbcr3 = ToYCbCrSSSE3<3>;
+      to_ycbcr4 = ToYCbCrSSSE3<4>;
+      to_rgb3 = ToRGBSSSE3<3>;
+      to_rgb4 = ToRGBSSSE3<4>;
+      return;
+    }
+#endif
+    to_ycbcr3 = ToYCbCrDefault<3>;
+    to_ycbcr4 = ToYCbCrDefault<4>;
+    to_rgb3 = ToRGBDefault<3>;
+    to_rgb4 = ToRGBDefault<4>;
+  }
+
+  ToYCbCrFun to_ycbcr3;
+  ToYCbCrFun to_ycbcr4;
+  ToRGBFun to_rgb3;
+  ToRGBFun to_rgb4;
+};
+
+const ColorKernels &GetColorKernels() {
+  static const ColorKernels kernels;
+  return kernels;
+}
+
+}  // namespace
+
+void YCbCr::RGBToYCbCr(uint8_t *out,
+                       const uint8_t *in,
+                       int width,
+                       int height,
+                       int pixel_stride,
+                       int num_channels) {
+  // The kernels require packed pixels (which is the common case).
+  if (pixel_stride == num_channels) {
+    const ColorKernels &kernels = GetColorKernels();
+    if (num_channels == 3) {
+      kernels.to_ycbcr3(out, in, width * height);
+      return;
+    }
+    if (num_channels == 4) {
+      kernels.to_ycbcr4(out, in, width * height);
+      return;
+    }
+  }
+  RGBToYCbCrDefault(out, in, width, height, pixel_stride, num_channels);
+}
+
+void YCbCr::YCbCrToRGB(uint8_t *buf,
+                       int width,
+                       int height,
+                       int num_channels) {
+  if (num_channels == 3)
+    GetColorKernels().to_rgb3(buf, width * height);
+  else if (num_channels == 4)
+    GetColorKernels().to_rgb4(buf, width * height);
+  else
+    YCbCrToRGBImpl<0>(buf, width, height, num_channels);
+}
+
+std::vector<YCbCr::KernelSet> YCbCr::SupportedKernelSets() {
+  std::vector<KernelSet> sets;
+  KernelSet set;
+  set.name = "scalar";
+  set.to_ycbcr[0] = ToYCbCrDefault<3>;
+  set.to_ycbcr[1] = ToYCbCrDefault<4>;
+  set.to_rgb[0] = ToRGBDefault<3>;
+  set.to_rgb[1] = ToRGBDefault<4>;
+  sets.push_back(set);
+
+#if CPU_DISPATCH_X86
+  if (CPU::HasSSSE3()) {
+    set.name = "SSSE3";
+    set.to_ycbcr[0] = ToYCbCrSSSE3<3>;
+    set.to_ycbcr[1] = ToYCbCrSSSE3<4>;
+    set.to_rgb[0] = ToRGBSSSE3<3>;
+    set.to_rgb[1] = ToRGBSSSE3<4>;
+    sets.push_back(set);
+  }
+  if (CPU::HasAVX2()) {
+    set.name = "AVX2";
+    set.to_ycbcr[0] = ToYCbCrAVX2<3>;
+    set.to_ycbcr[1] = ToYCbCrAVX2<4>;
+    set.to_rgb[0] = ToRGBAVX2<3>;
+    set.to_rgb[1] = ToRGBAVX2<4>;
+    sets.push_back(set);
+  }
+#endif
+
+  return sets;
+}
+
+void YCbCr::YCbCrToRGB(int16_t *y_r,
+                       int16_t *cb_g,
+                       int16_t *cr_b,
+                       int count) {
+  for (int i = 0; i < count; ++i) {
+    int16_t y = std::min<int16_t>(std::max<int16_t>(y_r[i], 0), 255);
+    int16_t cb = std::min<int16_t>(std::max<int16_t>(cb_g[i], 0), 255);
+    int16_t cr = std::min<int16_t>(std::max<int16_t>(cr_b[i], 0), 255);
+    cb = (cb << 1) - 255;
+    cr = (cr << 1) - 255;
+    int16_t g = y - ((cb + cr + 2) >> 2);
+    y_r[i] = g + cr;
+    cb_g[i] = g;
+    cr_b[i] = g + cb;
+  }
+}
+
 }  // namespace himg
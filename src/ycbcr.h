@@ -10,6 +10,7 @@
 #define YCBCR_H_
 
 #include <cstdint>
+#include <vector>
 
 namespace himg {
 
@@ -26,6 +27,24 @@ class YCbCr {
                          int width,
                          int height,
                          int num_channels);
+
+  // Convert separate 16-bit channels from YCbCr to RGB, in place. The YCbCr
+  // values are clamped to 8 bits first (just as for the 8-bit version), but
+  // the RGB values are not clamped.
+  static void YCbCrToRGB(int16_t *y_r, int16_t *cb_g, int16_t *cr_b, int count);
+
+  // The kernels for one instruction set, which convert count packed pixels
+  // with three or four channels (index 0 and 1, respectively).
+  struct KernelSet {
+    const char *name;
+    void (*to_ycbcr[2])(uint8_t *out, const uint8_t *in, int count);
+    void (*to_rgb[2])(uint8_t *buf, int count);
+  };
+
+  // Get the kernels of all the instruction sets that the CPU supports,
+  // starting with the scalar reference code (for testing that the SIMD
+  // kernels give identical results).
+  static std::vector<KernelSet> SupportedKernelSets();
 };
 
 }  // namespace himg